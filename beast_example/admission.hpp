@@ -0,0 +1,88 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <utility>
+
+// Admission control for the listeners.
+//
+// A gate caps the number of sessions. Once it is full the listener stops
+// accepting and tries again every pace() until a session has finished, so
+// the excess connections wait in the kernel's accept queue (which is kept
+// as short as the cap) instead of each taking a descriptor and a session.
+//
+// Connections are also shed by their queueing delay: when the first request
+// of a connection is only read long after the connection was accepted, the
+// server is already behind, and the cheapest thing it can do is answer 503
+// and close, rather than add to the work of the requests it has admitted.
+
+namespace admission {
+
+using clock = std::chrono::steady_clock;
+
+class gate
+{
+  public:
+  // Zero means no limit
+  void configure(std::size_t max_sessions, clock::duration max_queue_delay)
+  {
+    max_sessions_ = max_sessions;
+    max_queue_delay_ = max_queue_delay;
+  }
+
+  std::size_t max_sessions() const noexcept { return max_sessions_; }
+
+  // Count a new session in, unless there are max_sessions already
+  bool try_enter() noexcept
+  {
+    auto const n = active_.fetch_add(1, std::memory_order_relaxed);
+    if (max_sessions_ == 0 || n < max_sessions_) return true;
+
+    active_.fetch_sub(1, std::memory_order_relaxed);
+    return false;
+  }
+
+  void leave() noexcept { active_.fetch_sub(1, std::memory_order_relaxed); }
+
+  // How long to wait before trying to enter again
+  static constexpr clock::duration pace() { return std::chrono::milliseconds(1); }
+
+  // Should a connection accepted at 'accepted' be turned away now?
+  bool overdue(clock::time_point accepted) const noexcept
+  {
+    return max_queue_delay_ != clock::duration::zero() &&
+           clock::now() - accepted > max_queue_delay_;
+  }
+
+  private:
+  std::atomic<std::size_t> active_{0};
+  std::size_t max_sessions_ = 0;
+  clock::duration max_queue_delay_{};
+};
+
+// Leaves the gate on behalf of a session that has entered it, once the
+// session is done with (or when it is moved over by another pass)
+class pass
+{
+  gate* gate_ = nullptr;
+
+  public:
+  pass() = default;
+  explicit pass(gate& g) noexcept : gate_(&g) {}
+
+  pass(pass&& other) noexcept : gate_(std::exchange(other.gate_, nullptr)) {}
+
+  pass& operator=(pass&& other) noexcept
+  {
+    if (this != &other) {
+      if (gate_) gate_->leave();
+      gate_ = std::exchange(other.gate_, nullptr);
+    }
+    return *this;
+  }
+
+  ~pass() { if (gate_) gate_->leave(); }
+};
+
+} // namespace admission
@@ -1,62 +1,476 @@
 #include <boost/beast/core.hpp>
 #include <boost/beast/http.hpp>
+#include <boost/beast/websocket.hpp>
 #include <boost/asio/strand.hpp>
 
+#include "admission.hpp"
+#include "broadcast.hpp"
+#include "command_line.hpp"
+#include "handlers.hpp"
+#include "metrics.hpp"
+#include "pipeline.hpp"
+#include "rate_limit.hpp"
+#include "recycling_allocator.hpp"
+#include "request_arena.hpp"
+#include "static_files.hpp"
+#include "streaming.hpp"
+#include "timing_wheel.hpp"
+
+#include <array>
+#include <atomic>
+#include <cstdlib>
 #include <iostream>
 #include <thread>
 #include <format>
+#include <memory>
+#include <new>
+#include <optional>
+#include <sstream>
+#include <utility>
+#include <vector>
+
+#include <pthread.h>
+#include <sched.h>
 
 namespace beast = boost::beast;
 namespace http = beast::http;
+namespace websocket = beast::websocket;
 namespace asio = boost::asio;
 using tcp = boost::asio::ip::tcp;
 
+// How long a connection may take to send its next request, or to make room
+// for more of a response
+constexpr auto idle_timeout = std::chrono::seconds(30);
+
 void error(beast::error_code ec, char const* what)
 {
   std::cerr << std::format("Error: {} : {}\n", what, ec.message());
   return;
 };
 
+// With --alloc-stats every global heap allocation is counted, to check that
+// accepting and serving connections no longer touches the heap once the
+// session pool and the recycling caches have warmed up
+std::atomic<bool> count_heap{false};
+std::atomic<std::uint64_t> heap_allocations{0};
+
+void* operator new(std::size_t size)
+{
+  if(count_heap.load(std::memory_order_relaxed))
+    heap_allocations.fetch_add(1, std::memory_order_relaxed);
+
+  if(void* p = std::malloc(size ? size : 1)) return p;
+  throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+
+// Bind a completion handler to the per-thread recycling allocator, so the
+// state of the operation is allocated from (and returned to) the pool
+template <class Handler>
+auto recycled(Handler&& handler)
+{
+  return asio::bind_allocator(
+      recycling::allocator<void>{}, std::forward<Handler>(handler));
+}
+
+// The routes' responses are shared by every session (and serialized once)
+handlers::context app{"Boost.Beast", "Hello ACCU 2023 from the Asynchronous Server!"};
+
+// Limits the sessions (see --max-sessions and --max-queue-delay)
+admission::gate gate;
+
+// Limits each client's request rate (see --rate-limit and --rate-burst)
+rate_limit::limiter limiter;
+
+// Every WebSocket connection is subscribed to the hub (see --ws-queue)
+broadcast::hub hub;
+
+// With --idle-release a session gives up its buffer and request arena
+// between requests, and waits for the connection to become readable before
+// taking them back
+bool idle_release = false;
+
+// A WebSocket connection, subscribed to the hub until it closes. Every
+// message the client sends is published to all of the subscribers.
+class ws_session
+  : public broadcast::subscriber
+  , public std::enable_shared_from_this<ws_session>
+{
+  websocket::stream<beast::tcp_stream> ws_;
+  beast::flat_buffer buffer_;
+  broadcast::queue queue_;
+  bool joined_ = false;
+  bool evicted_ = false;
+
+  // The connection keeps its place in the gate
+  admission::pass pass_;
+
+  public:
+  ws_session(tcp::socket&& socket, admission::pass pass)
+    : ws_(std::move(socket))
+    , queue_(hub.max_queue())
+    , pass_(std::move(pass))
+  {
+  }
+
+  ~ws_session()
+  {
+    if(joined_) hub.leave(*this);
+  }
+
+  // Answer the upgrade request, which (like 'rest', what the session had
+  // read after it) is only used before this returns
+  template <class Request>
+  void
+    run(Request const& req, asio::const_buffer rest)
+    {
+      ws_.set_option(websocket::stream_base::timeout::suggested(
+          beast::role_type::server));
+      ws_.text(true);
+
+      auto handler = recycled(beast::bind_front_handler(
+            &ws_session::on_accept,
+            shared_from_this()));
+
+      // Frames that the client sent straight after its upgrade request are
+      // only taken along with the request, so the request is written out
+      // again for the stream to parse (which fails if they do not fit in
+      // its read buffer)
+      if(rest.size()) {
+        std::ostringstream header;
+        header << req.base();
+        auto const h = std::move(header).str();
+        ws_.async_accept(
+            std::array<asio::const_buffer, 2>{asio::buffer(h), rest},
+            std::move(handler));
+      }
+      else
+        ws_.async_accept(req, std::move(handler));
+    }
+
+  // Called by the hub, on any thread
+  void
+    deliver(broadcast::message const& m) override
+    {
+      auto self = weak_from_this().lock();
+      if(!self) return;
+
+      asio::post(ws_.get_executor(),
+          recycled([self = std::move(self), m] { self->on_deliver(m); }));
+    }
+
+  private:
+  void
+    on_accept(beast::error_code ec)
+    {
+      if(ec) return error(ec, "accept");
+
+      hub.join(*this);
+      joined_ = true;
+
+      do_read();
+    }
+
+  void
+    do_read()
+    {
+      ws_.async_read(buffer_,
+          recycled(beast::bind_front_handler(
+            &ws_session::on_read,
+            shared_from_this())));
+    }
+
+  void
+    on_read(beast::error_code ec, std::size_t)
+    {
+      // This means they closed the connection
+      if(ec == websocket::error::closed) return;
+      if(ec) {
+        if(!evicted_) error(ec, "read");
+        return;
+      }
+
+      hub.publish({static_cast<char const*>(buffer_.data().data()),
+                   buffer_.size()});
+      buffer_.consume(buffer_.size());
+
+      do_read();
+    }
+
+  void
+    on_deliver(broadcast::message const& m)
+    {
+      if(evicted_) return;
+
+      // A full queue means that the client is not keeping up, so drop it
+      // rather than let the messages pile up
+      if(!queue_.push(m)) {
+        evicted_ = true;
+        hub.evicted();
+        beast::error_code ec;
+        beast::get_lowest_layer(ws_).socket().close(ec);
+        return;
+      }
+
+      // Unless a write is already in progress
+      if(queue_.size() == 1) do_write();
+    }
+
+  void
+    do_write()
+    {
+      ws_.async_write(asio::buffer(*queue_.front()),
+          recycled(beast::bind_front_handler(
+            &ws_session::on_write,
+            shared_from_this())));
+    }
+
+  void
+    on_write(beast::error_code ec, std::size_t)
+    {
+      if(ec) {
+        if(!evicted_) error(ec, "write");
+        return;
+      }
+
+      queue_.pop();
+      if(!queue_.empty()) do_write();
+    }
+};
+
 // Handles an HTTP server connection
+//
+// Sessions are pooled: when the last reference to a session goes away it
+// is reset and kept by the releasing thread, so the next connection reuses
+// its stream, timer, strand and buffer instead of allocating new ones.
 class session : public std::enable_shared_from_this<session>
 {
+  asio::io_context& ioc_;
   beast::tcp_stream stream_;
-  beast::flat_buffer buffer_;
-  http::request<http::string_body> req_;
+  beast::basic_flat_buffer<recycling::allocator<char>> buffer_;
+  std::unique_ptr<arena::request_arena> arena_;
+  pipeline::response_batch<http::string_body> batch_;
+
+  // Counts the connection and times its requests while it is open (see
+  // metrics.hpp)
+  std::optional<metrics::connection> conn_;
+
+  // The session's place in the gate, and when its connection was accepted
+  admission::pass pass_;
+  admission::clock::time_point accepted_;
+  bool first_request_ = true;
+
+  // Whose rate the requests count against (see --rate-limit)
+  asio::ip::address client_;
+
+  // With --idle-wheel the idle timeout is kept by the io_context's timing
+  // wheel (see timing_wheel.hpp) instead of the stream's own timer. The
+  // session stays in the wheel for as long as its connection is open, and
+  // each read, write or step of a transfer touches it.
+  std::optional<idle::entry> idle_;
+
+  // Where the request that ended the current batch is to be forwarded
+  // (see --proxy)
+  proxy::upstream* upstream_ = nullptr;
+
+  // A thread's idle sessions
+  using pool_type = std::vector<std::unique_ptr<session>>;
+  static constexpr std::size_t max_pooled = 1024;
+
+  static pool_type& pool()
+  {
+    thread_local pool_type idle;
+    return idle;
+  }
 
   public:
-  // Take ownership of the stream
+  // In sharded mode the session uses its shard's io_context directly,
+  // otherwise it gets its own strand
   session(
-      tcp::socket&& socket)
-    : stream_(std::move(socket))
+      asio::io_context& ioc,
+      bool sharded,
+      idle::timing_wheel* wheel)
+    : ioc_(ioc)
+    , stream_(sharded ? asio::any_io_executor(ioc.get_executor())
+                      : asio::make_strand(ioc))
   {
+    if(wheel)
+      idle_.emplace(*wheel, &session::on_idle, this);
+    if(!idle_release)
+      arena_ = arena::acquire();
   }
 
+  // Get a session for a new connection, preferring a pooled one
+  static std::shared_ptr<session>
+    create(asio::io_context& ioc, bool sharded, idle::timing_wheel* wheel)
+    {
+      auto& idle = pool();
+      auto& stats = recycling::local_stats();
+      session* s = nullptr;
+
+      // A pooled session is tied to its io_context, so it can only be used
+      // for the same one (which is always the case once running), and so
+      // is its wheel
+      if(!idle.empty() && &idle.back()->ioc_ == &ioc) {
+        s = idle.back().release();
+        idle.pop_back();
+        stats.sessions_reused.store(
+            stats.sessions_reused.load(std::memory_order_relaxed) + 1,
+            std::memory_order_relaxed);
+      } else {
+        s = new session(ioc, sharded, wheel);
+        stats.sessions_created.store(
+            stats.sessions_created.load(std::memory_order_relaxed) + 1,
+            std::memory_order_relaxed);
+      }
+
+      // The control block is recycled too
+      return std::shared_ptr<session>(
+          s, &session::recycle, recycling::allocator<session>{});
+    }
+
+  // The socket that the listener accepts the connection into
+  tcp::socket& socket() { return stream_.socket(); }
+
   // Start the asynchronous operation
   void
-    run()
+    run(
+        admission::pass pass,
+        admission::clock::time_point accepted,
+        asio::ip::address client)
     {
+      pass_ = std::move(pass);
+      accepted_ = accepted;
+      client_ = client;
+      first_request_ = true;
+
+      // Responses are coalesced by the session, so Nagle would only
+      // delay the tail of a batch that needs more than one writev
+      beast::error_code ec;
+      stream_.socket().set_option(tcp::no_delay(true), ec);
+
+      conn_.emplace(accepted);
+
+      if(idle_) idle_->start();
+
       asio::dispatch(stream_.get_executor(),
-          beast::bind_front_handler(
+          recycled(beast::bind_front_handler(
             &session::do_read,
-            shared_from_this()));
+            shared_from_this())));
     }
 
+  private:
+  // Called instead of delete once the connection is finished with. The
+  // buffers keep their capacity, so the next connection starts warm.
+  static void
+    recycle(session* s)
+    {
+      std::unique_ptr<session> owned(s);
+
+      if(s->idle_) s->idle_->stop();
+      s->stream_.close();
+      s->conn_.reset();
+      s->pass_ = {};
+      s->buffer_.clear();
+      s->batch_.clear();
+      if(idle_release)
+        s->release_storage();
+      else
+        s->arena_->renew();
+
+      auto& idle = pool();
+      if(idle.size() < max_pooled)
+        idle.push_back(std::move(owned));
+    }
+
+  // The wheel found the connection idle. This runs on the wheel's thread,
+  // while the session may be about to be recycled by another, so it only
+  // holds on to the session (if it can) to close the socket on its own
+  // executor.
+  static void
+    on_idle(void* context)
+    {
+      auto self = static_cast<session*>(context)->weak_from_this().lock();
+      if(!self) return;
+
+      auto ex = self->stream_.get_executor();
+      asio::post(ex, [self = std::move(self)] {
+          beast::error_code ec;
+          self->stream_.socket().close(ec);
+        });
+    }
+
+  // How long a write or a wait for the client may take
+  deadline::limit
+    send_limit()
+    {
+      if(idle_) return *idle_;
+      return idle_timeout;
+    }
+
+  // Return the buffer's storage to the thread's recycling cache and the
+  // arena to the thread's spares, for as long as the connection is idle
+  void
+    release_storage()
+    {
+      buffer_.shrink_to_fit();
+      arena::release(std::move(arena_));
+    }
+
+  public:
   void
     do_read()
     {
-      // Make the request empty before reading,
-      // otherwise the operation behavior is undefined.
-      req_ = {};
+      // Set the timeout
+      if(idle_)
+        idle_->touch();
+      else
+        stream_.expires_after(idle_timeout);
+
+      // Unless the last read brought (part of) the next request already,
+      // wait for it without holding any memory for it. This wait is not
+      // one of the stream's operations, so only the wheel times it out.
+      if(idle_release && buffer_.size() == 0) {
+        release_storage();
+        stream_.socket().async_wait(tcp::socket::wait_read,
+            recycled(beast::bind_front_handler(
+              &session::on_readable,
+              shared_from_this())));
+        return;
+      }
+
+      read_request();
+    }
+
+  void
+    on_readable(beast::error_code ec)
+    {
+      // The idle wheel closed the connection
+      if(ec == asio::error::operation_aborted) return;
+
+      if(ec) return error(ec, "wait");
 
-      // Set the timeout.
-      stream_.expires_after(std::chrono::seconds(30));
+      read_request();
+    }
+
+  void
+    read_request()
+    {
+      if(!arena_)
+        arena_ = arena::acquire();
+
+      // Make the request empty before reading, otherwise the operation
+      // behavior is undefined. This also releases the previous request's
+      // memory back to the arena.
+      auto& req = arena_->renew();
 
       // Read a request
-      http::async_read(stream_, buffer_, req_,
-          beast::bind_front_handler(
+      http::async_read(stream_, buffer_, req,
+          recycled(beast::bind_front_handler(
             &session::on_read,
-            shared_from_this()));
+            shared_from_this())));
     }
 
   void
@@ -64,8 +478,6 @@ class session : public std::enable_shared_from_this<session>
         beast::error_code ec,
         std::size_t bytes_transferred)
     {
-      boost::ignore_unused(bytes_transferred);
-
       // This means they closed the connection
       if(ec == http::error::end_of_stream) {
         stream_.socket().shutdown(tcp::socket::shutdown_send, ec);
@@ -74,22 +486,75 @@ class session : public std::enable_shared_from_this<session>
 
       if(ec) return error(ec, "read");
 
-      // Send the response
-      auto handle_request = [this]() -> http::message_generator {
-        http::response<http::string_body> res{
-          http::status::ok, req_.version()};
-        res.set(http::field::server, "Boost.Beast");
-        res.body() = "Hello ACCU 2023 from the Asynchronous Server!";
-        res.prepare_payload();
-        res.keep_alive(req_.keep_alive());
-        return res;
+      if(idle_) idle_->touch();
+
+      // Queue the response to the request (see handlers.hpp), or a 503 if
+      // the connection had waited too long for it to be read (admission.hpp),
+      // or a 429 if the client is over its rate, upgrades included
+      // (rate_limit.hpp). A request for an upstream is left to be forwarded
+      // instead, once the responses before it have been sent, and ends the
+      // batch. So does an upgrade, which is only taken as the first request
+      // of a batch.
+      bool upgrade = false;
+      auto handle_request = [this, &upgrade](std::size_t size) {
+        conn_->read(size);
+        if(std::exchange(first_request_, false) && gate.overdue(accepted_)) {
+          handlers::shed(app, arena_->get(), batch_);
+          conn_->shed();
+        }
+        else if(limiter.enabled() &&
+                !limiter.allow(client_, rate_limit::clock::now())) {
+          handlers::limited(app, arena_->get(), batch_);
+          conn_->limited();
+        }
+        else if(batch_.size() == 0 && websocket::is_upgrade(arena_->get())) {
+          upgrade = true;
+          return false;
+        }
+        else if((upstream_ = handlers::proxied(app, arena_->get())))
+          return false;
+        else
+          handlers::handle(app, arena_->get(), batch_);
+        conn_->handled();
+        return true;
       };
 
-      beast::async_write(
+      // Answer this request plus any pipelined requests that have already
+      // arrived, stopping at the first one that closes the connection
+      if(handle_request(bytes_transferred)) {
+        while(batch_.keep_alive() && !batch_.full()) {
+          auto const n = pipeline::read_buffered(buffer_, arena_->renew());
+          if(!n || !handle_request(n)) break;
+        }
+      }
+
+      // An upgrade hands the connection over to a WebSocket session, which
+      // takes its place in the gate as well
+      if(upgrade) {
+        if(idle_) idle_->stop();
+        std::make_shared<ws_session>(
+            stream_.release_socket(), std::move(pass_))->run(
+              arena_->get(), buffer_.data());
+        return;
+      }
+
+      // Sending the responses can take longer than the idle timeout, and
+      // is fine for as long as the client keeps reading. In the wheel, the
+      // session is touched whenever some of them have been written. Without
+      // it, the sendfile, the streamed response and the proxy give each
+      // wait for the client a time limit of its own (see deadline.hpp).
+      if(batch_.size() == 0) return do_proxy();
+
+      // Send all of the responses with one gathered write
+      asio::async_write(
           stream_,
-          handle_request(),
-          beast::bind_front_handler(
-            &session::on_write, shared_from_this()));
+          batch_.buffers(),
+          [this](beast::error_code const& ec, std::size_t n) {
+            if(idle_) idle_->touch();
+            return asio::transfer_all()(ec, n);
+          },
+          recycled(beast::bind_front_handler(
+            &session::on_write, shared_from_this())));
     }
 
   void
@@ -97,28 +562,144 @@ class session : public std::enable_shared_from_this<session>
         beast::error_code ec,
         std::size_t bytes_transferred)
     {
-      boost::ignore_unused(bytes_transferred);
-
       if(ec) return error(ec, "write");
 
-      stream_.socket().shutdown(tcp::socket::shutdown_send, ec);
-      // Read another request
+      conn_->wrote(bytes_transferred);
+
+      // A large file's contents follow its header
+      if(auto* file = batch_.file()) {
+        static_files::async_sendfile(
+            stream_.socket(),
+            *file,
+            send_limit(),
+            recycled(beast::bind_front_handler(
+              &session::on_sendfile, shared_from_this())));
+        return;
+      }
+
+      // A streamed response follows the others, header and all
+      if(auto* res = batch_.stream()) {
+        streaming::async_write(
+            stream_.socket(),
+            *res,
+            send_limit(),
+            recycled(beast::bind_front_handler(
+              &session::on_streamed, shared_from_this())));
+        return;
+      }
+
+      on_sent();
+    }
+
+  void
+    on_sendfile(
+        beast::error_code ec,
+        std::size_t bytes_transferred)
+    {
+      if(ec) return error(ec, "sendfile");
+
+      conn_->wrote(bytes_transferred);
+
+      on_sent();
+    }
+
+  void
+    on_streamed(
+        beast::error_code ec,
+        std::size_t bytes_transferred)
+    {
+      if(ec) return error(ec, "stream");
+
+      conn_->wrote(bytes_transferred);
+
+      on_sent();
+    }
+
+  void
+    on_sent()
+    {
+      conn_->sent();
+
+      bool keep_alive = batch_.keep_alive();
+      batch_.clear();
+
+      // Determine if we should close the connection
+      if(!keep_alive) {
+        beast::error_code ec;
+        stream_.socket().shutdown(tcp::socket::shutdown_send, ec);
+        return;
+      }
+
+      // Forward the request that ended the batch, or read another
+      if(upstream_) return do_proxy();
+      do_read();
+    }
+
+  void
+    do_proxy()
+    {
+      // The upstream connections are pooled per thread, so they use the
+      // io_context rather than the session's strand (see proxy.hpp)
+      proxy::async_forward(
+          *std::exchange(upstream_, nullptr),
+          stream_,
+          arena_->get(),
+          ioc_.get_executor(),
+          idle_ ? send_limit() : proxy::upstream::io_timeout,
+          asio::bind_executor(stream_.get_executor(),
+            recycled(beast::bind_front_handler(
+              &session::on_proxied, shared_from_this()))));
+    }
+
+  void
+    on_proxied(beast::error_code ec, bool keep_alive)
+    {
+      if(ec) return error(ec, "proxy");
+
+      conn_->handled();
+      conn_->sent();
+
+      if(!keep_alive) {
+        stream_.socket().shutdown(tcp::socket::shutdown_send, ec);
+        return;
+      }
+
       do_read();
     }
 };
 
+// SO_REUSEPORT lets every shard bind its own acceptor to the same port and
+// have the kernel spread the incoming connections between them
+using reuse_port = asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+
 // Accepts incoming connections and launches the sessions
 class listener : public std::enable_shared_from_this<listener>
 {
   asio::io_context& ioc_;
   tcp::acceptor acceptor_;
+  asio::steady_timer pacer_;
+  bool sharded_;
+  idle::timing_wheel* wheel_;
+
+  // The session that the next connection is accepted into, and its place
+  // in the gate
+  std::shared_ptr<session> next_;
+  admission::pass pass_;
 
   public:
+  // In sharded mode the io_context is only ever run by one thread, so the
+  // acceptor and the sessions can use it directly instead of a strand
   listener(
       asio::io_context& ioc,
-      tcp::endpoint endpoint)
+      tcp::endpoint endpoint,
+      bool sharded = false,
+      idle::timing_wheel* wheel = nullptr)
     : ioc_(ioc)
-      , acceptor_(asio::make_strand(ioc))
+      , acceptor_(sharded ? asio::any_io_executor(ioc.get_executor())
+                          : asio::make_strand(ioc))
+      , pacer_(acceptor_.get_executor())
+      , sharded_(sharded)
+      , wheel_(wheel)
   {
     beast::error_code ec;
 
@@ -130,13 +711,22 @@ class listener : public std::enable_shared_from_this<listener>
     acceptor_.set_option(asio::socket_base::reuse_address(true), ec);
     if(ec) error(ec, "set_option");
 
+    // Let the other shards share the port
+    if(sharded_) {
+      acceptor_.set_option(reuse_port(true), ec);
+      if(ec) error(ec, "set_option");
+    }
+
     // Bind to the server address
     acceptor_.bind(endpoint, ec);
     if(ec) error(ec, "bind");
 
-    // Start listening for connections
+    // Start listening for connections. With a session limit the kernel's
+    // queue is kept as short, so that the connections waiting for a
+    // session are not queued for long either.
     acceptor_.listen(
-        asio::socket_base::max_listen_connections, ec);
+        gate.max_sessions() ? int(gate.max_sessions())
+                            : asio::socket_base::max_listen_connections, ec);
     if(ec) error(ec, "listen");
   }
 
@@ -150,34 +740,215 @@ class listener : public std::enable_shared_from_this<listener>
   void
     do_accept()
     {
-      // The new connection gets its own strand
+      // At the session limit, leave the connections queued in the kernel
+      // and try again shortly
+      if(!gate.try_enter()) {
+        pacer_.expires_after(admission::gate::pace());
+        pacer_.async_wait(
+            recycled(beast::bind_front_handler(
+              &listener::on_pace,
+              shared_from_this())));
+        return;
+      }
+      pass_ = admission::pass(gate);
+
+      // Accept straight into a (usually recycled) session's socket
+      next_ = session::create(ioc_, sharded_, wheel_);
+
       acceptor_.async_accept(
-          asio::make_strand(ioc_),
-          beast::bind_front_handler(
+          next_->socket(),
+          recycled(beast::bind_front_handler(
             &listener::on_accept,
-            shared_from_this()));
+            shared_from_this())));
     }
 
   void
-    on_accept(beast::error_code ec, tcp::socket socket)
+    on_pace(beast::error_code ec)
     {
-      if(ec) error(ec, "accept");
+      if(!ec) do_accept();
+    }
 
-      // Create the session and run it
-      std::make_shared<session>(
-          std::move(socket))->run();
+  void
+    on_accept(beast::error_code ec)
+    {
+      // Running out of descriptors is no reason to stop accepting, but
+      // there is no point in trying again straight away
+      if(ec) {
+        error(ec, "accept");
+        next_.reset();
+        pass_ = {};
+
+        pacer_.expires_after(admission::gate::pace());
+        pacer_.async_wait(
+            recycled(beast::bind_front_handler(
+              &listener::on_pace,
+              shared_from_this())));
+        return;
+      }
+
+      // Run the session (or just drop it back into the pool). The new
+      // connections of a client that is over its rate are closed straight
+      // away, and so are those whose peer is already gone (rather than
+      // charged to an unspecified address that every client would share).
+      auto const now = admission::clock::now();
+      asio::ip::address client;
+      if(limiter.enabled())
+        client = next_->socket().remote_endpoint(ec).address();
+
+      if(limiter.enabled() && (ec || limiter.exhausted(client, now)))
+        next_->socket().close(ec);
+      else
+        next_->run(std::move(pass_), now, client);
+
+      next_.reset();
+      pass_ = {};
 
       // Accept another connection
       do_accept();
     };
 };
 
+// Periodically report the allocation counters (see --alloc-stats)
+class alloc_reporter : public std::enable_shared_from_this<alloc_reporter>
+{
+  asio::steady_timer timer_;
+  std::uint64_t last_heap_ = 0;
+  std::uint64_t last_connections_ = 0;
+
+  public:
+  explicit alloc_reporter(asio::io_context& ioc)
+    : timer_(ioc)
+  {
+    count_heap = true;
+  }
+
+  void
+    run()
+    {
+      timer_.expires_after(std::chrono::seconds(5));
+      timer_.async_wait(
+          [self = shared_from_this()](beast::error_code ec) {
+            if(ec) return;
+            self->report();
+            self->run();
+          });
+    }
+
+  private:
+  void
+    report()
+    {
+      auto const t = recycling::read_stats();
+      auto const heap = heap_allocations.load(std::memory_order_relaxed);
+      auto const connections = t.sessions_created + t.sessions_reused;
+
+      std::cerr << std::format(
+          "Allocations: heap {} ({} in the last {} connections), "
+          "recycled {}, recycling misses {}, "
+          "sessions created {}, reused {}\n",
+          heap, heap - last_heap_, connections - last_connections_,
+          t.recycled, t.heap, t.sessions_created, t.sessions_reused);
+
+      last_heap_ = heap;
+      last_connections_ = connections;
+    }
+};
+
+// Pin the calling thread to a single CPU
+void pin_to_cpu(unsigned cpu)
+{
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu % std::max(1u, std::thread::hardware_concurrency()), &set);
+
+  if (auto rc = pthread_setaffinity_np(pthread_self(), sizeof(set), &set))
+    error(beast::error_code(rc, beast::system_category()), "pin");
+}
+
+// Thread-per-core layout: each thread runs its own io_context with its own
+// listener on the shared port, so there is no reactor lock contention and a
+// connection's handlers never migrate between cores
+void run_sharded(
+    tcp::endpoint endpoint,
+    int num_threads,
+    bool pin_cpus,
+    bool alloc_stats,
+    bool idle_wheel)
+{
+  std::vector<std::unique_ptr<asio::io_context>> shards;
+  for (auto i = 0; i < num_threads; ++i)
+    shards.push_back(std::make_unique<asio::io_context>(1));
+
+  // Each shard keeps its own connections' idle timeouts
+  std::vector<std::unique_ptr<idle::timing_wheel>> wheels;
+  if (idle_wheel)
+    for (auto& ioc : shards) {
+      wheels.push_back(std::make_unique<idle::timing_wheel>(
+          ioc->get_executor(), idle_timeout));
+      wheels.back()->run();
+    }
+
+  if (alloc_stats)
+    std::make_shared<alloc_reporter>(*shards[0])->run();
+
+  metrics::dump_on_signal(*shards[0]);
+
+  // Create all the listeners up front so that every shard is bound before
+  // any of them starts accepting
+  for (std::size_t i = 0; i < shards.size(); ++i)
+    std::make_shared<listener>(*shards[i], endpoint, true,
+        idle_wheel ? wheels[i].get() : nullptr)->run();
+
+  std::vector<std::thread> v;
+  for (auto i = 1; i < num_threads; ++i)
+    v.emplace_back([&ioc = *shards[i], i, pin_cpus]{
+        if (pin_cpus) pin_to_cpu(i);
+        ioc.run();
+      });
+
+  // Use the main thread as the first shard
+  if (pin_cpus) pin_to_cpu(0);
+  shards[0]->run();
+
+  for (auto& t : v) t.join();
+}
+
 int main(int argc, char *argv[])
 {
-  if (argc != 4) {
+  command_line options(argc, argv, 4);
+
+  if (argc < 4 || !options.positional().empty() ||
+      options.unknown({"sharded", "pin-cpus", "alloc-stats", "doc-root",
+                       "max-sessions", "max-queue-delay", "idle-wheel",
+                       "idle-release", "ws-queue", "proxy", "proxy-idle",
+                       "rate-limit", "rate-burst", "latency-dump", "trace",
+                       "trace-sample"})) {
     std::cerr << std::format(
-        "Usage: {} <ip-address> <port> <threads>\n"
-        "E.g.: {} 0.0.0.0 8080 2\n",
+        "Usage: {} <ip-address> <port> <threads> [options]\n"
+        "E.g.: {} 0.0.0.0 8080 2\n"
+        "Options:\n"
+        "  --sharded      one io_context and SO_REUSEPORT listener per thread\n"
+        "  --pin-cpus     pin each sharded thread to its own CPU\n"
+        "  --alloc-stats  report heap and pool allocation counts every 5s\n"
+        "  --doc-root=DIR serve the files in DIR for targets without a route\n"
+        "  --max-sessions=N  stop accepting while there are N sessions\n"
+        "  --max-queue-delay=MS  answer 503 to a connection whose first\n"
+        "                 request is read more than MS after accepting it\n"
+        "  --idle-wheel   time out idle connections with a shared timing\n"
+        "                 wheel instead of a timer per connection\n"
+        "  --idle-release free the buffers of idle connections until their\n"
+        "                 next request arrives (implies --idle-wheel)\n"
+        "  --ws-queue=N   messages a WebSocket subscriber may fall behind\n"
+        "                 before it is disconnected (64)\n"
+        "  --proxy=PREFIX=HOST:PORT  forward the targets under PREFIX to\n"
+        "                 HOST:PORT, over pooled keep-alive connections\n"
+        "  --proxy-idle=N idle upstream connections kept per thread (64)\n"
+        "  --rate-limit=R answer 429 to a client's requests beyond R a second\n"
+        "  --rate-burst=N requests a client may make at once (100)\n"
+        "  --latency-dump=FILE  write the phase histograms to FILE on SIGUSR1\n"
+        "  --trace=FILE   write a Chrome trace of the sampled requests to\n"
+        "                 FILE on SIGUSR1\n"
+        "  --trace-sample=N  trace one request in N (1000)\n",
         argv[0], argv[0]
         );
     return EXIT_FAILURE;
@@ -187,11 +958,62 @@ int main(int argc, char *argv[])
   auto const port = static_cast<unsigned short>(std::atoi(argv[2]));
   auto const num_threads = std::max<int>(1, std::atoi(argv[3]));
 
+  if (options.has("doc-root"))
+    app.serve_files(options.get("doc-root", "."));
+
+  gate.configure(options.get("max-sessions", std::size_t(0)),
+      std::chrono::milliseconds(options.get("max-queue-delay", 0)));
+
+  hub.configure(options.get("ws-queue", std::size_t(64)));
+
+  limiter.configure(options.get("rate-limit", 0.0),
+      options.get("rate-burst", std::size_t(100)));
+
+  metrics::configure({options.get("latency-dump", ""),
+      options.get("trace", ""),
+      options.get("trace-sample", std::uint64_t(1000))});
+
+  if (options.has("proxy")) {
+    auto const route = proxy::parse_route(options.get("proxy", ""));
+    if (!route) {
+      std::cerr << "Bad --proxy (expected PREFIX=HOST:PORT)\n";
+      return EXIT_FAILURE;
+    }
+    try {
+      app.proxy_to(*route, options.get("proxy-idle", std::size_t(64)));
+    } catch (std::exception const& e) {
+      std::cerr << std::format("Bad --proxy upstream: {}\n", e.what());
+      return EXIT_FAILURE;
+    }
+  }
+
+  // Only the wheel can time out the wait for an idle connection's request
+  idle_release = options.has("idle-release");
+  auto const idle_wheel = idle_release || options.has("idle-wheel");
+
+  if (options.has("sharded")) {
+    run_sharded(tcp::endpoint{address, port}, num_threads,
+        options.has("pin-cpus"), options.has("alloc-stats"), idle_wheel);
+    return EXIT_SUCCESS;
+  }
+
   asio::io_context ioc{num_threads};
 
+  if (options.has("alloc-stats"))
+    std::make_shared<alloc_reporter>(ioc)->run();
+
+  metrics::dump_on_signal(ioc);
+
+  std::optional<idle::timing_wheel> wheel;
+  if (idle_wheel) {
+    wheel.emplace(ioc.get_executor(), idle_timeout);
+    wheel->run();
+  }
+
   // Create and launch a listening port
   std::make_shared<listener>(
-    ioc, tcp::endpoint{address, port}
+    ioc, tcp::endpoint{address, port}, false,
+    wheel ? &*wheel : nullptr
   )->run();
 
   // Run the IO service with the requested number of threads
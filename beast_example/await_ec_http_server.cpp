@@ -0,0 +1,371 @@
+// The awaitable server without exceptions.
+//
+// await_http_server lets use_awaitable throw a system_error for every
+// failed operation, including the ordinary ones: the client closing its
+// connection (end_of_stream) and the idle timeout. Each of those costs a
+// throw and an unwind through the coroutine frames, on the path that every
+// connection ends with. Here every operation completes with
+// redirect_error(use_awaitable, ec) instead, so the errors come back in
+// 'ec' and the sessions and the listener check them as the callback server
+// does.
+//
+// Asio recycles the coroutine frames through its per-thread cache, which
+// by default keeps two blocks per thread (one before Boost 1.80, where the
+// size cannot be changed), and only blocks of up to 1020 bytes. A session has a frame of its own plus one for each co_await of an
+// operation, so the cache is made larger here to keep them all, and the
+// session's buffer, responses and request arena (several KiB) are kept out
+// of its frame, in a session_state pooled by the thread.
+
+#ifndef BOOST_ASIO_RECYCLING_ALLOCATOR_CACHE_SIZE
+#define BOOST_ASIO_RECYCLING_ALLOCATOR_CACHE_SIZE 8
+#endif
+
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/asio/awaitable.hpp>
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/redirect_error.hpp>
+#include <boost/asio/use_awaitable.hpp>
+
+#include "admission.hpp"
+#include "command_line.hpp"
+#include "handlers.hpp"
+#include "metrics.hpp"
+#include "pipeline.hpp"
+#include "request_arena.hpp"
+#include "static_files.hpp"
+#include "streaming.hpp"
+
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <format>
+#include <utility>
+
+namespace beast = boost::beast;
+namespace http = beast::http;
+namespace asio = boost::asio;
+using tcp = boost::asio::ip::tcp;
+
+// How long a connection may take to send its next request, or to make room
+// for more of a response
+constexpr auto idle_timeout = std::chrono::seconds(30);
+
+void error(beast::error_code ec, char const* what)
+{
+  std::cerr << std::format("Error: {} : {}\n", what, ec.message());
+}
+
+// The routes' responses are shared by every session (and serialized once)
+handlers::context app{"Beast", "Hello ACCU 2023 from the Awaitable Server!"};
+
+// Limits the sessions (see --max-sessions and --max-queue-delay)
+admission::gate gate;
+
+// What a session keeps between its requests. A session holds one by
+// pointer, so that its coroutine frame stays small enough to be recycled.
+struct session_state
+{
+  // This buffer is required to persist across reads
+  beast::flat_buffer buffer;
+
+  pipeline::response_batch<http::string_body> batch;
+
+  // Each request is parsed into memory from this arena, which is reset
+  // (not freed) between requests
+  arena::request_arena arena;
+};
+
+// Gives a session's state back to the spares of the thread that it ends on,
+// emptied but keeping its capacity
+struct state_recycler
+{
+  static std::vector<std::unique_ptr<session_state>>& spare()
+  {
+    thread_local std::vector<std::unique_ptr<session_state>> spare;
+    return spare;
+  }
+
+  void operator()(session_state* s) const
+  {
+    static constexpr std::size_t max_spare = 1024;
+
+    std::unique_ptr<session_state> owned(s);
+    if(spare().size() >= max_spare) return;
+
+    s->buffer.clear();
+    s->batch.clear();
+    s->arena.renew();
+    spare().push_back(std::move(owned));
+  }
+};
+
+using state_ptr = std::unique_ptr<session_state, state_recycler>;
+
+// A state from the calling thread's spares, if it has any
+state_ptr acquire_state()
+{
+  auto& spare = state_recycler::spare();
+  if(spare.empty()) return state_ptr(new session_state);
+
+  state_ptr s(spare.back().release());
+  spare.pop_back();
+  return s;
+}
+
+// Handles an HTTP server connection that was accepted at 'accepted'. The
+// session holds its place in the gate until it returns.
+asio::awaitable<void> do_session(
+    beast::tcp_stream stream,
+    [[maybe_unused]] admission::pass pass,
+    admission::clock::time_point accepted)
+{
+  bool first_request = true;
+
+  // Every operation below reports its error here
+  beast::error_code ec;
+  auto token = asio::redirect_error(asio::use_awaitable, ec);
+
+  // The buffer, the responses and the request arena (see session_state)
+  state_ptr state = acquire_state();
+  auto& [buffer, batch, arena] = *state;
+
+  // Counts the connection and times its requests (see metrics.hpp)
+  metrics::connection conn{accepted};
+
+  // Responses are coalesced below, so Nagle would only delay the tail of
+  // a batch that needs more than one writev
+  stream.socket().set_option(tcp::no_delay(true), ec);
+
+  for(;;) {
+    // Set the timeout.
+    stream.expires_after(idle_timeout);
+
+    // Read a request
+    auto& req = arena.renew();
+    auto const bytes = co_await http::async_read(stream, buffer, req, token);
+
+    // This means they closed the connection
+    if(ec == http::error::end_of_stream) break;
+    if(ec) {
+      error(ec, "read");
+      co_return;
+    }
+
+    // Queue the response to the request (see handlers.hpp), or a 503 if
+    // the connection had waited too long for it to be read (admission.hpp)
+    auto handle_request = [&](std::size_t size) {
+      conn.read(size);
+      if(std::exchange(first_request, false) && gate.overdue(accepted)) {
+        handlers::shed(app, req, batch);
+        conn.shed();
+      }
+      else
+        handlers::handle(app, req, batch);
+      conn.handled();
+    };
+
+    // Answer any pipelined requests that are already buffered as well
+    handle_request(bytes);
+    while(batch.keep_alive() && !batch.full())
+      if(auto const n = pipeline::read_buffered(buffer, arena.renew()))
+        handle_request(n);
+      else
+        break;
+
+    // Send the responses with one gathered write
+    auto const written =
+      co_await asio::async_write(stream, batch.buffers(), token);
+    if(ec) {
+      error(ec, "write");
+      co_return;
+    }
+    conn.wrote(written);
+
+    // A large file's contents follow its header
+    if(auto* file = batch.file()) {
+      auto const sent =
+        co_await static_files::async_sendfile(
+            stream.socket(), *file, idle_timeout, token);
+      if(ec) {
+        error(ec, "sendfile");
+        co_return;
+      }
+      conn.wrote(sent);
+    }
+
+    // A streamed response follows the others, header and all
+    if(auto* res = batch.stream()) {
+      auto const sent =
+        co_await streaming::async_write(
+            stream.socket(), *res, idle_timeout, token);
+      if(ec) {
+        error(ec, "stream");
+        co_return;
+      }
+      conn.wrote(sent);
+    }
+    conn.sent();
+
+    // Determine if we should close the connection
+    bool keep_alive = batch.keep_alive();
+    batch.clear();
+
+    if(!keep_alive) break;
+  }
+
+  // Send a TCP shutdown
+  stream.socket().shutdown(tcp::socket::shutdown_send, ec);
+}
+
+// Accepts incoming connections and launches the sessions
+asio::awaitable<void> do_listen(tcp::endpoint endpoint)
+{
+  beast::error_code ec;
+  auto token = asio::redirect_error(asio::use_awaitable, ec);
+
+  tcp::acceptor acceptor(co_await asio::this_coro::executor);
+
+  // Open the acceptor
+  acceptor.open(endpoint.protocol(), ec);
+  if(ec) {
+    error(ec, "open");
+    co_return;
+  }
+
+  // Allow address reuse
+  acceptor.set_option(asio::socket_base::reuse_address(true), ec);
+  if(ec) {
+    error(ec, "set_option");
+    co_return;
+  }
+
+  // Bind to the server address
+  acceptor.bind(endpoint, ec);
+  if(ec) {
+    error(ec, "bind");
+    co_return;
+  }
+
+  // Start listening for connections. With a session limit the kernel's
+  // queue is kept as short, so that the connections waiting for a session
+  // are not queued for long either.
+  acceptor.listen(
+      gate.max_sessions() ? int(gate.max_sessions())
+                          : asio::socket_base::max_listen_connections, ec);
+  if(ec) {
+    error(ec, "listen");
+    co_return;
+  }
+
+  asio::steady_timer pacer(acceptor.get_executor());
+
+  for(;;) {
+    // At the session limit, leave the connections queued in the kernel
+    // and try again shortly
+    if(!gate.try_enter()) {
+      pacer.expires_after(admission::gate::pace());
+      co_await pacer.async_wait(token);
+      continue;
+    }
+
+    admission::pass pass(gate);
+    auto socket = co_await acceptor.async_accept(token);
+
+    // Running out of descriptors is no reason to stop accepting, but
+    // there is no point in trying again straight away
+    if(ec) {
+      error(ec, "accept");
+      pacer.expires_after(admission::gate::pace());
+      co_await pacer.async_wait(token);
+      continue;
+    }
+
+    boost::asio::co_spawn(
+      acceptor.get_executor(),
+      do_session(beast::tcp_stream(std::move(socket)), std::move(pass),
+          admission::clock::now()),
+      [](std::exception_ptr e)
+      {
+        try
+        {
+          if (e) std::rethrow_exception(e);
+        }
+        catch (std::exception &e) {
+          std::cerr << "Error in session: " << e.what() << "\n";
+        }
+      }
+    );
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  // Check command line arguments.
+  command_line options(argc, argv, 4);
+
+  if (argc < 4 || !options.positional().empty() ||
+      options.unknown({"doc-root", "max-sessions", "max-queue-delay",
+                       "latency-dump", "trace", "trace-sample"})) {
+    std::cerr << std::format(
+      "Usage: {} <ip-address> <port> <threads> [options]\n"
+      "E.g.: {} 0.0.0.0 8080 1\n"
+      "Options:\n"
+      "  --doc-root=DIR serve the files in DIR for targets without a route\n"
+      "  --max-sessions=N  stop accepting while there are N sessions\n"
+      "  --max-queue-delay=MS  answer 503 to a connection whose first\n"
+      "                 request is read more than MS after accepting it\n"
+      "  --latency-dump=FILE  write the phase histograms to FILE on SIGUSR1\n"
+      "  --trace=FILE   write a Chrome trace of the sampled requests to\n"
+      "                 FILE on SIGUSR1\n"
+      "  --trace-sample=N  trace one request in N (1000)\n",
+      argv[0], argv[0]
+    );
+    return EXIT_FAILURE;
+  }
+
+  auto const address = asio::ip::make_address(argv[1]);
+  auto const port = static_cast<unsigned short>(std::atoi(argv[2]));
+  auto const num_threads = std::max<int>(1, std::atoi(argv[3]));
+
+  if (options.has("doc-root"))
+    app.serve_files(options.get("doc-root", "."));
+
+  gate.configure(options.get("max-sessions", std::size_t(0)),
+      std::chrono::milliseconds(options.get("max-queue-delay", 0)));
+
+  metrics::configure({options.get("latency-dump", ""),
+      options.get("trace", ""),
+      options.get("trace-sample", std::uint64_t(1000))});
+
+  // The io_context is required for all I/O
+  asio::io_context ioc{num_threads};
+  metrics::dump_on_signal(ioc);
+
+  // Spawn a listening port
+  boost::asio::co_spawn(ioc,
+    do_listen(tcp::endpoint{address, port}),
+    [](std::exception_ptr e)
+    {
+      try
+      {
+        if (e) std::rethrow_exception(e);
+      }
+      catch(std::exception & e)
+      {
+        std::cerr << "Error in acceptor: " << e.what() << "\n";
+      }
+    }
+  );
+
+  // Run the I/O service on the requested number of threads
+  std::vector<std::thread> v(num_threads-1);
+  for (auto i = num_threads - 1; i; --i)
+    v.emplace_back([&ioc]{ ioc.run(); });
+
+  // Use the main thread as well
+  ioc.run();
+
+  return EXIT_SUCCESS;
+}
@@ -1,16 +1,35 @@
 #include <boost/beast/core.hpp>
 #include <boost/beast/http.hpp>
+#include <boost/beast/websocket.hpp>
 #include <boost/asio/awaitable.hpp>
 #include <boost/asio/co_spawn.hpp>
+#include <boost/asio/redirect_error.hpp>
+#include <boost/asio/strand.hpp>
 #include <boost/asio/use_awaitable.hpp>
 
+#include "admission.hpp"
+#include "broadcast.hpp"
+#include "command_line.hpp"
+#include "handlers.hpp"
+#include "metrics.hpp"
+#include "pipeline.hpp"
+#include "rate_limit.hpp"
+#include "request_arena.hpp"
+#include "static_files.hpp"
+#include "streaming.hpp"
+
+#include <array>
 #include <iostream>
+#include <memory>
+#include <sstream>
 #include <thread>
 #include <vector>
 #include <format>
+#include <utility>
 
 namespace beast = boost::beast;
 namespace http = beast::http;
+namespace websocket = beast::websocket;
 namespace asio = boost::asio;
 using tcp = boost::asio::ip::tcp;
 
@@ -18,49 +37,311 @@ using tcp_stream = typename beast::tcp_stream::rebind_executor<
   asio::use_awaitable_t<>::
     executor_with_default<asio::any_io_executor>>::other;
 
-// Handles an HTTP server connection
-asio::awaitable<void> do_session(tcp_stream stream)
+// How long a connection may take to send its next request, or to make room
+// for more of a response
+constexpr auto idle_timeout = std::chrono::seconds(30);
+
+// The routes' responses are shared by every session (and serialized once)
+handlers::context app{"Beast", "Hello ACCU 2023 from the Awaitable Server!"};
+
+// Limits the sessions (see --max-sessions and --max-queue-delay)
+admission::gate gate;
+
+// Limits each client's request rate (see --rate-limit and --rate-burst)
+rate_limit::limiter limiter;
+
+// Every WebSocket connection is subscribed to the hub (see --ws-queue)
+broadcast::hub hub;
+
+// Report the exception that ended a coroutine, if any
+void log_errors(char const* what, std::exception_ptr e)
+{
+  try
+  {
+    if (e) std::rethrow_exception(e);
+  }
+  catch (std::exception &e) {
+    std::cerr << std::format("Error in {}: {}\n", what, e.what());
+  }
+}
+
+// A WebSocket connection, subscribed to the hub until it closes. Every
+// message the client sends is published to all of the subscribers.
+//
+// Reading and writing are separate coroutines on the connection's strand:
+// the reader publishes what arrives, and the writer sends the queued
+// messages and then waits on a timer that never expires, which deliver()
+// cancels to wake it.
+class ws_subscriber
+  : public broadcast::subscriber
+  , public std::enable_shared_from_this<ws_subscriber>
+{
+  public:
+  // The stream has to have been made on a strand, which its timers and
+  // both coroutines run on
+  ws_subscriber(websocket::stream<tcp_stream> ws, admission::pass pass)
+    : ws_(std::move(ws))
+    , strand_(ws_.get_executor())
+    , wake_(strand_, asio::steady_timer::time_point::max())
+    , queue_(hub.max_queue())
+    , pass_(std::move(pass))
+  {
+  }
+
+  ~ws_subscriber()
+  {
+    hub.leave(*this);
+  }
+
+  // Join the hub and start both coroutines
+  void run()
+  {
+    hub.join(*this);
+
+    // Each completion handler holds the subscriber until its coroutine has
+    // finished
+    asio::co_spawn(strand_, read_loop(),
+        [self = shared_from_this()](std::exception_ptr e) {
+          log_errors("WebSocket read", e);
+        });
+    asio::co_spawn(strand_, write_loop(),
+        [self = shared_from_this()](std::exception_ptr e) {
+          log_errors("WebSocket write", e);
+        });
+  }
+
+  // Called by the hub, on any thread
+  void deliver(broadcast::message const& m) override
+  {
+    auto self = weak_from_this().lock();
+    if (!self) return;
+
+    asio::post(strand_, [self = std::move(self), m] {
+        if (self->closed_) return;
+
+        // A full queue means that the client is not keeping up, so drop
+        // it rather than let the messages pile up
+        if (!self->queue_.push(m)) {
+          hub.evicted();
+          self->close();
+          return;
+        }
+        self->wake_.cancel();
+      });
+  }
+
+  private:
+  // Publish what the client sends until it closes
+  asio::awaitable<void> read_loop()
+  {
+    beast::flat_buffer buffer;
+    try
+    {
+      for(;;) {
+        co_await ws_.async_read(buffer);
+        hub.publish({static_cast<char const*>(buffer.data().data()),
+                     buffer.size()});
+        buffer.consume(buffer.size());
+      }
+    }
+    catch (boost::system::system_error & se)
+    {
+      // This means they closed the connection
+      if (se.code() != websocket::error::closed && !closed_)
+        throw;
+    }
+    close();
+  }
+
+  asio::awaitable<void> write_loop()
+  {
+    beast::error_code ec;
+    while (!closed_) {
+      while (!queue_.empty() && !closed_) {
+        co_await ws_.async_write(asio::buffer(*queue_.front()),
+            asio::redirect_error(asio::use_awaitable, ec));
+        if (ec) co_return close();
+        queue_.pop();
+      }
+
+      co_await wake_.async_wait(asio::redirect_error(asio::use_awaitable, ec));
+    }
+  }
+
+  // Stop both coroutines, whichever of them (or the hub) saw the end first
+  void close()
+  {
+    if (std::exchange(closed_, true)) return;
+
+    beast::error_code ec;
+    beast::get_lowest_layer(ws_).socket().close(ec);
+    wake_.cancel();
+  }
+
+  websocket::stream<tcp_stream> ws_;
+  asio::any_io_executor strand_;
+  asio::steady_timer wake_;
+  broadcast::queue queue_;
+  bool closed_ = false;
+
+  // The connection keeps its place in the gate
+  admission::pass pass_;
+};
+
+// Handles an HTTP server connection that was accepted at 'accepted', whose
+// requests count against the rate of 'client'. The session holds its place
+// in the gate until it returns.
+asio::awaitable<void> do_session(
+    tcp_stream stream,
+    admission::pass pass,
+    admission::clock::time_point accepted,
+    asio::ip::address client)
 {
+  bool first_request = true;
+
   beast::error_code ec;
 
   // This buffer is required to persist across reads
   beast::flat_buffer buffer;
 
+  pipeline::response_batch<http::string_body> batch;
+
+  // Each request is parsed into memory from this arena, which is reset
+  // (not freed) between requests
+  arena::request_arena arena;
+
+  // Counts the connection and times its requests (see metrics.hpp)
+  metrics::connection conn{accepted};
+
+  // Responses are coalesced below, so Nagle would only delay the tail of
+  // a batch that needs more than one writev
+  stream.socket().set_option(tcp::no_delay(true), ec);
+
   for(;;) {
     try
     {
       // Set the timeout.
-      stream.expires_after(std::chrono::seconds(30));
+      stream.expires_after(idle_timeout);
 
       // Read a request
-      http::request<http::string_body> req;
-      co_await http::async_read(stream, buffer, req);
-
-      // Handle the request
-      auto handle_request = [&req]() -> http::message_generator {
-        http::response<http::string_body> res{
-          http::status::ok,
-            req.version()
-        };
-        res.set(http::field::server, "Beast");
-        res.body() = "Hello ACCU 2023 from the Awaitable Server!";
-        res.prepare_payload();
-        res.keep_alive(req.keep_alive());
-        return res;
+      auto& req = arena.renew();
+      auto const bytes = co_await http::async_read(stream, buffer, req);
+
+      // Queue the response to the request (see handlers.hpp), or a 503 if
+      // the connection had waited too long for it to be read (admission.hpp),
+      // or a 429 if the client is over its rate, upgrades included
+      // (rate_limit.hpp). A request for an upstream is left to be forwarded
+      // instead, once the responses before it have been sent, and ends the
+      // batch. So does an upgrade, which is only taken as the first request
+      // of a batch.
+      proxy::upstream* upstream = nullptr;
+      bool upgrade = false;
+      auto handle_request = [&](std::size_t size) {
+        conn.read(size);
+        if(std::exchange(first_request, false) && gate.overdue(accepted)) {
+          handlers::shed(app, req, batch);
+          conn.shed();
+        }
+        else if(limiter.enabled() &&
+                !limiter.allow(client, rate_limit::clock::now())) {
+          handlers::limited(app, req, batch);
+          conn.limited();
+        }
+        else if(batch.size() == 0 && websocket::is_upgrade(req)) {
+          upgrade = true;
+          return false;
+        }
+        else if((upstream = handlers::proxied(app, req)))
+          return false;
+        else
+          handlers::handle(app, req, batch);
+        conn.handled();
+        return true;
       };
 
-      // Send response
-      co_await beast::async_write(
-        stream, handle_request(), asio::use_awaitable
-      );
+      // Answer any pipelined requests that are already buffered as well
+      if(handle_request(bytes)) {
+        while(batch.keep_alive() && !batch.full()) {
+          auto const n = pipeline::read_buffered(buffer, arena.renew());
+          if(!n || !handle_request(n)) break;
+        }
+      }
+
+      // An upgrade hands the connection over to a WebSocket subscriber,
+      // which takes its place in the gate as well
+      if(upgrade) {
+        // The stream's timeout and ping timers run on its own executor, so
+        // that has to be the subscriber's strand (and not the io_context,
+        // where they could run alongside its coroutines). A socket keeps
+        // its executor, so the connection is moved onto a new socket made
+        // on a strand. This also leaves the HTTP timeout behind, which
+        // would otherwise still cut the connection off 30 seconds from now.
+        auto const protocol = stream.socket().local_endpoint().protocol();
+        websocket::stream<tcp_stream> ws(
+            asio::make_strand(asio::any_io_executor(stream.get_executor())));
+        beast::get_lowest_layer(ws).socket().assign(
+            protocol, stream.release_socket().release());
+
+        ws.set_option(websocket::stream_base::timeout::suggested(
+            beast::role_type::server));
+        ws.text(true);
+
+        // Frames that the client sent straight after its upgrade request
+        // may already be in the buffer. The stream only takes those along
+        // with the request, so the request is written out again for it to
+        // parse (which fails if they do not fit in its read buffer).
+        if(buffer.size()) {
+          std::ostringstream header;
+          header << req.base();
+          auto const h = std::move(header).str();
+          co_await ws.async_accept(std::array<asio::const_buffer, 2>{
+              asio::buffer(h), buffer.data()});
+        }
+        else
+          co_await ws.async_accept(req);
+
+        std::make_shared<ws_subscriber>(std::move(ws), std::move(pass))->run();
+        co_return;
+      }
+
+      if(batch.size()) {
+        // Send the responses with one gathered write
+        conn.wrote(co_await asio::async_write(stream, batch.buffers()));
+
+        // A large file's contents follow its header
+        if(auto* file = batch.file())
+          conn.wrote(co_await static_files::async_sendfile(
+              stream.socket(), *file, idle_timeout, asio::use_awaitable));
+
+        // A streamed response follows the others, header and all
+        if(auto* res = batch.stream())
+          conn.wrote(co_await streaming::async_write(
+              stream.socket(), *res, idle_timeout, asio::use_awaitable));
+        conn.sent();
+      }
 
       // Determine if we should close the connection
-      if(!req.keep_alive()) break;
+      bool keep_alive = batch.keep_alive();
+      batch.clear();
+
+      // Forward the request that ended the batch, on upstream connections
+      // pooled by the thread (see proxy.hpp)
+      if(upstream) {
+        keep_alive = co_await proxy::async_forward(*upstream, stream, req,
+            co_await asio::this_coro::executor, proxy::upstream::io_timeout,
+            asio::use_awaitable);
+        conn.handled();
+        conn.sent();
+      }
+
+      if(!keep_alive) break;
     }
     catch (boost::system::system_error & se)
     {
       if (se.code() != http::error::end_of_stream)
         throw;
+
+      break;
     }
   }
 
@@ -83,13 +364,55 @@ asio::awaitable<void> do_listen(tcp::endpoint endpoint)
   // Bind to the server address
   acceptor.bind(endpoint);
 
-  // Start listening for connections
-  acceptor.listen(asio::socket_base::max_listen_connections);
+  // Start listening for connections. With a session limit the kernel's
+  // queue is kept as short, so that the connections waiting for a session
+  // are not queued for long either.
+  acceptor.listen(
+      gate.max_sessions() ? int(gate.max_sessions())
+                          : asio::socket_base::max_listen_connections);
+
+  auto pacer = asio::use_awaitable.as_default_on(
+    asio::steady_timer(acceptor.get_executor())
+  );
+
+  for(;;) {
+    // At the session limit, leave the connections queued in the kernel
+    // and try again shortly
+    if(!gate.try_enter()) {
+      pacer.expires_after(admission::gate::pace());
+      co_await pacer.async_wait();
+      continue;
+    }
+
+    admission::pass pass(gate);
+    beast::error_code ec;
+    auto socket = co_await acceptor.async_accept(
+        asio::redirect_error(asio::use_awaitable, ec));
+
+    // Running out of descriptors is no reason to stop accepting, but
+    // there is no point in trying again straight away
+    if(ec) {
+      std::cerr << std::format("Error in accept: {}\n", ec.message());
+      pacer.expires_after(admission::gate::pace());
+      co_await pacer.async_wait();
+      continue;
+    }
+
+    auto const now = admission::clock::now();
+
+    // The new connections of a client that is over its rate are closed
+    // straight away, and so are those whose peer is already gone (rather
+    // than charged to an unspecified address that every client would share)
+    asio::ip::address client;
+    if(limiter.enabled()) {
+      client = socket.remote_endpoint(ec).address();
+      if(ec || limiter.exhausted(client, now)) continue;
+    }
 
-  for(;;)
     boost::asio::co_spawn(
       acceptor.get_executor(),
-      do_session(tcp_stream(co_await acceptor.async_accept())),
+      do_session(tcp_stream(std::move(socket)), std::move(pass), now,
+          client),
       [](std::exception_ptr e)
       {
         try
@@ -101,15 +424,38 @@ asio::awaitable<void> do_listen(tcp::endpoint endpoint)
         }
       }
     );
+  }
 }
 
 int main(int argc, char* argv[])
 {
   // Check command line arguments.
-  if (argc != 4) {
+  command_line options(argc, argv, 4);
+
+  if (argc < 4 || !options.positional().empty() ||
+      options.unknown({"doc-root", "max-sessions", "max-queue-delay",
+                       "ws-queue", "proxy", "proxy-idle", "rate-limit",
+                       "rate-burst", "latency-dump", "trace",
+                       "trace-sample"})) {
     std::cerr << std::format(
-      "Usage: {} <ip-address> <port> <threads>\n"
-      "E.g.: {} 0.0.0.0 8080 1\n",
+      "Usage: {} <ip-address> <port> <threads> [options]\n"
+      "E.g.: {} 0.0.0.0 8080 1\n"
+      "Options:\n"
+      "  --doc-root=DIR serve the files in DIR for targets without a route\n"
+      "  --max-sessions=N  stop accepting while there are N sessions\n"
+      "  --max-queue-delay=MS  answer 503 to a connection whose first\n"
+      "                 request is read more than MS after accepting it\n"
+      "  --ws-queue=N   messages a WebSocket subscriber may fall behind\n"
+      "                 before it is disconnected (64)\n"
+      "  --proxy=PREFIX=HOST:PORT  forward the targets under PREFIX to\n"
+      "                 HOST:PORT, over pooled keep-alive connections\n"
+      "  --proxy-idle=N idle upstream connections kept per thread (64)\n"
+      "  --rate-limit=R answer 429 to a client's requests beyond R a second\n"
+      "  --rate-burst=N requests a client may make at once (100)\n"
+      "  --latency-dump=FILE  write the phase histograms to FILE on SIGUSR1\n"
+      "  --trace=FILE   write a Chrome trace of the sampled requests to\n"
+      "                 FILE on SIGUSR1\n"
+      "  --trace-sample=N  trace one request in N (1000)\n",
       argv[0], argv[0]
     );
     return EXIT_FAILURE;
@@ -119,8 +465,38 @@ int main(int argc, char* argv[])
   auto const port = static_cast<unsigned short>(std::atoi(argv[2]));
   auto const num_threads = std::max<int>(1, std::atoi(argv[3]));
 
+  if (options.has("doc-root"))
+    app.serve_files(options.get("doc-root", "."));
+
+  gate.configure(options.get("max-sessions", std::size_t(0)),
+      std::chrono::milliseconds(options.get("max-queue-delay", 0)));
+
+  hub.configure(options.get("ws-queue", std::size_t(64)));
+
+  limiter.configure(options.get("rate-limit", 0.0),
+      options.get("rate-burst", std::size_t(100)));
+
+  metrics::configure({options.get("latency-dump", ""),
+      options.get("trace", ""),
+      options.get("trace-sample", std::uint64_t(1000))});
+
+  if (options.has("proxy")) {
+    auto const route = proxy::parse_route(options.get("proxy", ""));
+    if (!route) {
+      std::cerr << "Bad --proxy (expected PREFIX=HOST:PORT)\n";
+      return EXIT_FAILURE;
+    }
+    try {
+      app.proxy_to(*route, options.get("proxy-idle", std::size_t(64)));
+    } catch (std::exception const& e) {
+      std::cerr << std::format("Bad --proxy upstream: {}\n", e.what());
+      return EXIT_FAILURE;
+    }
+  }
+
   // The io_context is required for all I/O
   asio::io_context ioc{num_threads};
+  metrics::dump_on_signal(ioc);
 
   // Spawn a listening port
   boost::asio::co_spawn(ioc,
@@ -0,0 +1,404 @@
+// WebSocket broadcast fan-out benchmark (see broadcast.hpp).
+//
+// Subscribes N WebSocket connections to a server's hub, and then publishes
+// timestamped messages through one more connection, which the hub sends to
+// all N + 1 of them. Publishing is paced by the slowest subscribers: at
+// most --window messages may still be on their way to anyone, so the run
+// measures what the server can fan out rather than how many it can evict.
+// Reports the messages published and delivered per second, and the
+// latency from publishing to delivery, as the subscriber count grows:
+//
+//   async_http_server 127.0.0.1 8082 1 & await_http_server 127.0.0.1 8084 1 &
+//   fanout_bench --subscribers=10,100,1000,10000
+//     async=127.0.0.1:8082 await=127.0.0.1:8084
+//
+// Everything runs on one client thread, which may well be the limit at the
+// higher counts; compare the servers at the same count.
+
+#include "latency_histogram.hpp"
+#include "command_line.hpp"
+
+#include <boost/beast/core.hpp>
+#include <boost/beast/websocket.hpp>
+
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <format>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <sys/resource.h>
+
+namespace beast = boost::beast;
+namespace websocket = beast::websocket;
+namespace asio = boost::asio;
+using tcp = asio::ip::tcp;
+using clock_type = std::chrono::steady_clock;
+
+struct target
+{
+  std::string label;
+  std::string host;
+  std::string port;
+};
+
+// Targets are given as <label>=<host>:<port>
+std::optional<target> parse_target(std::string const& spec)
+{
+  auto const eq = spec.find('=');
+  auto const colon = spec.rfind(':');
+  if (eq == std::string::npos || colon == std::string::npos || colon < eq)
+    return std::nullopt;
+
+  return target{
+    spec.substr(0, eq),
+    spec.substr(eq + 1, colon - eq - 1),
+    spec.substr(colon + 1)};
+}
+
+// A comma separated list of counts e.g. "100,1000,10000"
+std::vector<std::size_t> parse_counts(std::string const& list)
+{
+  std::vector<std::size_t> counts;
+  auto p = list.data();
+  auto const end = list.data() + list.size();
+
+  while (p < end) {
+    std::size_t n = 0;
+    auto const [next, ec] = std::from_chars(p, end, n);
+    if (ec != std::errc{} || n == 0 || (next != end && *next != ','))
+      return {};
+    counts.push_back(n);
+    p = next + (next != end);
+  }
+
+  return counts;
+}
+
+// Thousands of connections need more descriptors than the usual soft limit
+void raise_fd_limit()
+{
+  rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+}
+
+struct settings
+{
+  std::size_t subscribers = 0;
+  std::size_t size = 64;
+  std::size_t window = 8;
+  std::chrono::nanoseconds warmup{};
+  std::chrono::nanoseconds duration{};
+};
+
+struct result
+{
+  latency_histogram latency;
+  std::uint64_t published = 0;
+  std::uint64_t delivered = 0;
+  std::uint64_t closed = 0;
+  std::chrono::nanoseconds elapsed{};
+
+  double per_second(std::uint64_t n) const
+  {
+    auto const s = std::chrono::duration<double>(elapsed).count();
+    return s > 0 ? double(n) / s : 0;
+  }
+};
+
+// One run against one server: the subscribers, the publisher and what they
+// have seen so far
+class fanout
+{
+  public:
+  fanout(asio::io_context& ioc, target const& t, settings const& s)
+    : ioc_(ioc)
+    , target_(t)
+    , settings_(s)
+    , endpoints_(tcp::resolver(ioc).resolve(t.host, t.port))
+  {
+  }
+
+  result run()
+  {
+    // Subscribe everyone first, a few hundred handshakes at a time, with
+    // the publisher last
+    auto const total = settings_.subscribers + 1;
+    connections_.reserve(total);
+    buffers_.reserve(total); // the reads hold on to them
+    for (std::size_t i = 0; i < std::min<std::size_t>(total, 256); ++i)
+      connect_next();
+    while (ready_ + failed_ < total) ioc_.run_one();
+
+    if (failed_)
+      throw std::runtime_error(std::format(
+          "{} of {} connections failed", failed_, total));
+
+    auto const start = clock_type::now();
+    measure_from_ = start + settings_.warmup;
+    stop_at_ = measure_from_ + settings_.duration;
+    publish();
+
+    while (!done_ && clock_type::now() < stop_at_)
+      ioc_.run_one_until(stop_at_);
+    done_ = true;
+
+    // Let the connections go, and the server see them close
+    result_.elapsed = settings_.duration;
+    for (auto& ws : connections_) {
+      beast::error_code ec;
+      beast::get_lowest_layer(*ws).socket().close(ec);
+    }
+    ioc_.restart();
+    ioc_.poll();
+
+    return result_;
+  }
+
+  private:
+  using stream_type = websocket::stream<beast::tcp_stream>;
+
+  void connect_next()
+  {
+    if (next_ == settings_.subscribers + 1) return;
+    ++next_;
+
+    connections_.push_back(std::make_unique<stream_type>(ioc_));
+    auto& ws = *connections_.back();
+    buffers_.emplace_back();
+    auto const index = connections_.size() - 1;
+
+    beast::get_lowest_layer(ws).async_connect(endpoints_,
+        [this, &ws, index](beast::error_code ec, tcp::endpoint) {
+          if (ec) return fail();
+          beast::get_lowest_layer(ws).socket().set_option(
+              tcp::no_delay(true), ec);
+          ws.async_handshake(target_.host, "/",
+              [this, index](beast::error_code ec) {
+                if (ec) return fail();
+                ++ready_;
+                connect_next();
+                read(index);
+              });
+        });
+  }
+
+  void fail()
+  {
+    ++failed_;
+    connect_next();
+  }
+
+  void read(std::size_t index)
+  {
+    connections_[index]->async_read(buffers_[index],
+        [this, index](beast::error_code ec, std::size_t) {
+          // The server closed it, which means that it was evicted, and
+          // the window now only counts the others
+          if (ec) {
+            if (!done_) ++result_.closed;
+            return publish();
+          }
+          on_message(buffers_[index]);
+          buffers_[index].clear();
+          read(index);
+        });
+  }
+
+  // Every message starts with when it was published (in ns)
+  void on_message(beast::flat_buffer const& buffer)
+  {
+    auto const now = clock_type::now();
+    ++delivered_;
+
+    std::uint64_t sent = 0;
+    auto const* p = static_cast<char const*>(buffer.data().data());
+    std::from_chars(p, p + buffer.size(), sent);
+
+    if (sent >= ns(measure_from_) && sent < ns(stop_at_)) {
+      result_.latency.record(ns(now) - sent);
+      ++result_.delivered;
+    }
+
+    publish();
+  }
+
+  // Keep publishing while fewer than 'window' messages are still on their
+  // way to some subscriber
+  void publish()
+  {
+    if (done_) return;
+
+    auto const now = clock_type::now();
+    if (now >= stop_at_) {
+      done_ = true;
+      return;
+    }
+
+    auto const receivers = settings_.subscribers + 1 - result_.closed;
+    if (receivers == 0) {
+      done_ = true;
+      return;
+    }
+
+    while (!writing_ &&
+           published_ * receivers < delivered_ + settings_.window * receivers)
+    {
+      message_ = std::format("{}", ns(clock_type::now()));
+      if (message_.size() < settings_.size)
+        message_.resize(settings_.size, 'x');
+
+      ++published_;
+      if (clock_type::now() >= measure_from_) ++result_.published;
+
+      // The publisher is the last connection
+      writing_ = true;
+      connections_.back()->async_write(asio::buffer(message_),
+          [this](beast::error_code ec, std::size_t) {
+            writing_ = false;
+            if (ec) {
+              done_ = true;
+              return;
+            }
+            publish();
+          });
+    }
+  }
+
+  static std::uint64_t ns(clock_type::time_point t)
+  {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        t.time_since_epoch()).count();
+  }
+
+  asio::io_context& ioc_;
+  target const& target_;
+  settings const& settings_;
+  tcp::resolver::results_type endpoints_;
+
+  std::vector<std::unique_ptr<stream_type>> connections_;
+  std::vector<beast::flat_buffer> buffers_;
+  std::size_t next_ = 0;
+  std::size_t ready_ = 0;
+  std::size_t failed_ = 0;
+
+  clock_type::time_point measure_from_;
+  clock_type::time_point stop_at_;
+  std::string message_;
+  bool writing_ = false;
+  bool done_ = false;
+  std::uint64_t published_ = 0;
+  std::uint64_t delivered_ = 0;
+
+  result result_;
+};
+
+void print_results(
+    settings const& s,
+    std::vector<std::pair<target, result>> const& runs)
+{
+  std::cout << std::format(
+      "\n{} subscribers, {} byte messages, window {}, {} s per server\n\n",
+      s.subscribers, s.size, s.window,
+      std::chrono::duration<double>(s.duration).count());
+
+  std::cout << std::format(
+      "{:<12} {:>10} {:>14} {:>10} {:>10} {:>10} {:>8}\n",
+      "server", "msgs/s", "deliveries/s", "p50(us)", "p99(us)",
+      "p99.9(us)", "closed");
+
+  for (auto const& [t, r] : runs) {
+    auto const& h = r.latency;
+    std::cout << std::format(
+        "{:<12} {:>10.0f} {:>14.0f} {:>10.1f} {:>10.1f} {:>10.1f} {:>8}\n",
+        t.label, r.per_second(r.published), r.per_second(r.delivered),
+        h.value_at_percentile(50) / 1e3,
+        h.value_at_percentile(99) / 1e3,
+        h.value_at_percentile(99.9) / 1e3, r.closed);
+  }
+}
+
+int main(int argc, char* argv[])
+{
+  command_line cl(argc, argv, 1);
+
+  if (cl.positional().empty() || cl.has("help")) {
+    std::cerr << std::format(
+      "Usage: {} [options] <label>=<host>:<port> ...\n"
+      "E.g.: {} --subscribers=100,1000 async=127.0.0.1:8080\n"
+      "Options:\n"
+      "  --subscribers=N  WebSocket subscribers per server (100), or a\n"
+      "                   comma separated list of counts to run in turn\n"
+      "  --size=B         message size in bytes (64)\n"
+      "  --window=N       messages in flight to the subscribers (8)\n"
+      "  --duration=S     measured seconds per server (5)\n"
+      "  --warmup=S       unmeasured seconds before each run (1)\n",
+      argv[0], argv[0]
+    );
+    return EXIT_FAILURE;
+  }
+
+  if (auto u = cl.unknown({"subscribers", "size", "window", "duration",
+                           "warmup", "help"})) {
+    std::cerr << std::format("Unknown option: --{}\n", *u);
+    return EXIT_FAILURE;
+  }
+
+  auto const counts = parse_counts(cl.get("subscribers", "100"));
+  if (counts.empty()) {
+    std::cerr << "Bad --subscribers (expected N or N,N,...)\n";
+    return EXIT_FAILURE;
+  }
+
+  settings s;
+  s.size = cl.get<std::size_t>("size", 64);
+  s.window = std::max<std::size_t>(1, cl.get<std::size_t>("window", 8));
+  s.duration = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::duration<double>(cl.get<double>("duration", 5)));
+  s.warmup = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::duration<double>(cl.get<double>("warmup", 1)));
+
+  std::vector<target> targets;
+  for (auto const& spec : cl.positional()) {
+    auto t = parse_target(spec);
+    if (!t) {
+      std::cerr << std::format(
+          "Bad target '{}' (expected label=host:port)\n", spec);
+      return EXIT_FAILURE;
+    }
+    targets.push_back(*t);
+  }
+
+  raise_fd_limit();
+
+  for (auto const n : counts) {
+    s.subscribers = n;
+    std::vector<std::pair<target, result>> runs;
+
+    for (auto const& t : targets) {
+      std::cerr << std::format("Running {} ({}:{}) with {} subscribers ...\n",
+          t.label, t.host, t.port, n);
+
+      try {
+        asio::io_context ioc{1};
+        runs.emplace_back(t, fanout(ioc, t, s).run());
+      } catch (std::exception const& e) {
+        std::cerr << std::format("Error: {} : {}\n", t.label, e.what());
+        return EXIT_FAILURE;
+      }
+    }
+
+    print_results(s, runs);
+  }
+
+  return EXIT_SUCCESS;
+}
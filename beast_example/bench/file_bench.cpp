@@ -0,0 +1,158 @@
+// The cost of serving static files (see static_files.hpp) against the
+// in-memory string path.
+//
+// The first cases stop short of the socket, like response_bench: they
+// measure producing the buffers for one request, either by building an
+// http::response with the contents in a string_body, or through the
+// file_handler (a hit in the mmap cache, and a large file that is opened
+// for sendfile).
+//
+// The transfer cases then push a large body through a socket pair, with a
+// thread draining the other end: write(2) from a string against
+// sendfile(2) straight from the file.
+
+#include "microbench.hpp"
+#include "pipeline.hpp"
+#include "static_files.hpp"
+
+#include <boost/asio/local/stream_protocol.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <thread>
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace beast = boost::beast;
+namespace http = beast::http;
+namespace asio = boost::asio;
+
+constexpr std::size_t small_size = 4 << 10;
+constexpr std::size_t large_size = 4 << 20;
+
+std::string make_contents(std::size_t size)
+{
+  std::string s(size, '\0');
+  for (std::size_t i = 0; i < size; ++i) s[i] = char('a' + i % 26);
+  return s;
+}
+
+// The string path: copy the contents into a response and serialize it
+std::size_t string_response(
+    std::string const& contents,
+    http::request<http::string_body> const& req,
+    pipeline::response_batch<http::string_body>& batch)
+{
+  http::response<http::string_body> res{http::status::ok, req.version()};
+  res.set(http::field::server, "Beast");
+  res.set(http::field::content_type, "application/octet-stream");
+  res.body() = contents;
+  res.prepare_payload();
+  res.keep_alive(req.keep_alive());
+  batch.push(std::move(res));
+
+  auto const n = beast::buffer_bytes(batch.buffers());
+  batch.clear();
+  return n;
+}
+
+std::size_t file_response(
+    static_files::file_handler& files,
+    http::request<http::string_body> const& req,
+    pipeline::response_batch<http::string_body>& batch)
+{
+  files.handle(req, batch);
+
+  auto n = beast::buffer_bytes(batch.buffers());
+  if (auto* file = batch.file()) n += file->size();
+  batch.clear();
+  return n;
+}
+
+// Reads and discards everything sent to 'fd' until it is closed
+std::thread drain(int fd)
+{
+  return std::thread([fd] {
+      static char buffer[1 << 16];
+      while (::read(fd, buffer, sizeof(buffer)) > 0) {}
+    });
+}
+
+int main()
+{
+  char dir[] = "/tmp/file_bench.XXXXXX";
+  if (!::mkdtemp(dir)) return EXIT_FAILURE;
+
+  auto const small = make_contents(small_size);
+  auto const large = make_contents(large_size);
+  std::ofstream(std::string(dir) + "/small.bin", std::ios::binary) << small;
+  std::ofstream(std::string(dir) + "/large.bin", std::ios::binary) << large;
+
+  static_files::file_handler files(dir, "Beast");
+  pipeline::response_batch<http::string_body> batch;
+
+  http::request<http::string_body> small_req{http::verb::get, "/small.bin", 11};
+  http::request<http::string_body> large_req{http::verb::get, "/large.bin", 11};
+
+  std::vector<microbench::result> results;
+
+  results.push_back(microbench::run("string_body (4 KiB)",
+      [&] { microbench::do_not_optimize(
+          string_response(small, small_req, batch)); }));
+
+  results.push_back(microbench::run("file_handler mmap cache (4 KiB)",
+      [&] { microbench::do_not_optimize(
+          file_response(files, small_req, batch)); }));
+
+  results.push_back(microbench::run("string_body (4 MiB)",
+      [&] { microbench::do_not_optimize(
+          string_response(large, large_req, batch)); }));
+
+  results.push_back(microbench::run("file_handler file_body (4 MiB)",
+      [&] { microbench::do_not_optimize(
+          file_response(files, large_req, batch)); }));
+
+  // Transfers
+  int fds[2];
+  if (::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) return EXIT_FAILURE;
+  auto reader = drain(fds[1]);
+
+  asio::io_context ioc;
+  asio::local::stream_protocol::socket sink(ioc,
+      asio::local::stream_protocol(), fds[0]);
+
+  results.push_back(microbench::run("write from string (4 MiB)",
+      [&] {
+        beast::error_code ec;
+        microbench::do_not_optimize(
+            asio::write(sink, asio::buffer(large), ec));
+      }));
+
+  http::file_body::value_type body;
+  beast::error_code ec;
+  body.open((std::string(dir) + "/large.bin").c_str(),
+      beast::file_mode::scan, ec);
+  if (ec) return EXIT_FAILURE;
+
+  results.push_back(microbench::run("sendfile (4 MiB)",
+      [&] {
+        beast::error_code ec;
+        microbench::do_not_optimize(
+            static_files::sendfile(sink, body, ec));
+      }));
+
+  sink.close();
+  reader.join();
+
+  microbench::print(results);
+
+  std::remove((std::string(dir) + "/small.bin").c_str());
+  std::remove((std::string(dir) + "/large.bin").c_str());
+  ::rmdir(dir);
+
+  return EXIT_SUCCESS;
+}
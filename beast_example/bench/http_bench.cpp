@@ -0,0 +1,782 @@
+// Keep-alive HTTP load generator for comparing the Beast server models.
+//
+// Start the servers on different ports, e.g.
+//
+//   sync_http_server 127.0.0.1 8081
+//   async_http_server 127.0.0.1 8082 4
+//   coro_http_server 127.0.0.1 8083 4
+//   await_http_server 127.0.0.1 8084 4
+//
+// and then drive each of them in turn with the same load:
+//
+//   http_bench --connections=64 --rate=20000
+//     sync=127.0.0.1:8081 async=127.0.0.1:8082
+//     coro=127.0.0.1:8083 await=127.0.0.1:8084
+//
+// Adding a server's pid to its target (label=host:port@pid) also reports
+// the CPU time and context switches it used per request, plus (with
+// --syscalls) its syscalls per request. E.g. to compare the epoll and
+// io_uring builds at growing connection counts (after raising 'ulimit -n'
+// for the servers):
+//
+//   async_http_server 127.0.0.1 8082 4 & epoll=$!
+//   async_http_server_uring 127.0.0.1 8092 4 & uring=$!
+//   http_bench --connections=100,1000,10000 --threads=4 --syscalls=5
+//     epoll=127.0.0.1:8082@$epoll uring=127.0.0.1:8092@$uring
+//
+// --overload=F checks how a server degrades: each server's capacity is
+// measured first (closed loop), and then it is offered F times as many
+// requests. With --close every request also needs a new connection, which
+// is what admission control works on, e.g.
+//
+//   async_http_server 127.0.0.1 8082 1 --max-sessions=64 --max-queue-delay=5
+//   http_bench --overload=10 --close --connections=512 async=127.0.0.1:8082
+//
+// and the latency of the requests that were served (2xx) should stay
+// bounded while the rest are answered 503.
+//
+// --hangup=N has the client close each connection after N requests without
+// asking the server to, so that the server's next read ends the session
+// with end_of_stream - which await_http_server throws and
+// await_ec_http_server does not:
+//
+//   http_bench --hangup=1 exceptions=127.0.0.1:8084 error_codes=127.0.0.1:8086
+//
+// --idle measures how a server scales with mostly idle connections
+// instead: it opens the connections one after another, makes one request
+// on each and leaves them open, and reports the server's resident memory
+// per connection (which needs its pid) and how fast the connections were
+// accepted. Then a small active set of --active connections runs the load
+// for --duration among them, for its latency. --csv prints the same as one
+// CSV row per server and count, for keeping track of it over time. E.g. to
+// compare the four models from C1K to C10K:
+//
+//   sync_http_server 127.0.0.1 8081 --workers=50100 & sync=$!
+//   async_http_server 127.0.0.1 8082 1 & async=$!
+//   coro_http_server 127.0.0.1 8083 1 --stack-size=64 & coro=$!
+//   await_http_server 127.0.0.1 8084 1 & await=$!
+//   http_bench --idle --connections=1000,10000,50000 --csv
+//     sync=127.0.0.1:8081@$sync async=127.0.0.1:8082@$async
+//     coro=127.0.0.1:8083@$coro await=127.0.0.1:8084@$await > scaling.csv
+//
+// --slow-read=R reads a single response to --target at R bytes a second
+// instead, through a small receive window, to check that a server keeps
+// sending a large file or stream for as long as the client keeps reading,
+// however long that takes. E.g. with the timing wheel, whose idle timeout
+// is 30 s:
+//
+//   async_http_server 127.0.0.1 8082 1 --idle-wheel
+//   http_bench --slow-read=65536 --target=/stream?bytes=4194304
+//     async=127.0.0.1:8082
+//
+// takes about 64 s, and should end with the whole body.
+//
+// sync_http_server holds a worker thread per connection, so it needs
+// --workers above the largest count. Every connection is a descriptor in
+// both the client and the server, so 'ulimit -n' has to allow for the
+// largest count in both. More than about
+// 28k connections to one port need more than one source address, so
+// connections to a 127.x address come from 127.0.0.1, 127.0.0.2 and so on,
+// 16k from each.
+
+#include "load_client.hpp"
+#include "command_line.hpp"
+#include "syscall_census.hpp"
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <iostream>
+#include <limits>
+#include <format>
+
+#include <sys/resource.h>
+#include <netinet/in.h>
+
+namespace asio = boost::asio;
+
+struct target
+{
+  std::string label;
+  std::string host;
+  std::string port;
+  int pid = 0;
+};
+
+// The measurements for one server
+struct server_run
+{
+  target server;
+  bench::load_result result;
+
+  // From the separate traced run (see --syscalls)
+  std::optional<double> syscalls_per_request;
+};
+
+// Targets are given as <label>=<host>:<port>[@<pid>]
+std::optional<target> parse_target(std::string spec)
+{
+  int pid = 0;
+  if (auto const at = spec.rfind('@'); at != std::string::npos) {
+    auto const p = spec.data() + at + 1;
+    auto const [end, ec] = std::from_chars(p, spec.data() + spec.size(), pid);
+    if (ec != std::errc{} || end != spec.data() + spec.size() || pid <= 0)
+      return std::nullopt;
+    spec.resize(at);
+  }
+
+  auto const eq = spec.find('=');
+  auto const colon = spec.rfind(':');
+  if (eq == std::string::npos || colon == std::string::npos || colon < eq)
+    return std::nullopt;
+
+  return target{
+    spec.substr(0, eq),
+    spec.substr(eq + 1, colon - eq - 1),
+    spec.substr(colon + 1),
+    pid};
+}
+
+// A comma separated list of counts e.g. "100,1000,10000"
+std::vector<std::size_t> parse_counts(std::string const& list)
+{
+  std::vector<std::size_t> counts;
+  auto p = list.data();
+  auto const end = list.data() + list.size();
+
+  while (p < end) {
+    std::size_t n = 0;
+    auto const [next, ec] = std::from_chars(p, end, n);
+    if (ec != std::errc{} || n == 0 || (next != end && *next != ','))
+      return {};
+    counts.push_back(n);
+    p = next + (next != end);
+  }
+
+  return counts;
+}
+
+// Thousands of connections need more descriptors than the usual soft limit
+void raise_fd_limit()
+{
+  rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+}
+
+// Print a latency histogram as (upper bound, count, cumulative percentile)
+void print_histogram(std::string const& label, latency_histogram const& h)
+{
+  std::cout << std::format("\n{} latency histogram\n", label);
+  std::cout << std::format("{:>14} {:>12} {:>10}\n", "<= (us)", "count", "pct");
+
+  std::uint64_t seen = 0;
+  h.for_each_bucket([&](std::uint64_t upper, std::uint64_t n) {
+    seen += n;
+    std::cout << std::format("{:>14.1f} {:>12} {:>9.4f}%\n",
+        upper / 1e3, n, 100.0 * seen / h.count());
+  });
+}
+
+// Count the server's syscalls during an extra run with the same load.
+// Tracing slows the server right down, so this run's own throughput and
+// latency are thrown away.
+std::optional<double> syscalls_per_request(
+    bench::load_settings settings,
+    double seconds)
+{
+  settings.duration = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::duration<double>(seconds));
+
+  auto const start = std::chrono::steady_clock::now() + settings.warmup;
+  std::uint64_t syscalls = 0;
+  std::string error;
+
+  // All of the ptrace calls have to come from the one thread
+  std::thread tracer([&] {
+      try {
+        syscalls = bench::count_syscalls(settings.server_pid,
+            start, start + settings.duration);
+      } catch (std::exception const& e) {
+        error = e.what();
+      }
+    });
+
+  auto const result = bench::run_load(settings);
+  tracer.join();
+
+  if (!error.empty()) {
+    std::cerr << std::format("Cannot count syscalls: {}\n", error);
+    return std::nullopt;
+  }
+
+  if (result.requests == 0) return std::nullopt;
+  return double(syscalls) / double(result.requests);
+}
+
+// A server with 'connections' idle connections (see --idle): its resident
+// memory before, with and after them, and the load on the active set
+// while they were open
+struct idle_run
+{
+  target server;
+  std::size_t opened = 0;
+  std::chrono::duration<double> opening{};
+  std::uint64_t before = 0;
+  std::uint64_t open = 0;
+  std::uint64_t after = 0;
+  std::optional<bench::load_result> active;
+
+  double accept_rate() const
+  {
+    return opening.count() > 0 ? double(opened) / opening.count() : 0;
+  }
+
+  double bytes_per_connection() const
+  {
+    return opened ? (double(open) - double(before)) / double(opened) : 0;
+  }
+};
+
+idle_run measure_idle(
+    target const& t,
+    std::size_t connections,
+    bench::load_settings active)
+{
+  namespace beast = boost::beast;
+  namespace http = beast::http;
+  using tcp = asio::ip::tcp;
+
+  // Binds the source address without choosing the port, which connect then
+  // chooses for the whole address pair
+  using bind_address_no_port = asio::detail::socket_option::boolean<
+      IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT>;
+
+  asio::io_context ioc{1};
+  auto const endpoint = *tcp::resolver(ioc).resolve(t.host, t.port).begin();
+  auto const loopback = endpoint.endpoint().address().is_v4() &&
+                        endpoint.endpoint().address().is_loopback();
+
+  auto const request = std::format(
+      "GET / HTTP/1.1\r\nHost: {}:{}\r\nUser-Agent: http_bench\r\n\r\n",
+      t.host, t.port);
+
+  auto const settle = [] {
+      std::this_thread::sleep_for(std::chrono::seconds(1));
+    };
+
+  idle_run run;
+  run.server = t;
+  run.before = bench::resident_bytes(t.pid).value_or(0);
+
+  std::vector<tcp::socket> sockets;
+  sockets.reserve(connections);
+
+  auto const start = std::chrono::steady_clock::now();
+  for (std::size_t i = 0; i < connections; ++i) {
+    tcp::socket socket(ioc);
+    boost::system::error_code ec;
+
+    socket.open(tcp::v4(), ec);
+    if (!ec && loopback) {
+      socket.set_option(bind_address_no_port(true), ec);
+      socket.bind({asio::ip::address_v4(0x7f000001 + i / 16384), 0}, ec);
+    }
+
+    // A server that has no session to spare may never answer, so each
+    // connection gets a few seconds
+    beast::flat_buffer buffer;
+    http::response<http::string_body> res;
+    bool answered = false;
+
+    if (!ec) {
+      socket.async_connect(endpoint, [&](boost::system::error_code e) {
+          if ((ec = e)) return;
+          asio::async_write(socket, asio::buffer(request),
+              [&](boost::system::error_code e, std::size_t) {
+                if ((ec = e)) return;
+                http::async_read(socket, buffer, res,
+                    [&](boost::system::error_code e, std::size_t) {
+                      ec = e;
+                      answered = !e;
+                    });
+              });
+        });
+
+      ioc.restart();
+      ioc.run_for(std::chrono::seconds(5));
+      if (!ec && !answered) {
+        socket.close();
+        ioc.restart();
+        ioc.run();
+        ec = asio::error::timed_out;
+      }
+    }
+
+    if (ec) {
+      std::cerr << std::format("Stopped at {} connections: {}\n",
+          i, ec.message());
+      break;
+    }
+    sockets.push_back(std::move(socket));
+    run.opening = std::chrono::steady_clock::now() - start;
+  }
+  run.opened = sockets.size();
+
+  settle();
+  run.open = bench::resident_bytes(t.pid).value_or(0);
+
+  if (active.connections > 0) {
+    active.host = t.host;
+    active.port = t.port;
+    active.server_pid = 0;
+    run.active = bench::run_load(active);
+  }
+
+  sockets.clear();
+  settle();
+  run.after = bench::resident_bytes(t.pid).value_or(0);
+
+  return run;
+}
+
+void print_idle(
+    std::size_t connections,
+    bench::load_settings const& active,
+    std::vector<idle_run> const& runs)
+{
+  std::cout << std::format(
+      "\n{} idle connections, {} active, {} s per server\n\n",
+      connections, active.connections,
+      std::chrono::duration<double>(active.duration).count());
+
+  std::cout << std::format(
+      "{:<12} {:>8} {:>8} {:>10} {:>10} {:>10} {:>9} {:>10} {:>9} {:>9}\n",
+      "server", "opened", "conn/s", "rss0(MiB)", "rss(MiB)", "closed(MiB)",
+      "KiB/conn", "act req/s", "p50(us)", "p99(us)");
+
+  for (auto const& r : runs) {
+    auto const mib = [](std::uint64_t bytes) { return bytes / 1048576.0; };
+    std::cout << std::format(
+        "{:<12} {:>8} {:>8.0f} {:>10.1f} {:>10.1f} {:>10.1f} {:>9.1f}",
+        r.server.label, r.opened, r.accept_rate(), mib(r.before),
+        mib(r.open), mib(r.after), r.bytes_per_connection() / 1024);
+
+    if (r.active) {
+      auto const& h = r.active->latency;
+      std::cout << std::format(" {:>10.0f} {:>9.1f} {:>9.1f}\n",
+          r.active->throughput(), h.value_at_percentile(50) / 1e3,
+          h.value_at_percentile(99) / 1e3);
+    }
+    else
+      std::cout << std::format(" {:>10} {:>9} {:>9}\n", "-", "-", "-");
+  }
+
+  std::cout << std::format(
+      "\n(resident memory of the server before opening the connections, "
+      "with them open, and 1 s after closing them)\n");
+}
+
+// The same as CSV, with the header before the first count's rows
+void print_idle_csv(
+    std::size_t connections,
+    bench::load_settings const& active,
+    std::vector<idle_run> const& runs,
+    bool header)
+{
+  if (header)
+    std::cout << "server,connections,opened,accepts_per_s,rss_before,"
+                 "rss_open,rss_closed,bytes_per_connection,active,"
+                 "active_requests_per_s,p50_us,p99_us,p999_us,errors\n";
+
+  for (auto const& r : runs) {
+    std::cout << std::format("{},{},{},{:.0f},{},{},{},{:.0f},{}",
+        r.server.label, connections, r.opened, r.accept_rate(), r.before,
+        r.open, r.after, r.bytes_per_connection(), active.connections);
+
+    if (r.active) {
+      auto const& h = r.active->latency;
+      std::cout << std::format(",{:.0f},{:.1f},{:.1f},{:.1f},{}\n",
+          r.active->throughput(), h.value_at_percentile(50) / 1e3,
+          h.value_at_percentile(99) / 1e3, h.value_at_percentile(99.9) / 1e3,
+          r.active->errors);
+    }
+    else
+      std::cout << ",,,,,\n";
+  }
+}
+
+// One response read slowly (see --slow-read): how long it took, how much
+// of its body arrived, and why it ended if that was before the end
+struct slow_read_run
+{
+  target server;
+  std::chrono::duration<double> elapsed{};
+  std::uint64_t body_bytes = 0;
+  boost::system::error_code ec;
+};
+
+slow_read_run measure_slow_read(
+    target const& t,
+    std::string const& path,
+    double rate)
+{
+  namespace beast = boost::beast;
+  namespace http = beast::http;
+  using tcp = asio::ip::tcp;
+
+  asio::io_context ioc{1};
+  auto const endpoint = *tcp::resolver(ioc).resolve(t.host, t.port).begin();
+
+  // A small receive window, so that the server's writes have to wait for
+  // the client instead of the kernels taking the whole body
+  tcp::socket socket(ioc);
+  socket.open(endpoint.endpoint().protocol());
+  socket.set_option(asio::socket_base::receive_buffer_size(16384));
+  socket.connect(endpoint);
+
+  asio::write(socket, asio::buffer(std::format(
+      "GET {} HTTP/1.1\r\nHost: {}:{}\r\nUser-Agent: http_bench\r\n"
+      "Connection: close\r\n\r\n", path, t.host, t.port)));
+
+  slow_read_run run;
+  run.server = t;
+
+  // The body goes through 'chunk', and the buffer only holds what the
+  // parser has not taken yet
+  beast::flat_buffer buffer(8192);
+  http::response_parser<http::buffer_body> parser;
+  parser.body_limit(std::numeric_limits<std::uint64_t>::max());
+  std::array<char, 4096> chunk;
+
+  auto const start = std::chrono::steady_clock::now();
+  http::read_header(socket, buffer, parser, run.ec);
+
+  while (!run.ec && !parser.is_done()) {
+    auto& body = parser.get().body();
+    body.data = chunk.data();
+    body.size = chunk.size();
+
+    http::read(socket, buffer, parser, run.ec);
+    if (run.ec == http::error::need_buffer) run.ec = {};
+    run.body_bytes += chunk.size() - body.size;
+
+    std::this_thread::sleep_until(start +
+        std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+          std::chrono::duration<double>(run.body_bytes / rate)));
+  }
+
+  run.elapsed = std::chrono::steady_clock::now() - start;
+  return run;
+}
+
+void print_slow_read(
+    std::string const& path,
+    double rate,
+    std::vector<slow_read_run> const& runs)
+{
+  std::cout << std::format("\n{} read at {:.0f} bytes/s\n\n", path, rate);
+
+  std::cout << std::format("{:<12} {:>10} {:>12} {:>10}  {}\n",
+      "server", "time(s)", "body bytes", "bytes/s", "result");
+
+  for (auto const& r : runs)
+    std::cout << std::format("{:<12} {:>10.1f} {:>12} {:>10.0f}  {}\n",
+        r.server.label, r.elapsed.count(), r.body_bytes,
+        r.elapsed.count() > 0 ? r.body_bytes / r.elapsed.count() : 0.0,
+        r.ec ? r.ec.message() : "complete");
+}
+
+// The capacity run and the overload run of one server (see --overload)
+struct overload_run
+{
+  target server;
+  bench::load_result capacity;
+  bench::load_result overload;
+  double offered = 0;
+};
+
+void print_overload(
+    bench::load_settings const& settings,
+    double factor,
+    std::vector<overload_run> const& runs)
+{
+  std::cout << std::format(
+      "\n{} connections{}, {}x overload, {} s per run\n\n",
+      settings.connections, settings.close ? " (one request each)" : "",
+      factor, std::chrono::duration<double>(settings.duration).count());
+
+  std::cout << std::format(
+      "{:<12} {:>10} {:>10} {:>10} {:>10} {:>10} {:>10} {:>10} {:>8}\n",
+      "server", "capacity", "offered", "ok req/s", "ok p50", "ok p99",
+      "ok p99.9", "non-2xx", "errors");
+
+  for (auto const& [t, capacity, r, offered] : runs) {
+    auto const& h = r.ok_latency;
+    auto const s = std::chrono::duration<double>(r.elapsed).count();
+    std::cout << std::format(
+        "{:<12} {:>10.0f} {:>10.0f} {:>10.0f} {:>10.1f} {:>10.1f} {:>10.1f}"
+        " {:>10} {:>8}\n",
+        t.label, capacity.throughput(), offered,
+        double(r.requests - r.non_2xx) / s,
+        h.value_at_percentile(50) / 1e3,
+        h.value_at_percentile(99) / 1e3,
+        h.value_at_percentile(99.9) / 1e3,
+        r.non_2xx, r.errors);
+  }
+
+  std::cout << std::format(
+      "\n(capacity with the same connections in a closed loop; "
+      "ok latencies in us, for 2xx responses only)\n");
+}
+
+// One comparison table for all servers, plus their resource usage for
+// those that were given a pid
+void print_results(
+    bench::load_settings const& settings,
+    std::vector<server_run> const& runs)
+{
+  std::cout << std::format(
+      "\n{} connections (pipeline {}{}), {} req/s offered, {} s per server\n\n",
+      settings.connections, settings.pipeline,
+      settings.hangup ? std::format(", hang up after {}", settings.hangup) : "",
+      settings.rate > 0 ? std::format("{:.0f}", settings.rate) : "unlimited",
+      std::chrono::duration<double>(settings.duration).count());
+
+  std::cout << std::format(
+      "{:<12} {:>12} {:>10} {:>10} {:>10} {:>10} {:>10} {:>8} {:>8}\n",
+      "server", "req/s", "mean(us)", "p50(us)", "p99(us)", "p99.9(us)",
+      "max(us)", "non-2xx", "errors");
+
+  for (auto const& [t, r, syscalls] : runs) {
+    auto const& h = r.latency;
+    std::cout << std::format(
+        "{:<12} {:>12.0f} {:>10.1f} {:>10.1f} {:>10.1f} {:>10.1f} {:>10.1f}"
+        " {:>8} {:>8}\n",
+        t.label, r.throughput(), h.mean() / 1e3,
+        h.value_at_percentile(50) / 1e3,
+        h.value_at_percentile(99) / 1e3,
+        h.value_at_percentile(99.9) / 1e3,
+        h.max() / 1e3, r.non_2xx, r.errors);
+  }
+
+  bool const any_usage = std::any_of(runs.begin(), runs.end(),
+      [](auto const& run) { return run.result.server.has_value(); });
+  if (!any_usage) return;
+
+  // Per request: CPU and context switches over the measured period (see
+  // process_usage.hpp), syscalls from the traced run
+  std::cout << std::format(
+      "\n{:<12} {:>12} {:>12} {:>12} {:>12}\n",
+      "server", "usr-us/req", "sys-us/req", "ctxsw/req", "syscalls/req");
+
+  for (auto const& [t, r, syscalls] : runs) {
+    if (!r.server || r.requests == 0) continue;
+    auto const& u = *r.server;
+    double const n = double(r.requests);
+    std::cout << std::format(
+        "{:<12} {:>12.2f} {:>12.2f} {:>12.3f} {:>12}\n",
+        t.label, u.user_seconds * 1e6 / n, u.system_seconds * 1e6 / n,
+        (u.voluntary_switches + u.involuntary_switches) / n,
+        syscalls ? std::format("{:.2f}", *syscalls) : "-");
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  command_line cl(argc, argv, 1);
+
+  if (cl.positional().empty() || cl.has("help")) {
+    std::cerr << std::format(
+      "Usage: {} [options] <label>=<host>:<port>[@<pid>] ...\n"
+      "E.g.: {} --connections=64 --rate=10000 async=127.0.0.1:8080\n"
+      "Options:\n"
+      "  --connections=N  keep-alive connections per server (64), or a\n"
+      "                   comma separated list to run each server at each\n"
+      "                   of the counts in turn\n"
+      "  --threads=N      client threads (1)\n"
+      "  --rate=R         total requests/second, 0 for closed loop (0)\n"
+      "  --pipeline=N     requests pipelined per connection (1)\n"
+      "  --duration=S     measured seconds per server (10)\n"
+      "  --warmup=S       unmeasured seconds before each run (1)\n"
+      "  --target=PATH    request target (/)\n"
+      "  --close          one request per connection\n"
+      "  --hangup=N       close each connection after N requests, without\n"
+      "                   Connection: close (the server reads EOF)\n"
+      "  --overload=F     measure each server's capacity, then offer it\n"
+      "                   F times that and report the 2xx latencies\n"
+      "  --idle           open the connections, one request each, and\n"
+      "                   report the servers' memory per idle connection\n"
+      "                   and accept rate (servers need a pid)\n"
+      "  --active=N       with --idle, the latency of N more connections\n"
+      "                   running the load meanwhile (16, 0 for none)\n"
+      "  --csv            with --idle, print CSV rows instead of tables\n"
+      "  --slow-read=R    read one response to the target at R bytes a\n"
+      "                   second and report whether all of it arrived\n"
+      "  --histogram      print the full latency histogram of each server\n"
+      "  --syscalls=S     for servers given with a pid, also count their\n"
+      "                   syscalls during S more seconds of load (ptrace)\n",
+      argv[0], argv[0]
+    );
+    return EXIT_FAILURE;
+  }
+
+  if (auto u = cl.unknown({"connections", "threads", "rate", "pipeline",
+                           "duration", "warmup", "target", "histogram",
+                           "syscalls", "close", "hangup", "overload", "idle",
+                           "active", "csv", "slow-read", "help"})) {
+    std::cerr << std::format("Unknown option: --{}\n", *u);
+    return EXIT_FAILURE;
+  }
+
+  auto const connection_counts = parse_counts(cl.get("connections", "64"));
+  if (connection_counts.empty()) {
+    std::cerr << "Bad --connections (expected N or N,N,...)\n";
+    return EXIT_FAILURE;
+  }
+
+  auto const syscall_seconds = cl.get<double>("syscalls", 0);
+  auto const overload = cl.get<double>("overload", 0);
+
+  raise_fd_limit();
+
+  bench::load_settings settings;
+  settings.threads = cl.get<std::size_t>("threads", 1);
+  settings.rate = cl.get<double>("rate", 0);
+  settings.pipeline = cl.get<std::size_t>("pipeline", 1);
+  settings.target = cl.get("target", "/");
+  settings.close = cl.has("close");
+  settings.hangup = cl.get<std::size_t>("hangup", 0);
+  settings.duration = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::duration<double>(cl.get<double>("duration", 10)));
+  settings.warmup = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::duration<double>(cl.get<double>("warmup", 1)));
+
+  std::vector<target> targets;
+  for (auto const& spec : cl.positional()) {
+    auto t = parse_target(spec);
+    if (!t) {
+      std::cerr << std::format(
+          "Bad target '{}' (expected label=host:port[@pid])\n", spec);
+      return EXIT_FAILURE;
+    }
+    targets.push_back(*t);
+  }
+
+  if (auto const rate = cl.get<double>("slow-read", 0); rate > 0) {
+    std::vector<slow_read_run> runs;
+
+    for (auto const& t : targets) {
+      std::cerr << std::format("Reading {} from {} at {:.0f} bytes/s ...\n",
+          settings.target, t.label, rate);
+
+      try {
+        runs.push_back(measure_slow_read(t, settings.target, rate));
+      } catch (std::exception const& e) {
+        std::cerr << std::format("Error: {} : {}\n", t.label, e.what());
+        return EXIT_FAILURE;
+      }
+    }
+
+    print_slow_read(settings.target, rate, runs);
+    return EXIT_SUCCESS;
+  }
+
+  auto active = settings;
+  active.connections = cl.get<std::size_t>("active", 16);
+
+  for (auto const connections : connection_counts) {
+    settings.connections = connections;
+
+    if (cl.has("idle")) {
+      std::vector<idle_run> runs;
+
+      for (auto const& t : targets) {
+        if (!t.pid) {
+          std::cerr << std::format("Error: {} : --idle needs its pid\n",
+              t.label);
+          return EXIT_FAILURE;
+        }
+
+        std::cerr << std::format("Opening {} idle connections to {} ...\n",
+            connections, t.label);
+
+        try {
+          runs.push_back(measure_idle(t, connections, active));
+        } catch (std::exception const& e) {
+          std::cerr << std::format("Error: {} : {}\n", t.label, e.what());
+          return EXIT_FAILURE;
+        }
+      }
+
+      if (cl.has("csv"))
+        print_idle_csv(connections, active, runs,
+            connections == connection_counts.front());
+      else
+        print_idle(connections, active, runs);
+      continue;
+    }
+
+    if (overload > 0) {
+      std::vector<overload_run> runs;
+
+      for (auto const& t : targets) {
+        auto s = settings;
+        s.host = t.host;
+        s.port = t.port;
+        s.server_pid = 0;
+
+        std::cerr << std::format("Measuring {} ({}:{}) ...\n",
+            t.label, t.host, t.port);
+
+        try {
+          s.rate = 0;
+          auto capacity = bench::run_load(s);
+
+          s.rate = capacity.throughput() * overload;
+          std::cerr << std::format("Overloading {} at {:.0f} req/s ...\n",
+              t.label, s.rate);
+          runs.push_back({t, std::move(capacity), bench::run_load(s), s.rate});
+        } catch (std::exception const& e) {
+          std::cerr << std::format("Error: {} : {}\n", t.label, e.what());
+          return EXIT_FAILURE;
+        }
+      }
+
+      print_overload(settings, overload, runs);
+      continue;
+    }
+
+    std::vector<server_run> runs;
+
+    for (auto const& t : targets) {
+      settings.host = t.host;
+      settings.port = t.port;
+      settings.server_pid = t.pid;
+
+      std::cerr << std::format("Running {} ({}:{}) with {} connections ...\n",
+          t.label, t.host, t.port, connections);
+
+      try {
+        runs.push_back({t, bench::run_load(settings), std::nullopt});
+
+        if (t.pid && syscall_seconds > 0)
+          runs.back().syscalls_per_request =
+            syscalls_per_request(settings, syscall_seconds);
+      } catch (std::exception const& e) {
+        std::cerr << std::format("Error: {} : {}\n", t.label, e.what());
+        return EXIT_FAILURE;
+      }
+    }
+
+    print_results(settings, runs);
+
+    if (cl.has("histogram"))
+      for (auto const& run : runs)
+        print_histogram(run.server.label, run.result.latency);
+  }
+
+  return EXIT_SUCCESS;
+}
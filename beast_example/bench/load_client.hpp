@@ -0,0 +1,408 @@
+#pragma once
+
+#include "latency_histogram.hpp"
+#include "process_usage.hpp"
+
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <format>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace bench {
+
+namespace beast = boost::beast;
+namespace http = beast::http;
+namespace asio = boost::asio;
+using tcp = boost::asio::ip::tcp;
+using clock = std::chrono::steady_clock;
+
+// What to run against a single server
+struct load_settings
+{
+  std::string host = "127.0.0.1";
+  std::string port = "8080";
+  std::string target = "/";
+
+  // Number of keep-alive connections and client threads driving them
+  std::size_t connections = 64;
+  std::size_t threads = 1;
+
+  // Requests sent back-to-back on a connection before reading the responses
+  // (HTTP/1.1 pipelining). One means no pipelining.
+  std::size_t pipeline = 1;
+
+  // Send a single request per connection (with Connection: close), so that
+  // every request costs the server an accept as well
+  bool close = false;
+
+  // Close each connection after this many responses, without telling the
+  // server first, so that its next read finds the end of the stream (as
+  // when a browser drops an idle connection). Zero means never.
+  std::size_t hangup = 0;
+
+  // Total request rate across all connections. Zero means closed loop i.e.
+  // every connection sends its next request as soon as a response arrives.
+  double rate = 0;
+
+  std::chrono::nanoseconds warmup = std::chrono::seconds(1);
+  std::chrono::nanoseconds duration = std::chrono::seconds(10);
+
+  // If set, the server's resource usage over the measured period is read
+  // from /proc (it must run on the same machine)
+  int server_pid = 0;
+};
+
+// What a run measured. Each client thread fills its own copy which are
+// merged once the threads have finished.
+struct load_result
+{
+  latency_histogram latency;
+
+  // Only the successful (2xx) responses, i.e. the requests the server took
+  // on rather than turned away. These are measured from when the request
+  // was sent, or from when its connection was established if it was the
+  // first on it. Under overload no client can keep to the schedule, and a
+  // full accept queue drops SYNs (leaving the client to retry a second
+  // later); this leaves out both, to show what the server did with the
+  // requests that it took on.
+  latency_histogram ok_latency;
+
+  std::uint64_t requests = 0;
+  std::uint64_t non_2xx = 0;
+  std::uint64_t errors = 0;
+  std::uint64_t bytes = 0;
+  std::chrono::nanoseconds elapsed{};
+
+  // The server's usage, when its pid was given
+  std::optional<process_usage> server;
+
+  void merge(load_result const& other)
+  {
+    latency.merge(other.latency);
+    ok_latency.merge(other.ok_latency);
+    requests += other.requests;
+    non_2xx += other.non_2xx;
+    errors += other.errors;
+    bytes += other.bytes;
+  }
+
+  double throughput() const
+  {
+    auto const s = std::chrono::duration<double>(elapsed).count();
+    return s > 0 ? requests / s : 0.0;
+  }
+};
+
+// A single keep-alive connection sending one request at a time.
+//
+// When a request rate is set, sends follow a fixed schedule and latency is
+// measured from the *scheduled* send time rather than the actual one. That
+// way a stalled server is charged for the requests it delayed (avoiding
+// 'coordinated omission') instead of the client quietly backing off.
+class load_connection : public std::enable_shared_from_this<load_connection>
+{
+  public:
+  load_connection(
+      asio::io_context& ioc,
+      tcp::resolver::results_type const& endpoints,
+      std::string const& request,
+      std::size_t pipeline,
+      std::size_t hangup,
+      load_result& result,
+      clock::time_point first_send,
+      clock::duration interval,
+      clock::time_point record_from,
+      clock::time_point deadline)
+    : stream_(ioc)
+    , pacer_(ioc)
+    , endpoints_(endpoints)
+    , request_(request)
+    , pipeline_(pipeline)
+    , hangup_(hangup)
+    , result_(result)
+    , next_send_(first_send)
+    , interval_(interval)
+    , record_from_(record_from)
+    , deadline_(deadline)
+  {
+  }
+
+  void run()
+  {
+    do_connect();
+  }
+
+  private:
+  void do_connect()
+  {
+    reused_ = false;
+    served_ = 0;
+
+    stream_.expires_after(std::chrono::seconds(5));
+    stream_.async_connect(endpoints_,
+        [self = shared_from_this()](beast::error_code ec, auto const&) {
+          self->on_connect(ec);
+        });
+  }
+
+  void on_connect(beast::error_code ec)
+  {
+    if (ec) return on_error();
+
+    started_ = clock::now();
+    stream_.socket().set_option(tcp::no_delay(true), ec);
+    do_pace();
+  }
+
+  void do_pace()
+  {
+    auto const now = clock::now();
+    if (now >= deadline_) return close();
+
+    // Closed loop - send straight away
+    if (interval_ == clock::duration::zero()) {
+      next_send_ = now;
+      return do_write();
+    }
+
+    if (next_send_ >= deadline_) return close();
+
+    pacer_.expires_at(next_send_);
+    pacer_.async_wait(
+        [self = shared_from_this()](beast::error_code ec) {
+          if (!ec) self->do_write();
+        });
+  }
+
+  // Sends the whole pipeline in one go ('request_' holds every copy)
+  void do_write()
+  {
+    // A new connection may have been open for a while, waiting for the
+    // scheduled send
+    started_ = reused_ ? clock::now() : std::max(started_, next_send_);
+    received_ = 0;
+    stream_.expires_after(std::chrono::seconds(30));
+    asio::async_write(stream_, asio::buffer(request_),
+        [self = shared_from_this()](beast::error_code ec, std::size_t) {
+          if (ec) return self->on_error();
+          self->do_read();
+        });
+  }
+
+  void do_read()
+  {
+    parser_.emplace();
+    parser_->body_limit(std::numeric_limits<std::uint64_t>::max());
+
+    http::async_read(stream_, buffer_, *parser_,
+        [self = shared_from_this()](beast::error_code ec, std::size_t n) {
+          self->on_read(ec, n);
+        });
+  }
+
+  void on_read(beast::error_code ec, std::size_t bytes_transferred)
+  {
+    if (ec) return on_error();
+
+    auto const now = clock::now();
+    auto const& res = parser_->get();
+
+    if (now >= record_from_ && now < deadline_) {
+      auto const ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+          now - next_send_).count();
+      result_.latency.record(ns);
+      ++result_.requests;
+      result_.bytes += bytes_transferred;
+      if (res.result_int() / 100 != 2)
+        ++result_.non_2xx;
+      else
+        result_.ok_latency.record(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(
+              now - started_).count());
+    }
+
+    reused_ = true;
+
+    // The server wants to close - open a new connection
+    if (!res.keep_alive()) {
+      next_send_ += interval_;
+      reconnect();
+      return;
+    }
+
+    // Wait for the rest of the pipelined responses
+    if (++received_ < pipeline_) return do_read();
+
+    next_send_ += interval_;
+
+    // Hang up on the server
+    served_ += received_;
+    if (hangup_ && served_ >= hangup_) return reconnect();
+
+    do_pace();
+  }
+
+  void on_error()
+  {
+    if (clock::now() >= deadline_) return close();
+
+    if (clock::now() >= record_from_) ++result_.errors;
+
+    // Back off briefly so a dead server does not turn into a busy loop
+    pacer_.expires_after(std::chrono::milliseconds(10));
+    pacer_.async_wait(
+        [self = shared_from_this()](beast::error_code ec) {
+          if (!ec) self->reconnect();
+        });
+  }
+
+  void reconnect()
+  {
+    beast::error_code ec;
+    stream_.socket().close(ec);
+    buffer_.clear();
+    do_connect();
+  }
+
+  void close()
+  {
+    beast::error_code ec;
+    stream_.socket().shutdown(tcp::socket::shutdown_both, ec);
+    stream_.close();
+  }
+
+  beast::tcp_stream stream_;
+  asio::steady_timer pacer_;
+  tcp::resolver::results_type endpoints_;
+  std::string const& request_;
+  std::size_t pipeline_;
+  std::size_t received_ = 0;
+  std::size_t hangup_;
+  std::size_t served_ = 0;
+  load_result& result_;
+
+  beast::flat_buffer buffer_;
+  std::optional<http::response_parser<http::string_body>> parser_;
+
+  clock::time_point next_send_;
+  clock::time_point started_;
+  bool reused_ = false;
+  clock::duration interval_;
+  clock::time_point record_from_;
+  clock::time_point deadline_;
+};
+
+// A connection that closes after one request cannot pipeline
+inline std::size_t pipeline_depth(load_settings const& settings)
+{
+  return settings.close ? 1 : std::max<std::size_t>(1, settings.pipeline);
+}
+
+// Build the request(s) that every connection sends in one write
+inline std::string make_request(load_settings const& settings)
+{
+  auto const one = std::format(
+      "GET {} HTTP/1.1\r\n"
+      "Host: {}:{}\r\n"
+      "User-Agent: http_bench\r\n"
+      "{}"
+      "\r\n",
+      settings.target, settings.host, settings.port,
+      settings.close ? "Connection: close\r\n" : "");
+
+  std::string request;
+  for (std::size_t i = 0; i < pipeline_depth(settings); ++i)
+    request += one;
+
+  return request;
+}
+
+// Drive one server with the given settings and return what was measured
+inline load_result run_load(load_settings const& settings)
+{
+  auto const request = make_request(settings);
+  auto const threads = std::max<std::size_t>(1, settings.threads);
+
+  asio::io_context resolver_ioc;
+  tcp::resolver resolver(resolver_ioc);
+  auto const endpoints = resolver.resolve(settings.host, settings.port);
+
+  // Every connection sends a pipeline of requests at rate / connections
+  auto const pipeline = pipeline_depth(settings);
+
+  clock::duration interval = clock::duration::zero();
+  if (settings.rate > 0)
+    interval = std::chrono::duration_cast<clock::duration>(
+        std::chrono::duration<double>(
+          settings.connections * pipeline / settings.rate));
+
+  auto const start = clock::now();
+  auto const record_from = start + settings.warmup;
+  auto const deadline = record_from + settings.duration;
+
+  std::vector<std::unique_ptr<asio::io_context>> contexts;
+  std::vector<load_result> results(threads);
+
+  for (std::size_t t = 0; t < threads; ++t)
+    contexts.push_back(std::make_unique<asio::io_context>(1));
+
+  for (std::size_t i = 0; i < settings.connections; ++i) {
+    auto const t = i % threads;
+
+    // Stagger the first sends so the connections do not fire in lockstep
+    auto const offset = interval * static_cast<long>(i)
+      / static_cast<long>(settings.connections);
+
+    std::make_shared<load_connection>(
+        *contexts[t], endpoints, request, pipeline, settings.hangup, results[t],
+        start + offset, interval, record_from, deadline)->run();
+  }
+
+  // Read the server's usage as the measured period starts and ends
+  std::optional<process_usage> usage_start, usage_end;
+  asio::steady_timer usage_timer(*contexts[0], record_from);
+
+  if (settings.server_pid)
+    usage_timer.async_wait([&](beast::error_code ec) {
+        if (ec) return;
+        usage_start = process_usage::read(settings.server_pid);
+
+        usage_timer.expires_at(deadline);
+        usage_timer.async_wait([&](beast::error_code ec) {
+            if (!ec) usage_end = process_usage::read(settings.server_pid);
+          });
+      });
+
+  // Don't wait for stragglers (e.g. a server that stopped responding)
+  std::vector<asio::steady_timer> stoppers;
+  for (auto& ioc : contexts) {
+    stoppers.emplace_back(*ioc, deadline + std::chrono::seconds(2));
+    stoppers.back().async_wait([&ioc](beast::error_code) { ioc->stop(); });
+  }
+
+  std::vector<std::thread> workers;
+  for (std::size_t t = 0; t < threads; ++t)
+    workers.emplace_back([&ioc = *contexts[t]] { ioc.run(); });
+
+  for (auto& w : workers) w.join();
+
+  load_result total;
+  for (auto const& r : results) total.merge(r);
+  total.elapsed = settings.duration;
+
+  if (usage_start && usage_end)
+    total.server = *usage_end - *usage_start;
+
+  return total;
+}
+
+} // namespace bench
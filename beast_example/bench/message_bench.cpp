@@ -0,0 +1,344 @@
+// The Beast building blocks that every request goes through, one at a
+// time, apart from the rest of the server.
+//
+// request_bench and response_bench compare the servers' own paths (the
+// arena, the cached responses) with what they replaced. This one measures
+// the pieces underneath, so that a change in any of them (or in Beast)
+// shows up on its own:
+//
+//  - reading a request with http::read, into a fresh request and buffer,
+//    into a fresh request with the session's buffer, through a parser
+//    kept in the session, and into the session's arena;
+//  - serializing a response through a message_generator against a
+//    response_serializer over the same response;
+//  - prepare_payload, setting a typical set of response headers, and
+//    growing a flat_buffer a read at a time.
+//
+// The requests are read from memory rather than a socket, so only the
+// parsing and the allocations are measured.
+
+#include "microbench.hpp"
+#include "request_arena.hpp"
+
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+
+#include <cstddef>
+#include <cstdlib>
+#include <format>
+#include <optional>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace beast = boost::beast;
+namespace http = beast::http;
+namespace asio = boost::asio;
+
+// What a browser typically sends
+constexpr std::string_view browser_get =
+  "GET /index.html HTTP/1.1\r\n"
+  "Host: localhost:8080\r\n"
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) "
+    "Gecko/20100101 Firefox/112.0\r\n"
+  "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+    "image/avif,image/webp,*/*;q=0.8\r\n"
+  "Accept-Language: en-GB,en;q=0.5\r\n"
+  "Accept-Encoding: gzip, deflate, br\r\n"
+  "Connection: keep-alive\r\n"
+  "Upgrade-Insecure-Requests: 1\r\n"
+  "Sec-Fetch-Dest: document\r\n"
+  "Sec-Fetch-Mode: navigate\r\n"
+  "Sec-Fetch-Site: none\r\n"
+  "Sec-Fetch-User: ?1\r\n"
+  "\r\n";
+
+// A small form submission, so that the body is read too
+constexpr std::string_view form_post =
+  "POST /submit HTTP/1.1\r\n"
+  "Host: localhost:8080\r\n"
+  "User-Agent: curl/7.88.1\r\n"
+  "Accept: */*\r\n"
+  "Content-Type: application/x-www-form-urlencoded\r\n"
+  "Content-Length: 64\r\n"
+  "\r\n"
+  "name=ACCU+2023&talk=coroutines&session=beast&rating=5&ok=yes&x=1";
+
+constexpr std::string_view page =
+  "<!DOCTYPE html>\n<html><head><title>Boost.Beast</title></head>\n"
+  "<body><p>Hello ACCU 2023 from the Asynchronous Server!</p></body>\n"
+  "</html>\n";
+
+// A SyncReadStream that hands out the same bytes each time it is rewound,
+// in reads of at most 'read_size' bytes, as a socket might
+class memory_stream
+{
+  std::string_view data_;
+  std::size_t read_size_;
+  std::size_t pos_ = 0;
+
+  public:
+  explicit memory_stream(std::string_view data, std::size_t read_size = 4096)
+    : data_(data)
+    , read_size_(read_size)
+  {
+  }
+
+  void rewind() { pos_ = 0; }
+
+  template <class MutableBufferSequence>
+  std::size_t read_some(
+      MutableBufferSequence const& buffers,
+      beast::error_code& ec)
+  {
+    ec = {};
+    if (pos_ == data_.size()) {
+      ec = asio::error::eof;
+      return 0;
+    }
+
+    auto const n = asio::buffer_copy(buffers,
+        asio::buffer(data_.substr(pos_, read_size_)));
+    pos_ += n;
+    return n;
+  }
+
+  template <class MutableBufferSequence>
+  std::size_t read_some(MutableBufferSequence const& buffers)
+  {
+    beast::error_code ec;
+    auto const n = read_some(buffers, ec);
+    if (ec) throw beast::system_error(ec);
+    return n;
+  }
+};
+
+template <class Message>
+std::size_t checked(Message const& req, beast::error_code ec)
+{
+  if (ec) std::abort();
+  return std::distance(req.begin(), req.end()) + req.body().size();
+}
+
+// No state kept between requests: what a one-shot handler does
+std::size_t read_fresh(memory_stream& stream)
+{
+  stream.rewind();
+  beast::flat_buffer buffer;
+  http::request<http::string_body> req;
+
+  beast::error_code ec;
+  http::read(stream, buffer, req, ec);
+  return checked(req, ec);
+}
+
+// The session keeps its buffer, the request is new (the servers before
+// the arena)
+std::size_t read_request(memory_stream& stream, beast::flat_buffer& buffer)
+{
+  stream.rewind();
+  http::request<http::string_body> req;
+
+  beast::error_code ec;
+  http::read(stream, buffer, req, ec);
+  return checked(req, ec);
+}
+
+// The session keeps its buffer and a parser. A Beast parser cannot be
+// reset once it has finished a message, so "reusing" it means emplacing a
+// new one in the same storage, with its limits set again.
+std::size_t read_parser(
+    memory_stream& stream,
+    beast::flat_buffer& buffer,
+    std::optional<http::request_parser<http::string_body>>& parser)
+{
+  stream.rewind();
+  parser.emplace();
+  parser->header_limit(8 * 1024);
+  parser->body_limit(1024 * 1024);
+
+  beast::error_code ec;
+  http::read(stream, buffer, *parser, ec);
+  return checked(parser->get(), ec);
+}
+
+// The session keeps its buffer and its arena (what the servers do now)
+std::size_t read_arena(
+    memory_stream& stream,
+    beast::flat_buffer& buffer,
+    arena::request_arena& a)
+{
+  stream.rewind();
+  auto& req = a.renew();
+
+  beast::error_code ec;
+  http::read(stream, buffer, req, ec);
+  return checked(req, ec);
+}
+
+// The headers of a typical page, besides the ones prepare_payload and
+// keep_alive set
+template <class Fields>
+void set_headers(Fields& fields)
+{
+  fields.set(http::field::server, "Boost.Beast");
+  fields.set(http::field::date, "Sun, 16 Apr 2023 12:00:00 GMT");
+  fields.set(http::field::content_type, "text/html; charset=utf-8");
+  fields.set(http::field::cache_control, "public, max-age=3600");
+  fields.set(http::field::etag, "\"5f3e-1a2b3c4d\"");
+  fields.set(http::field::last_modified, "Sat, 15 Apr 2023 09:30:00 GMT");
+  fields.set(http::field::vary, "Accept-Encoding");
+}
+
+http::response<http::string_body> make_response(bool keep_alive)
+{
+  http::response<http::string_body> res{http::status::ok, 11};
+  set_headers(res);
+  res.body() = page;
+  res.prepare_payload();
+  res.keep_alive(keep_alive);
+  return res;
+}
+
+// The type-erased path that beast::write / beast::async_write take
+std::size_t serialize_generator(bool keep_alive)
+{
+  http::message_generator msg = make_response(keep_alive);
+
+  std::size_t total = 0;
+  beast::error_code ec;
+  while (!msg.is_done()) {
+    auto const buffers = msg.prepare(ec);
+    auto const n = beast::buffer_bytes(buffers);
+    total += n;
+    msg.consume(n);
+  }
+  return total;
+}
+
+// The serializer used directly, as http::write does
+std::size_t serialize_direct(bool keep_alive)
+{
+  auto const res = make_response(keep_alive);
+  http::response_serializer<http::string_body> sr(res);
+
+  std::size_t total = 0;
+  beast::error_code ec;
+  while (!sr.is_done()) {
+    std::size_t n = 0;
+    sr.next(ec, [&](beast::error_code&, auto const& buffers) {
+      n = beast::buffer_bytes(buffers);
+    });
+    total += n;
+    sr.consume(n);
+  }
+  return total;
+}
+
+// Fill a buffer the way a read loop does, 'read' bytes at a time, up to
+// 'total', then hand it all on
+std::size_t fill(beast::flat_buffer& buffer, std::size_t read,
+    std::size_t total)
+{
+  while (buffer.size() < total) {
+    auto const b = buffer.prepare(read);
+    static_cast<char*>(b.data())[0] = 'x';
+    buffer.commit(read);
+  }
+
+  auto const n = buffer.size();
+  buffer.consume(n);
+  return n;
+}
+
+int main()
+{
+  std::vector<microbench::result> results;
+
+  // Reading
+  for (auto const& [name, text] : {std::pair{"GET", browser_get},
+                                   std::pair{"POST", form_post}}) {
+    memory_stream stream(text);
+    beast::flat_buffer buffer;
+    std::optional<http::request_parser<http::string_body>> parser;
+    arena::request_arena a;
+
+    results.push_back(microbench::run(
+        std::format("read, new buffer ({})", name),
+        [&] { microbench::do_not_optimize(read_fresh(stream)); }));
+
+    results.push_back(microbench::run(
+        std::format("read, session buffer ({})", name),
+        [&] { microbench::do_not_optimize(read_request(stream, buffer)); }));
+
+    results.push_back(microbench::run(
+        std::format("read, session parser ({})", name),
+        [&] {
+          microbench::do_not_optimize(read_parser(stream, buffer, parser));
+        }));
+
+    results.push_back(microbench::run(
+        std::format("read, session arena ({})", name),
+        [&] { microbench::do_not_optimize(read_arena(stream, buffer, a)); }));
+  }
+
+  // Serializing
+  results.push_back(microbench::run("write, message_generator",
+      [] { microbench::do_not_optimize(serialize_generator(true)); }));
+
+  results.push_back(microbench::run("write, response_serializer",
+      [] { microbench::do_not_optimize(serialize_direct(true)); }));
+
+  // Building a response
+  {
+    http::response<http::string_body> res{http::status::ok, 11};
+    res.body() = page;
+
+    results.push_back(microbench::run("prepare_payload",
+        [&] {
+          res.prepare_payload();
+          microbench::do_not_optimize(res);
+        }));
+  }
+
+  results.push_back(microbench::run("set headers (fresh fields)",
+      [] {
+        http::fields fields;
+        set_headers(fields);
+        microbench::do_not_optimize(fields);
+      }));
+
+  {
+    http::fields fields;
+    results.push_back(microbench::run("set headers (cleared fields)",
+        [&] {
+          fields.clear();
+          set_headers(fields);
+          microbench::do_not_optimize(fields);
+        }));
+  }
+
+  // Buffer growth: 64 KiB read 1 KiB at a time
+  results.push_back(microbench::run("flat_buffer growth (fresh)",
+      [] {
+        beast::flat_buffer buffer;
+        microbench::do_not_optimize(fill(buffer, 1024, 65536));
+      }));
+
+  results.push_back(microbench::run("flat_buffer growth (reserved)",
+      [] {
+        beast::flat_buffer buffer;
+        buffer.reserve(65536);
+        microbench::do_not_optimize(fill(buffer, 1024, 65536));
+      }));
+
+  {
+    beast::flat_buffer buffer;
+    results.push_back(microbench::run("flat_buffer growth (reused)",
+        [&] { microbench::do_not_optimize(fill(buffer, 1024, 65536)); }));
+  }
+
+  microbench::print(results);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+// A minimal Google-Benchmark style harness for the micro benchmarks.
+//
+// Each case is run in growing batches until it has taken at least the
+// minimum time, then the time and the number of global heap allocations
+// per operation are reported. Allocations are counted by replacing the
+// global operator new, so this header must only be included by the one
+// translation unit of a benchmark program.
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <format>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+namespace microbench {
+
+inline std::atomic<std::uint64_t> allocations{0};
+
+struct result
+{
+  std::string name;
+  std::uint64_t iterations = 0;
+  double ns_per_op = 0;
+  double allocs_per_op = 0;
+};
+
+// Stop the compiler from optimising away a value that is never used
+template <class T>
+inline void do_not_optimize(T const& value)
+{
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+// Run 'op' (a callable taking no arguments) and measure it
+template <class Op>
+result run(
+    std::string name,
+    Op&& op,
+    std::chrono::nanoseconds min_time = std::chrono::milliseconds(500))
+{
+  using clock = std::chrono::steady_clock;
+
+  // Warm up caches, pools and branch predictors
+  for (int i = 0; i < 1000; ++i) op();
+
+  std::uint64_t iterations = 1000;
+  for (;;) {
+    auto const allocs = allocations.load(std::memory_order_relaxed);
+    auto const start = clock::now();
+
+    for (std::uint64_t i = 0; i < iterations; ++i) op();
+
+    auto const elapsed = clock::now() - start;
+    auto const allocated = allocations.load(std::memory_order_relaxed) - allocs;
+
+    if (elapsed >= min_time || iterations >= (std::uint64_t(1) << 40))
+      return result{
+        std::move(name), iterations,
+        std::chrono::duration<double, std::nano>(elapsed).count() / iterations,
+        double(allocated) / iterations};
+
+    iterations *= 2;
+  }
+}
+
+inline void print(std::vector<result> const& results)
+{
+  std::cout << std::format("{:<40} {:>14} {:>12} {:>12}\n",
+      "benchmark", "iterations", "ns/op", "allocs/op");
+
+  for (auto const& r : results)
+    std::cout << std::format("{:<40} {:>14} {:>12.1f} {:>12.2f}\n",
+        r.name, r.iterations, r.ns_per_op, r.allocs_per_op);
+}
+
+} // namespace microbench
+
+// Count every global heap allocation made by the benchmark program
+void* operator new(std::size_t size)
+{
+  microbench::allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void* p = std::malloc(size ? size : 1)) return p;
+  throw std::bad_alloc();
+}
+
+void* operator new[](std::size_t size)
+{
+  return ::operator new(size);
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
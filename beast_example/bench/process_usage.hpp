@@ -0,0 +1,99 @@
+#pragma once
+
+#include <charconv>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+
+#include <unistd.h>
+
+namespace bench {
+
+// The CPU time and context switches a (server) process has used so far,
+// read from /proc. This only needs the process to belong to the same user,
+// and costs it nothing, so it can be read around a measured run.
+//
+// /proc/<pid>/io also has syscall counts, but only for calls through the
+// VFS read/write paths - the recvmsg/sendmsg that Asio uses on sockets
+// (and anything io_uring does) never show up there. Use count_syscalls
+// (see syscall_census.hpp) for those.
+struct process_usage
+{
+  double user_seconds = 0;
+  double system_seconds = 0;
+  std::uint64_t voluntary_switches = 0;
+  std::uint64_t involuntary_switches = 0;
+
+  static std::optional<process_usage> read(int pid)
+  {
+    auto const proc = std::filesystem::path("/proc") / std::to_string(pid);
+    process_usage u;
+
+    // utime and stime are the 14th and 15th fields, counting from the pid,
+    // and the command name (2nd) may contain spaces
+    std::ifstream stat(proc / "stat");
+    std::string s;
+    if (!std::getline(stat, s)) return std::nullopt;
+    std::istringstream fields(s.substr(s.rfind(')') + 2));
+    std::string field;
+    for (int i = 3; i <= 15 && fields >> field; ++i) {
+      auto const ticks = double(sysconf(_SC_CLK_TCK));
+      if (i == 14) u.user_seconds = number(field, 0) / ticks;
+      if (i == 15) u.system_seconds = number(field, 0) / ticks;
+    }
+
+    // Context switches are only reported per thread
+    std::error_code ec;
+    for (auto const& task :
+         std::filesystem::directory_iterator(proc / "task", ec)) {
+      std::ifstream status(task.path() / "status");
+      for (std::string line; std::getline(status, line); ) {
+        if (line.starts_with("voluntary_ctxt_switches:"))
+          u.voluntary_switches += number(line, 24);
+        if (line.starts_with("nonvoluntary_ctxt_switches:"))
+          u.involuntary_switches += number(line, 27);
+      }
+    }
+
+    return u;
+  }
+
+  // The usage between two readings
+  process_usage operator-(process_usage const& earlier) const
+  {
+    return {
+      user_seconds - earlier.user_seconds,
+      system_seconds - earlier.system_seconds,
+      voluntary_switches - earlier.voluntary_switches,
+      involuntary_switches - earlier.involuntary_switches};
+  }
+
+  private:
+  static std::uint64_t number(std::string_view s, std::size_t from)
+  {
+    s.remove_prefix(std::min(from, s.size()));
+    while (!s.empty() && (s.front() == ' ' || s.front() == '\t'))
+      s.remove_prefix(1);
+
+    std::uint64_t value = 0;
+    std::from_chars(s.data(), s.data() + s.size(), value);
+    return value;
+  }
+};
+
+// A process's resident memory, read from /proc/<pid>/statm (whose second
+// field is the number of resident pages)
+inline std::optional<std::uint64_t> resident_bytes(int pid)
+{
+  std::ifstream statm(
+      std::filesystem::path("/proc") / std::to_string(pid) / "statm");
+  std::uint64_t size = 0, resident = 0;
+  if (!(statm >> size >> resident)) return std::nullopt;
+  return resident * std::uint64_t(sysconf(_SC_PAGESIZE));
+}
+
+} // namespace bench
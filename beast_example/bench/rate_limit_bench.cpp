@@ -0,0 +1,87 @@
+// The cost of rate limiting a request (see rate_limit.hpp).
+//
+// The servers call limiter::allow() once per request, with the time, and
+// limiter::exhausted() once per connection. Both are measured for one
+// client (which always finds its bucket in the same shard, and in cache),
+// and for many clients taken in turn, when the buckets are spread over the
+// shards and mostly not in cache. The end-to-end overhead is the
+// difference between a server run with and without --rate-limit, e.g.
+//
+//   async_http_server 127.0.0.1 8080 1 &
+//   async_http_server 127.0.0.1 8081 1 --rate-limit=1e9 &
+//   http_bench --pipeline=16 async=127.0.0.1:8080 limited=127.0.0.1:8081
+//
+// but on a busy machine that is usually lost in the noise of the rest of
+// the request.
+
+#include "microbench.hpp"
+#include "rate_limit.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <format>
+#include <memory>
+#include <vector>
+
+namespace asio = boost::asio;
+
+std::vector<asio::ip::address> make_clients(std::size_t n)
+{
+  std::vector<asio::ip::address> clients;
+  clients.reserve(n);
+  for (std::size_t i = 0; i < n; ++i)
+    clients.push_back(asio::ip::address_v4(0x0a000000u + std::uint32_t(i)));
+  return clients;
+}
+
+int main()
+{
+  std::vector<microbench::result> results;
+
+  // Never over the limit, unless said otherwise
+  auto const limiter = std::make_unique<rate_limit::limiter>();
+  limiter->configure(1e9, 1'000'000);
+
+  for (std::size_t const n : {1, 1000, 100'000}) {
+    auto const clients = make_clients(n);
+    std::size_t i = 0;
+
+    results.push_back(microbench::run(
+        std::format("allow ({} client{})", n, n == 1 ? "" : "s"),
+        [&] {
+          auto const& client = clients[i++ % n];
+          microbench::do_not_optimize(
+              limiter->allow(client, rate_limit::clock::now()));
+        }));
+
+    results.push_back(microbench::run(
+        std::format("exhausted ({} client{})", n, n == 1 ? "" : "s"),
+        [&] {
+          auto const& client = clients[i++ % n];
+          microbench::do_not_optimize(
+              limiter->exhausted(client, rate_limit::clock::now()));
+        }));
+  }
+
+  // A client that is always over the limit, which is answered 429
+  auto const strict = std::make_unique<rate_limit::limiter>();
+  strict->configure(1, 1);
+  auto const client = make_clients(1).front();
+
+  results.push_back(microbench::run("allow (over the limit)",
+      [&] {
+        microbench::do_not_optimize(
+            strict->allow(client, rate_limit::clock::now()));
+      }));
+
+  // What the server pays anyway, for comparison
+  results.push_back(microbench::run("clock::now()",
+      [&] {
+        microbench::do_not_optimize(rate_limit::clock::now());
+      }));
+
+  microbench::print(results);
+
+  return EXIT_SUCCESS;
+}
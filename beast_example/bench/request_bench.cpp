@@ -0,0 +1,100 @@
+// Per-request cost of parsing a request: into a default http::request,
+// whose fields are each allocated from the global heap (what the servers
+// used to do), against into an arena::request that is renewed for every
+// request (see request_arena.hpp).
+//
+// Both cases parse through an http::request_parser constructed from the
+// empty request, which is what http::read / http::async_read do.
+
+#include "microbench.hpp"
+#include "request_arena.hpp"
+
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+
+#include <string_view>
+
+namespace beast = boost::beast;
+namespace http = beast::http;
+namespace asio = boost::asio;
+
+// What a browser typically sends
+constexpr std::string_view browser_get =
+  "GET /index.html HTTP/1.1\r\n"
+  "Host: localhost:8080\r\n"
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) "
+    "Gecko/20100101 Firefox/112.0\r\n"
+  "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+    "image/avif,image/webp,*/*;q=0.8\r\n"
+  "Accept-Language: en-GB,en;q=0.5\r\n"
+  "Accept-Encoding: gzip, deflate, br\r\n"
+  "Connection: keep-alive\r\n"
+  "Upgrade-Insecure-Requests: 1\r\n"
+  "Sec-Fetch-Dest: document\r\n"
+  "Sec-Fetch-Mode: navigate\r\n"
+  "Sec-Fetch-Site: none\r\n"
+  "Sec-Fetch-User: ?1\r\n"
+  "\r\n";
+
+// A small form submission, so that the body is allocated too
+constexpr std::string_view form_post =
+  "POST /submit HTTP/1.1\r\n"
+  "Host: localhost:8080\r\n"
+  "User-Agent: curl/7.88.1\r\n"
+  "Accept: */*\r\n"
+  "Content-Type: application/x-www-form-urlencoded\r\n"
+  "Content-Length: 64\r\n"
+  "\r\n"
+  "name=ACCU+2023&talk=coroutines&session=beast&rating=5&ok=yes&x=1";
+
+template <class Body, class Allocator>
+std::size_t parse(
+    http::request<Body, http::basic_fields<Allocator>>& req,
+    std::string_view text)
+{
+  http::request_parser<Body, Allocator> parser(std::move(req));
+  parser.eager(true);
+
+  beast::error_code ec;
+  parser.put(asio::buffer(text.data(), text.size()), ec);
+  if (ec || !parser.is_done()) std::abort();
+
+  req = parser.release();
+  return std::distance(req.begin(), req.end()) + req.body().size();
+}
+
+// The old per-request path: a fresh default request every time
+std::size_t parse_default(std::string_view text)
+{
+  http::request<http::string_body> req;
+  return parse(req, text);
+}
+
+// The arena path: the session's arena is reset and reused
+std::size_t parse_arena(arena::request_arena& a, std::string_view text)
+{
+  return parse(a.renew(), text);
+}
+
+int main()
+{
+  arena::request_arena a;
+
+  std::vector<microbench::result> results;
+
+  results.push_back(microbench::run("http::request (browser GET)",
+      [] { microbench::do_not_optimize(parse_default(browser_get)); }));
+
+  results.push_back(microbench::run("arena::request (browser GET)",
+      [&] { microbench::do_not_optimize(parse_arena(a, browser_get)); }));
+
+  results.push_back(microbench::run("http::request (form POST)",
+      [] { microbench::do_not_optimize(parse_default(form_post)); }));
+
+  results.push_back(microbench::run("arena::request (form POST)",
+      [&] { microbench::do_not_optimize(parse_arena(a, form_post)); }));
+
+  microbench::print(results);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,77 @@
+// Per-request CPU cost of producing a response: building and serializing an
+// http::response every time (what the servers used to do) against handing
+// out the buffers of a shared cached_response.
+//
+// Both cases stop short of the socket; the serialized buffers are walked
+// and their sizes summed, which is what a gathered write needs from them.
+
+#include "microbench.hpp"
+#include "response_cache.hpp"
+
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+
+namespace beast = boost::beast;
+namespace http = beast::http;
+namespace asio = boost::asio;
+
+constexpr char body[] = "Hello ACCU 2023 from the Asynchronous Server!";
+
+// The old per-request path: build the response and serialize it through a
+// message_generator, as beast::write / beast::async_write do
+std::size_t build_and_serialize(unsigned version, bool keep_alive)
+{
+  http::response<http::string_body> res{http::status::ok, version};
+  res.set(http::field::server, "Boost.Beast");
+  res.body() = body;
+  res.prepare_payload();
+  res.keep_alive(keep_alive);
+
+  http::message_generator msg{std::move(res)};
+
+  std::size_t total = 0;
+  beast::error_code ec;
+  while (!msg.is_done()) {
+    auto const buffers = msg.prepare(ec);
+    auto const n = beast::buffer_bytes(buffers);
+    total += n;
+    msg.consume(n);
+  }
+  return total;
+}
+
+// The cached path: select the pre-built buffers for this request
+std::size_t cached(
+    std::shared_ptr<response_cache::cached_response const> const& res,
+    unsigned version,
+    bool keep_alive)
+{
+  std::size_t total = 0;
+  for (auto const& b : res->buffers(version, keep_alive))
+    total += b.size();
+  return total;
+}
+
+int main()
+{
+  auto const hello = response_cache::make_cached_response(
+      http::status::ok, "Boost.Beast", body);
+
+  std::vector<microbench::result> results;
+
+  results.push_back(microbench::run("build + serialize (1.1 keep-alive)",
+      [] { microbench::do_not_optimize(build_and_serialize(11, true)); }));
+
+  results.push_back(microbench::run("cached_response (1.1 keep-alive)",
+      [&] { microbench::do_not_optimize(cached(hello, 11, true)); }));
+
+  results.push_back(microbench::run("build + serialize (1.0 close)",
+      [] { microbench::do_not_optimize(build_and_serialize(10, false)); }));
+
+  results.push_back(microbench::run("cached_response (1.0 close)",
+      [&] { microbench::do_not_optimize(cached(hello, 10, false)); }));
+
+  microbench::print(results);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,169 @@
+// The cost of finding a request's route (see router.hpp).
+//
+// The compile-time table hashes the target once and compares it with the
+// one route in that slot. It is measured against the chain of comparisons
+// a hand-written handler would do, for a table as small as the servers' and
+// for one with 48 routes, looking up a mix of the routes and of targets
+// that have none.
+
+#include "microbench.hpp"
+#include "router.hpp"
+
+#include <array>
+#include <cstddef>
+#include <cstdlib>
+#include <span>
+#include <string_view>
+
+namespace http = boost::beast::http;
+
+using route = routing::route<int>;
+
+constexpr route small_routes[] = {
+  {http::verb::get,  "/",       0},
+  {http::verb::head, "/",       1},
+  {http::verb::get,  "/health", 2},
+  {http::verb::head, "/health", 3},
+};
+
+constexpr route large_routes[] = {
+  {http::verb::get,    "/",                     0},
+  {http::verb::head,   "/",                     1},
+  {http::verb::get,    "/health",               2},
+  {http::verb::head,   "/health",               3},
+  {http::verb::get,    "/metrics",              4},
+  {http::verb::get,    "/api/v1/users",         5},
+  {http::verb::post,   "/api/v1/users",         6},
+  {http::verb::get,    "/api/v1/users/me",      7},
+  {http::verb::put,    "/api/v1/users/me",      8},
+  {http::verb::delete_,"/api/v1/users/me",      9},
+  {http::verb::get,    "/api/v1/groups",        10},
+  {http::verb::post,   "/api/v1/groups",        11},
+  {http::verb::get,    "/api/v1/orders",        12},
+  {http::verb::post,   "/api/v1/orders",        13},
+  {http::verb::get,    "/api/v1/orders/recent", 14},
+  {http::verb::get,    "/api/v1/products",      15},
+  {http::verb::post,   "/api/v1/products",      16},
+  {http::verb::get,    "/api/v1/cart",          17},
+  {http::verb::put,    "/api/v1/cart",          18},
+  {http::verb::delete_,"/api/v1/cart",          19},
+  {http::verb::post,   "/api/v1/checkout",      20},
+  {http::verb::get,    "/api/v1/search",        21},
+  {http::verb::get,    "/api/v1/tags",          22},
+  {http::verb::get,    "/api/v1/status",        23},
+  {http::verb::get,    "/api/v2/users",         24},
+  {http::verb::post,   "/api/v2/users",         25},
+  {http::verb::get,    "/api/v2/groups",        26},
+  {http::verb::get,    "/api/v2/orders",        27},
+  {http::verb::post,   "/api/v2/orders",        28},
+  {http::verb::get,    "/api/v2/products",      29},
+  {http::verb::get,    "/api/v2/search",        30},
+  {http::verb::get,    "/api/v2/status",        31},
+  {http::verb::post,   "/login",                32},
+  {http::verb::post,   "/logout",               33},
+  {http::verb::get,    "/login",                34},
+  {http::verb::get,    "/signup",               35},
+  {http::verb::post,   "/signup",               36},
+  {http::verb::get,    "/about",                37},
+  {http::verb::get,    "/contact",              38},
+  {http::verb::post,   "/contact",              39},
+  {http::verb::get,    "/favicon.ico",          40},
+  {http::verb::get,    "/robots.txt",           41},
+  {http::verb::get,    "/sitemap.xml",          42},
+  {http::verb::get,    "/ws",                   43},
+  {http::verb::get,    "/admin",                44},
+  {http::verb::get,    "/admin/stats",          45},
+  {http::verb::post,   "/admin/reload",         46},
+  {http::verb::options,"/api/v1/users",         47},
+};
+
+constexpr auto small_table = routing::make_route_table<int>(small_routes);
+constexpr auto large_table = routing::make_route_table<int>(large_routes);
+
+// What a handler without a table does: try each route in turn
+int linear_find(
+    std::span<route const> routes,
+    http::verb method,
+    std::string_view target)
+{
+  for (auto const& r : routes)
+    if (r.method == method && r.target == target) return r.handler;
+  return -1;
+}
+
+template <class Table>
+int table_find(Table const& table, http::verb method, std::string_view target)
+{
+  auto const* r = table.find(method, target);
+  return r ? r->handler : -1;
+}
+
+struct lookup
+{
+  http::verb method;
+  std::string_view target;
+};
+
+// Every route, and then as many misses, so neither side can predict
+template <std::size_t N>
+std::array<lookup, 2 * N> make_lookups(route const (&routes)[N])
+{
+  static constexpr std::string_view misses[] = {
+    "/index.html", "/api/v1/user", "/api/v3/users", "/healthz",
+    "/static/app.js", "/api/v1/orders/1234", "/admin/", "/x",
+  };
+
+  std::array<lookup, 2 * N> lookups;
+  for (std::size_t i = 0; i < N; ++i) {
+    lookups[i] = {routes[i].method, routes[i].target};
+    lookups[N + i] = {http::verb::get, misses[i % std::size(misses)]};
+  }
+  return lookups;
+}
+
+int main()
+{
+  auto const small = make_lookups(small_routes);
+  auto const large = make_lookups(large_routes);
+
+  std::vector<microbench::result> results;
+
+  // Each iteration looks up the whole mix, so report per lookup below
+  auto per_lookup = [](microbench::result r, std::size_t n) {
+    r.ns_per_op /= double(n);
+    r.allocs_per_op /= double(n);
+    return r;
+  };
+
+  results.push_back(per_lookup(microbench::run("linear (4 routes)",
+      [&] {
+        for (auto const& l : small)
+          microbench::do_not_optimize(
+              linear_find(small_routes, l.method, l.target));
+      }), small.size()));
+
+  results.push_back(per_lookup(microbench::run("route_table (4 routes)",
+      [&] {
+        for (auto const& l : small)
+          microbench::do_not_optimize(
+              table_find(small_table, l.method, l.target));
+      }), small.size()));
+
+  results.push_back(per_lookup(microbench::run("linear (48 routes)",
+      [&] {
+        for (auto const& l : large)
+          microbench::do_not_optimize(
+              linear_find(large_routes, l.method, l.target));
+      }), large.size()));
+
+  results.push_back(per_lookup(microbench::run("route_table (48 routes)",
+      [&] {
+        for (auto const& l : large)
+          microbench::do_not_optimize(
+              table_find(large_table, l.method, l.target));
+      }), large.size()));
+
+  microbench::print(results);
+
+  return EXIT_SUCCESS;
+}
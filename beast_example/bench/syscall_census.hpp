@@ -0,0 +1,116 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <signal.h>
+#include <sys/ptrace.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+namespace bench {
+
+// Counts every system call that a running process makes between two points
+// in time, by attaching to each of its threads with ptrace.
+//
+// Nothing has to be installed or enabled for this, but the caller needs
+// permission to trace the process (the same user with Yama's ptrace_scope
+// at 0, or CAP_SYS_PTRACE). Every syscall stops the traced thread twice, so
+// the process runs much slower while it is being counted: count during a
+// separate run, never while measuring throughput or latency.
+//
+// Throws std::system_error if the process cannot be traced.
+inline std::uint64_t count_syscalls(
+    int pid,
+    std::chrono::steady_clock::time_point from,
+    std::chrono::steady_clock::time_point until)
+{
+  auto fail = [](char const* what) {
+    throw std::system_error(errno, std::generic_category(), what);
+  };
+
+  std::vector<pid_t> threads;
+  std::error_code ec;
+  auto const tasks = std::filesystem::path("/proc") / std::to_string(pid) / "task";
+  for (auto const& task : std::filesystem::directory_iterator(tasks, ec))
+    threads.push_back(std::stoi(task.path().filename()));
+  if (ec || threads.empty())
+    throw std::system_error(ec, "no such process");
+
+  std::this_thread::sleep_until(from);
+
+  // Stop one thread at a time and leave it to run to its next syscall. A
+  // thread that is already inside a syscall reports its exit first, which
+  // is why stops are halved rather than counted in pairs.
+  std::vector<pid_t> attached;
+  auto detach_all = [&attached] {
+    for (auto tid : attached) {
+      ptrace(PTRACE_INTERRUPT, tid, nullptr, nullptr);
+
+      // Detach at whichever stop comes next, passing on any signal
+      for (;;) {
+        int status = 0;
+        if (waitpid(tid, &status, __WALL) < 0 || !WIFSTOPPED(status)) break;
+
+        auto const sig = WSTOPSIG(status);
+        auto const pass = (sig == SIGTRAP || sig == (SIGTRAP | 0x80) ||
+                           (status >> 16) != 0) ? 0 : sig;
+        ptrace(PTRACE_DETACH, tid, nullptr, (void*)(long)pass);
+        break;
+      }
+    }
+  };
+
+  for (auto tid : threads) {
+    if (ptrace(PTRACE_SEIZE, tid, nullptr, (void*)PTRACE_O_TRACESYSGOOD) != 0) {
+      auto const error = errno;
+      detach_all();
+      errno = error;
+      fail("ptrace");
+    }
+    attached.push_back(tid);
+
+    int status = 0;
+    ptrace(PTRACE_INTERRUPT, tid, nullptr, nullptr);
+    waitpid(tid, &status, __WALL);
+    ptrace(PTRACE_SYSCALL, tid, nullptr, nullptr);
+  }
+
+  std::uint64_t stops = 0;
+
+  while (std::chrono::steady_clock::now() < until) {
+    int status = 0;
+    auto const tid = waitpid(-1, &status, __WALL | WNOHANG);
+
+    if (tid == 0) {
+      std::this_thread::sleep_for(std::chrono::microseconds(20));
+      continue;
+    }
+
+    if (tid < 0) break;
+    if (!WIFSTOPPED(status)) continue; // the thread exited
+
+    // Syscall stops are marked by TRACESYSGOOD, ptrace events by the high
+    // bits, and anything else is a signal to deliver
+    auto const sig = WSTOPSIG(status);
+    long inject = 0;
+
+    if (sig == (SIGTRAP | 0x80))
+      ++stops;
+    else if ((status >> 16) == 0)
+      inject = sig;
+
+    ptrace(PTRACE_SYSCALL, tid, nullptr, (void*)inject);
+  }
+
+  detach_all();
+
+  return stops / 2;
+}
+
+} // namespace bench
@@ -0,0 +1,114 @@
+// The cost of restarting a connection's idle timeout (see timing_wheel.hpp).
+//
+// With a timer per connection, every request cancels the connection's
+// pending wait and starts a new one, as tcp_stream::expires_after and the
+// next read do: the cancelled wait completes with operation_aborted and the
+// new one goes into the reactor's timer heap, among the waits of all the
+// other connections. With the timing wheel it is a store to the entry.
+//
+// Both are measured with 1k, 10k and 100k connections waiting, touching
+// them round-robin so that the timers are not all in the cache. Starting
+// and stopping a wheel entry (once per connection) is measured as well.
+
+#include "microbench.hpp"
+#include "timing_wheel.hpp"
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include <chrono>
+#include <cstddef>
+#include <cstdlib>
+#include <format>
+#include <memory>
+#include <vector>
+
+namespace asio = boost::asio;
+
+constexpr auto timeout = std::chrono::seconds(30);
+
+microbench::result rearm_timers(std::size_t n)
+{
+  asio::io_context ioc{1};
+
+  std::vector<std::unique_ptr<asio::steady_timer>> timers;
+  for (std::size_t i = 0; i < n; ++i) {
+    timers.push_back(std::make_unique<asio::steady_timer>(ioc));
+    timers.back()->expires_after(timeout);
+    timers.back()->async_wait([](boost::system::error_code) {});
+  }
+
+  std::size_t next = 0;
+  auto r = microbench::run(std::format("steady_timer re-arm ({})", n), [&] {
+      auto& t = *timers[next];
+      next = next + 1 == n ? 0 : next + 1;
+
+      t.expires_after(timeout);
+      t.async_wait([](boost::system::error_code) {});
+
+      // Run the cancelled wait's handler
+      ioc.poll_one();
+    });
+
+  for (auto& t : timers) t->cancel();
+  ioc.poll();
+  return r;
+}
+
+microbench::result touch_entries(std::size_t n)
+{
+  asio::io_context ioc{1};
+  idle::timing_wheel wheel(ioc.get_executor(), timeout);
+
+  std::vector<std::unique_ptr<idle::entry>> entries;
+  for (std::size_t i = 0; i < n; ++i) {
+    entries.push_back(std::make_unique<idle::entry>(
+        wheel, [](void*) {}, nullptr));
+    entries.back()->start();
+  }
+
+  std::size_t next = 0;
+  return microbench::run(std::format("timing_wheel touch ({})", n), [&] {
+      auto& e = *entries[next];
+      next = next + 1 == n ? 0 : next + 1;
+
+      e.touch();
+    });
+}
+
+microbench::result restart_entries(std::size_t n)
+{
+  asio::io_context ioc{1};
+  idle::timing_wheel wheel(ioc.get_executor(), timeout);
+
+  std::vector<std::unique_ptr<idle::entry>> entries;
+  for (std::size_t i = 0; i < n; ++i) {
+    entries.push_back(std::make_unique<idle::entry>(
+        wheel, [](void*) {}, nullptr));
+    entries.back()->start();
+  }
+
+  std::size_t next = 0;
+  return microbench::run(std::format("timing_wheel stop+start ({})", n), [&] {
+      auto& e = *entries[next];
+      next = next + 1 == n ? 0 : next + 1;
+
+      e.stop();
+      e.start();
+    });
+}
+
+int main()
+{
+  std::vector<microbench::result> results;
+
+  for (std::size_t n : {1000, 10000, 100000}) {
+    results.push_back(rearm_timers(n));
+    results.push_back(touch_entries(n));
+    results.push_back(restart_entries(n));
+  }
+
+  microbench::print(results);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,184 @@
+#pragma once
+
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+
+#include <semaphore.h>
+
+// A bounded multi-producer, multi-consumer queue.
+//
+// The queue itself is Dmitry Vyukov's array of cells, each with a sequence
+// number that says whether it is ready to be written or read on the
+// current lap: claiming a cell is one compare-and-swap on the head or the
+// tail, and there is no lock. Two semaphores count the free and the used
+// cells so that a thread with nothing else to do can sleep in push() or
+// pop(); on Linux they wait on a futex, and only when the queue is empty
+// (or full).
+//
+// They are POSIX semaphores rather than std::counting_semaphore, which in
+// libstdc++ (up to GCC 13 at least) wakes every waiting thread on each
+// release: with thousands of idle workers waiting in pop(), handing over
+// one connection woke them all.
+
+namespace mpmc {
+
+namespace detail {
+
+// Just what the queue needs of a counting semaphore. sem_post wakes one
+// waiter, if there is any.
+class semaphore
+{
+  public:
+  explicit semaphore(std::size_t count) noexcept
+  {
+    ::sem_init(&sem_, 0, unsigned(count));
+  }
+
+  semaphore(semaphore const&) = delete;
+  semaphore& operator=(semaphore const&) = delete;
+
+  ~semaphore() { ::sem_destroy(&sem_); }
+
+  void acquire() noexcept
+  {
+    while (::sem_wait(&sem_) != 0) {} // EINTR
+  }
+
+  bool try_acquire() noexcept { return ::sem_trywait(&sem_) == 0; }
+
+  void release() noexcept { ::sem_post(&sem_); }
+
+  private:
+  sem_t sem_;
+};
+
+} // namespace detail
+
+// Can a bounded_queue hold 'capacity' elements? It must be a power of two
+// (and at least 2), so that a position maps to its cell with a mask.
+constexpr bool valid_capacity(std::size_t capacity) noexcept
+{
+  return capacity >= 2 && std::has_single_bit(capacity);
+}
+
+template <class T>
+class bounded_queue
+{
+  public:
+  // Throws std::invalid_argument unless valid_capacity(capacity)
+  explicit bounded_queue(std::size_t capacity)
+    : capacity_(capacity)
+    , cells_(valid_capacity(capacity)
+          ? std::make_unique<cell[]>(capacity_)
+          : throw std::invalid_argument(
+                "bounded_queue capacity must be a power of two"))
+    , free_(capacity_)
+  {
+    for (std::size_t i = 0; i < capacity_; ++i)
+      cells_[i].sequence.store(i, std::memory_order_relaxed);
+  }
+
+  bounded_queue(bounded_queue const&) = delete;
+  bounded_queue& operator=(bounded_queue const&) = delete;
+
+  std::size_t capacity() const noexcept { return capacity_; }
+
+  // Add 'value', waiting for room if the queue is full
+  void push(T value)
+  {
+    free_.acquire();
+    enqueue(std::move(value));
+    used_.release();
+  }
+
+  // Add 'value' unless the queue is full
+  bool try_push(T value)
+  {
+    if (!free_.try_acquire()) return false;
+    enqueue(std::move(value));
+    used_.release();
+    return true;
+  }
+
+  // Remove the oldest value, waiting for one if the queue is empty
+  T pop()
+  {
+    used_.acquire();
+    T value = dequeue();
+    free_.release();
+    return value;
+  }
+
+  private:
+  struct cell
+  {
+    alignas(64) std::atomic<std::size_t> sequence;
+    T value;
+  };
+
+  // The semaphores have already reserved a cell, but the cell at our
+  // position may still be in use by a slower thread of the previous lap,
+  // so these can spin briefly
+  void enqueue(T&& value)
+  {
+    auto pos = tail_.load(std::memory_order_relaxed);
+    for (;;) {
+      auto& c = cells_[pos & (capacity_ - 1)];
+      auto const seq = c.sequence.load(std::memory_order_acquire);
+      auto const diff = std::ptrdiff_t(seq) - std::ptrdiff_t(pos);
+
+      if (diff == 0) {
+        if (tail_.compare_exchange_weak(pos, pos + 1,
+                std::memory_order_relaxed)) {
+          c.value = std::move(value);
+          c.sequence.store(pos + 1, std::memory_order_release);
+          return;
+        }
+      } else if (diff < 0) {
+        std::this_thread::yield();
+        pos = tail_.load(std::memory_order_relaxed);
+      } else {
+        pos = tail_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  T dequeue()
+  {
+    auto pos = head_.load(std::memory_order_relaxed);
+    for (;;) {
+      auto& c = cells_[pos & (capacity_ - 1)];
+      auto const seq = c.sequence.load(std::memory_order_acquire);
+      auto const diff = std::ptrdiff_t(seq) - std::ptrdiff_t(pos + 1);
+
+      if (diff == 0) {
+        if (head_.compare_exchange_weak(pos, pos + 1,
+                std::memory_order_relaxed)) {
+          T value = std::move(c.value);
+          c.sequence.store(pos + capacity_, std::memory_order_release);
+          return value;
+        }
+      } else if (diff < 0) {
+        std::this_thread::yield();
+        pos = head_.load(std::memory_order_relaxed);
+      } else {
+        pos = head_.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  std::size_t const capacity_;
+  std::unique_ptr<cell[]> cells_;
+
+  alignas(64) std::atomic<std::size_t> tail_{0};
+  alignas(64) std::atomic<std::size_t> head_{0};
+
+  detail::semaphore free_;
+  detail::semaphore used_{0};
+};
+
+} // namespace mpmc
@@ -0,0 +1,165 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Fan-out of WebSocket messages to many subscribers.
+//
+// A published message is copied once into an immutable string, and every
+// subscriber's write queue shares that same string: however many
+// subscribers there are, the payload exists once, and only the frame
+// header (which Beast writes in front of it) is per connection.
+//
+// Each subscriber's queue is bounded. A subscriber whose queue is full
+// when a message arrives is not keeping up, and is evicted - its
+// connection is closed - rather than letting its backlog grow without
+// bound or holding up the others.
+
+namespace broadcast {
+
+using message = std::shared_ptr<std::string const>;
+
+class hub;
+
+// A connection that takes the hub's messages
+class subscriber
+{
+  public:
+  virtual ~subscriber() = default;
+
+  // Queue 'm' for sending. This is called from any thread, with the hub
+  // locked, so it should only post the message to wherever the connection
+  // runs. A subscriber that is being destroyed (and so is about to leave
+  // the hub) can still be called, and should ignore it.
+  virtual void deliver(message const& m) = 0;
+
+  private:
+  friend class hub;
+
+  // Where the subscriber is in the hub's list, guarded by its lock
+  std::size_t slot_ = 0;
+};
+
+class hub
+{
+  public:
+  // Each subscriber may have up to 'max_queue' messages waiting
+  explicit hub(std::size_t max_queue = 64) noexcept
+    : max_queue_(max_queue)
+  {
+  }
+
+  hub(hub const&) = delete;
+  hub& operator=(hub const&) = delete;
+
+  void configure(std::size_t max_queue) noexcept
+  {
+    max_queue_ = max_queue ? max_queue : 1;
+  }
+
+  std::size_t max_queue() const noexcept { return max_queue_; }
+
+  void join(subscriber& s)
+  {
+    std::lock_guard lock(mutex_);
+    s.slot_ = subscribers_.size();
+    subscribers_.push_back(&s);
+  }
+
+  // A subscriber must leave before it is destroyed
+  void leave(subscriber& s)
+  {
+    std::lock_guard lock(mutex_);
+    auto* last = subscribers_.back();
+    subscribers_[s.slot_] = last;
+    last->slot_ = s.slot_;
+    subscribers_.pop_back();
+  }
+
+  // Send 'payload' to every subscriber, and return how many there were
+  std::size_t publish(std::string_view payload)
+  {
+    auto const m = std::make_shared<std::string const>(payload);
+
+    std::lock_guard lock(mutex_);
+    for (auto* s : subscribers_) s->deliver(m);
+
+    published_.fetch_add(1, std::memory_order_relaxed);
+    return subscribers_.size();
+  }
+
+  // Called by a subscriber that found its queue full and closed
+  void evicted() noexcept
+  {
+    evicted_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  std::uint64_t published() const noexcept
+  {
+    return published_.load(std::memory_order_relaxed);
+  }
+
+  std::uint64_t evictions() const noexcept
+  {
+    return evicted_.load(std::memory_order_relaxed);
+  }
+
+  private:
+  std::size_t max_queue_;
+
+  std::mutex mutex_;
+  std::vector<subscriber*> subscribers_;
+
+  std::atomic<std::uint64_t> published_{0};
+  std::atomic<std::uint64_t> evicted_{0};
+};
+
+// A subscriber's write queue: the messages waiting to be sent, oldest
+// first, up to the hub's bound. It is only ever used from the
+// subscriber's own executor, and its slots are allocated with the first
+// message.
+class queue
+{
+  public:
+  explicit queue(std::size_t capacity) noexcept
+    : capacity_(capacity)
+  {
+  }
+
+  bool empty() const noexcept { return size_ == 0; }
+  std::size_t size() const noexcept { return size_; }
+
+  message const& front() const noexcept { return slots_[head_]; }
+
+  // Add 'm' to the back, unless the queue is full
+  bool push(message m)
+  {
+    if (size_ == capacity_) return false;
+    if (!slots_) slots_ = std::make_unique<message[]>(capacity_);
+
+    slots_[(head_ + size_) % capacity_] = std::move(m);
+    ++size_;
+    return true;
+  }
+
+  void pop() noexcept
+  {
+    slots_[head_].reset();
+    head_ = (head_ + 1) % capacity_;
+    --size_;
+  }
+
+  private:
+  std::size_t const capacity_;
+  std::unique_ptr<message[]> slots_;
+  std::size_t head_ = 0;
+  std::size_t size_ = 0;
+};
+
+} // namespace broadcast
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <charconv>
+#include <initializer_list>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Optional '--name' and '--name=value' switches for the example programs.
+//
+// The servers keep their positional '<ip-address> <port> ...' arguments;
+// anything after those is treated as a switch so that the different modes
+// can be selected without disturbing the existing command lines.
+class command_line
+{
+  public:
+  command_line(int argc, char *argv[], int first)
+  {
+    for (int i = first; i < argc; ++i) {
+      std::string_view arg{argv[i]};
+
+      if (!arg.starts_with("--")) {
+        positional_.emplace_back(arg);
+        continue;
+      }
+
+      arg.remove_prefix(2);
+      auto const eq = arg.find('=');
+      if (eq == std::string_view::npos)
+        switches_.push_back({std::string(arg), std::nullopt});
+      else
+        switches_.push_back(
+          {std::string(arg.substr(0, eq)), std::string(arg.substr(eq + 1))});
+    }
+  }
+
+  // Arguments that are not switches (e.g. benchmark targets)
+  std::vector<std::string> const& positional() const { return positional_; }
+
+  bool has(std::string_view name) const { return find(name) != nullptr; }
+
+  std::string get(std::string_view name, std::string_view def) const
+  {
+    auto const* s = find(name);
+    return s && s->value ? *s->value : std::string(def);
+  }
+
+  std::string get(std::string_view name, char const* def) const
+  {
+    return get(name, std::string_view(def));
+  }
+
+  // Numeric switches. A malformed value falls back to the default.
+  template <class T>
+  T get(std::string_view name, T def) const
+  {
+    auto const* s = find(name);
+    if (!s || !s->value) return def;
+
+    T value{};
+    auto const& v = *s->value;
+    auto [ptr, ec] = std::from_chars(v.data(), v.data() + v.size(), value);
+    return (ec == std::errc{} && ptr == v.data() + v.size()) ? value : def;
+  }
+
+  // Returns the first switch that is not in 'known' (if any)
+  std::optional<std::string>
+    unknown(std::initializer_list<std::string_view> known) const
+    {
+      for (auto const& s : switches_) {
+        bool found = false;
+        for (auto k : known) found = found || (s.name == k);
+        if (!found) return s.name;
+      }
+      return std::nullopt;
+    }
+
+  private:
+  struct option
+  {
+    std::string name;
+    std::optional<std::string> value;
+  };
+
+  option const* find(std::string_view name) const
+  {
+    // The last occurrence wins, as with most command line parsers
+    for (auto it = switches_.rbegin(); it != switches_.rend(); ++it)
+      if (it->name == name) return &*it;
+    return nullptr;
+  }
+
+  std::vector<option> switches_;
+  std::vector<std::string> positional_;
+};
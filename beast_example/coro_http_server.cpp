@@ -2,72 +2,142 @@
 #include <boost/beast/http.hpp>
 #include <boost/asio/spawn.hpp>
 
+#include "admission.hpp"
+#include "command_line.hpp"
+#include "handlers.hpp"
+#include "metrics.hpp"
+#include "pipeline.hpp"
+#include "request_arena.hpp"
+#include "stack_pool.hpp"
+#include "static_files.hpp"
+#include "streaming.hpp"
+
 #include <iostream>
 #include <thread>
 #include <vector>
 #include <format>
+#include <new>
+#include <utility>
 
 namespace beast = boost::beast;
 namespace http = beast::http;
 namespace asio = boost::asio;
 using tcp = boost::asio::ip::tcp;
 
+// How long a connection may take to send its next request, or to make room
+// for more of a response
+constexpr auto idle_timeout = std::chrono::seconds(30);
+
 // Report an error
 void error(beast::error_code ec, char const* msg)
 {
   std::cerr << std::format("Error: {} - {}\n", msg, ec.message());
 }
 
+// The routes' responses are shared by every session (and serialized once)
+handlers::context app{"Beast", "Hello ACCU 2023 from the Stackful Coro Server!"};
+
+// Limits the sessions (see --max-sessions and --max-queue-delay)
+admission::gate gate;
+
+// Handles a connection that was accepted at 'accepted', after do_listen
+// has entered it into the gate
   void
 do_session(
     beast::tcp_stream& stream,
+    admission::clock::time_point accepted,
     asio::yield_context yield)
 {
+  admission::pass pass(gate);
+  bool first_request = true;
+
   beast::flat_buffer buffer;
   beast::error_code ec;
+  pipeline::response_batch<http::string_body> batch;
+
+  // Each request is parsed into memory from this arena, which is reset
+  // (not freed) between requests
+  arena::request_arena arena;
+
+  // Counts the connection and times its requests (see metrics.hpp)
+  metrics::connection conn{accepted};
+
+  // Responses are coalesced below, so Nagle would only delay the tail of
+  // a batch that needs more than one writev
+  stream.socket().set_option(tcp::no_delay(true), ec);
 
   for(;;)
   {
     // Set a timeout (in case the client stops responding)
-    stream.expires_after(std::chrono::seconds(30));
+    stream.expires_after(idle_timeout);
 
     // Read a request
-    http::request<http::string_body> req;
-    http::async_read(stream, buffer, req, yield[ec]);
+    auto& req = arena.renew();
+    auto const bytes = http::async_read(stream, buffer, req, yield[ec]);
 
     if(ec == http::error::end_of_stream) break;
 
     if(ec) return error(ec, "read request");
 
-    // Handle the request
-    auto handle_request = [&req]() -> http::message_generator {
-      http::response<http::string_body> res{
-        http::status::ok, req.version()
-      };
-      res.set(http::field::server, "Beast");
-      res.body() = "Hello ACCU 2023 from the Stackful Coro Server!";
-      res.prepare_payload();
-      res.keep_alive(req.keep_alive());
-      return res;
+    // Queue the response to the request (see handlers.hpp), or a 503 if
+    // the connection had waited too long for it to be read (admission.hpp)
+    auto handle_request = [&](std::size_t size) {
+      conn.read(size);
+      if(std::exchange(first_request, false) && gate.overdue(accepted)) {
+        handlers::shed(app, req, batch);
+        conn.shed();
+      }
+      else
+        handlers::handle(app, req, batch);
+      conn.handled();
     };
 
-    // Send the response
-    beast::async_write(stream, handle_request(), yield[ec]);
+    // Answer any pipelined requests that are already buffered as well
+    handle_request(bytes);
+    while(batch.keep_alive() && !batch.full())
+      if(auto const n = pipeline::read_buffered(buffer, arena.renew()))
+        handle_request(n);
+      else
+        break;
+
+    // Send the responses with one gathered write
+    conn.wrote(asio::async_write(stream, batch.buffers(), yield[ec]));
 
     if(ec) return error(ec, "write response");
 
+    // A large file's contents follow its header
+    if(auto* file = batch.file()) {
+      conn.wrote(
+          static_files::async_sendfile(
+              stream.socket(), *file, idle_timeout, yield[ec]));
+      if(ec) return error(ec, "send file");
+    }
+
+    // A streamed response follows the others, header and all
+    if(auto* res = batch.stream()) {
+      conn.wrote(streaming::async_write(
+          stream.socket(), *res, idle_timeout, yield[ec]));
+      if(ec) return error(ec, "stream");
+    }
+    conn.sent();
+
     // Determine if we should close the connection
-    if(!req.keep_alive()) break;
+    bool keep_alive = batch.keep_alive();
+    batch.clear();
+
+    if(!keep_alive) break;
   }
 
   // Close the connection
   stream.socket().shutdown(tcp::socket::shutdown_send, ec);
 }
 
-// Accepts incoming connections and launches the sessions
+// Accepts incoming connections and launches the sessions, each on a stack
+// from the pool
 void do_listen(
     asio::io_context& ioc,
     tcp::endpoint endpoint,
+    stacks::pool& stack_pool,
     asio::yield_context yield)
 {
   beast::error_code ec;
@@ -85,32 +155,85 @@ void do_listen(
   acceptor.bind(endpoint, ec);
   if(ec) return error(ec, "bind");
 
-  // Start listening for connections
-  acceptor.listen(asio::socket_base::max_listen_connections, ec);
+  // Start listening for connections. With a session limit the kernel's
+  // queue is kept as short, so that the connections waiting for a session
+  // are not queued for long either.
+  acceptor.listen(
+      gate.max_sessions() ? int(gate.max_sessions())
+                          : asio::socket_base::max_listen_connections, ec);
   if(ec) return error(ec, "listen");
 
+  asio::steady_timer pacer(ioc);
+
   for(;;)
   {
+    // At the session limit, leave the connections queued in the kernel
+    // and try again shortly
+    if(!gate.try_enter()) {
+      pacer.expires_after(admission::gate::pace());
+      pacer.async_wait(yield[ec]);
+      continue;
+    }
+
     tcp::socket socket(ioc);
     acceptor.async_accept(socket, yield[ec]);
-    if(ec)
+
+    // Running out of descriptors is no reason to stop accepting, but there
+    // is no point in trying again straight away
+    if(ec) {
+      gate.leave();
       error(ec, "accept");
-    else
-      boost::asio::spawn(
-          acceptor.get_executor(),
-          std::bind(
-            do_session,
-            beast::tcp_stream(std::move(socket)),
-            std::placeholders::_1));
+      pacer.expires_after(admission::gate::pace());
+      pacer.async_wait(yield[ec]);
+    }
+    else {
+      try {
+        stacks::spawn(
+            acceptor.get_executor(),
+            std::bind(
+              do_session,
+              beast::tcp_stream(std::move(socket)),
+              admission::clock::now(),
+              std::placeholders::_1),
+            stack_pool);
+      }
+      // There is no stack for the session (with guard pages, mapping one
+      // fails once vm.max_map_count is reached). Its arguments, and with
+      // them the connection, have been destroyed, so the connection is
+      // closed: give up its place and pause, as for a failed accept.
+      catch(std::bad_alloc const&) {
+        gate.leave();
+        error(asio::error::no_memory, "spawn");
+        pacer.expires_after(admission::gate::pace());
+        pacer.async_wait(yield[ec]);
+      }
+    }
   }
 }
 
 int main(int argc, char *argv[])
 {
-  if (argc != 4) {
+  command_line options(argc, argv, 4);
+
+  if (argc < 4 || !options.positional().empty() ||
+      options.unknown({"doc-root", "max-sessions", "max-queue-delay",
+                       "stack-size", "stack-pool", "guard-pages",
+                       "latency-dump", "trace", "trace-sample"})) {
     std::cerr << std::format(
-        "Usage: {} <ip-address> <port> <num_threads>\n"
-        "E.g.: {} 0.0.0.0 8080 2\n",
+        "Usage: {} <ip-address> <port> <num_threads> [options]\n"
+        "E.g.: {} 0.0.0.0 8080 2\n"
+        "Options:\n"
+        "  --doc-root=DIR serve the files in DIR for targets without a route\n"
+        "  --max-sessions=N  stop accepting while there are N sessions\n"
+        "  --max-queue-delay=MS  answer 503 to a connection whose first\n"
+        "                 request is read more than MS after accepting it\n"
+        "  --stack-size=KB   each session's stack (Boost.Context's default)\n"
+        "  --stack-pool=N    keep up to N free stacks for reuse (1024)\n"
+        "  --guard-pages     put an inaccessible page below every stack\n"
+        "  --latency-dump=FILE  write the phase histograms to FILE on SIGUSR1\n"
+        "  --trace=FILE   write a Chrome trace of the sampled requests to\n"
+        "                 FILE on SIGUSR1\n"
+        "  --trace-sample=N  trace one request in N (1000)\n",
         argv[0], argv[0]
         );
     return EXIT_FAILURE;
@@ -120,7 +243,24 @@ int main(int argc, char *argv[])
   auto const port = static_cast<unsigned short>(std::atoi(argv[2]));
   auto const num_threads = std::max<int>(1, std::atoi(argv[3]));
 
+  if (options.has("doc-root"))
+    app.serve_files(options.get("doc-root", "."));
+
+  gate.configure(options.get("max-sessions", std::size_t(0)),
+      std::chrono::milliseconds(options.get("max-queue-delay", 0)));
+
+  metrics::configure({options.get("latency-dump", ""),
+      options.get("trace", ""),
+      options.get("trace-sample", std::uint64_t(1000))});
+
+  stacks::pool stack_pool(
+      options.get("stack-size",
+          boost::context::stack_traits::default_size() / 1024) * 1024,
+      options.has("guard-pages"),
+      options.get("stack-pool", std::size_t(1024)));
+
   asio::io_context ioc{num_threads};
+  metrics::dump_on_signal(ioc);
 
   // Spawn a stackful coroutine
   boost::asio::spawn(ioc,
@@ -128,7 +268,9 @@ int main(int argc, char *argv[])
         &do_listen,
         std::ref(ioc),
         tcp::endpoint{address, port},
-        std::placeholders::_1));
+        std::ref(stack_pool),
+        std::placeholders::_1),
+      [](std::exception_ptr e) { if (e) std::rethrow_exception(e); });
 
   // Run the IO service with the requested number of threads
   std::vector<std::thread> v(num_threads-1);
@@ -0,0 +1,113 @@
+#pragma once
+
+#include "timing_wheel.hpp"
+
+#include <boost/asio/steady_timer.hpp>
+#include <boost/beast/core/error.hpp>
+
+#include <chrono>
+#include <memory>
+#include <utility>
+
+// Time limits for operations on a raw socket.
+//
+// tcp_stream times out its own reads and writes, but sendfile(2) and the
+// streamed responses write to the socket underneath it, where nothing stops
+// a client that has stopped reading from holding its session (and its
+// file, and its admission pass) for ever. A deadline::timer cancels the
+// socket's operations if one of them has not finished within its timeout,
+// like the stream's own expiry does. It is armed for each wait on the
+// socket, so a slow client is fine as long as it keeps reading.
+//
+// The timer's state is shared with its pending wait, which may still run
+// after the operation that armed it has finished (and its socket is gone),
+// so the wait only touches the socket while the timer is armed.
+//
+// A connection that is already timed by an idle timing wheel (see
+// timing_wheel.hpp) needs no timer of its own: the wheel closes it if it
+// stays idle, so each wait that finishes only touches its entry.
+
+namespace deadline {
+
+namespace asio = boost::asio;
+namespace beast = boost::beast;
+
+// How long a wait on the socket may take: 'timeout', or the timeout of the
+// idle wheel that 'idle' is in
+struct limit
+{
+  template <class Rep, class Period>
+  limit(std::chrono::duration<Rep, Period> t) noexcept : timeout(t) {}
+
+  limit(idle::entry& e) noexcept : idle(&e) {}
+
+  std::chrono::steady_clock::duration timeout{};
+  idle::entry* idle = nullptr;
+};
+
+template <class Socket>
+class timer
+{
+  struct state
+  {
+    state(Socket& s)
+      : wait(s.get_executor())
+      , socket(&s)
+    {
+    }
+
+    asio::steady_timer wait;
+    Socket* socket;
+    bool armed = false;
+    bool expired = false;
+  };
+
+  limit limit_;
+  std::shared_ptr<state> s_;
+
+  public:
+  // The state comes from 'alloc', usually the completion handler's. With
+  // a wheel there is none.
+  template <class Allocator>
+  timer(Socket& socket, Allocator const& alloc, limit l)
+    : limit_(l)
+  {
+    if (!limit_.idle)
+      s_ = std::allocate_shared<state>(alloc, socket);
+  }
+
+  // Cancel the socket's operations unless disarm() is called within the
+  // limit
+  void arm()
+  {
+    if (!s_) return;
+    s_->armed = true;
+    s_->expired = false;
+    s_->wait.expires_after(limit_.timeout);
+    s_->wait.async_wait([s = s_](beast::error_code ec) {
+        if (ec || !s->armed) return;
+        s->expired = true;
+        s->socket->cancel(ec);
+      });
+  }
+
+  // The wait finished, which restarts the wheel's timeout
+  void disarm()
+  {
+    if (!s_) return limit_.idle->touch();
+    s_->armed = false;
+    s_->wait.cancel();
+  }
+
+  // Disarm the timer, and turn the error of an operation it cancelled into
+  // beast::error::timeout
+  beast::error_code disarm(beast::error_code ec)
+  {
+    disarm();
+    if (s_ && ec == asio::error::operation_aborted && s_->expired)
+      return beast::error::timeout;
+    return ec;
+  }
+};
+
+} // namespace deadline
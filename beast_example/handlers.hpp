@@ -0,0 +1,260 @@
+#pragma once
+
+#include "metrics.hpp"
+#include "pipeline.hpp"
+#include "proxy.hpp"
+#include "request_arena.hpp"
+#include "response_cache.hpp"
+#include "router.hpp"
+#include "static_files.hpp"
+#include "streaming.hpp"
+
+#include <boost/beast/http.hpp>
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// The request handling shared by all of the servers.
+//
+// Every server parses into an arena::request and queues its responses in a
+// response_batch, so a handler is a plain function of the request and the
+// batch, plus the server's context. The routes are a compile-time table
+// (see router.hpp); a target without a route is looked up in the static
+// files when the server has a document root, and is otherwise a 404.
+// Targets under a proxied prefix are not handled here at all: the servers
+// forward them upstream (see proxied() and proxy.hpp).
+
+namespace handlers {
+
+namespace beast = boost::beast;
+namespace http = beast::http;
+
+using request = arena::request;
+using batch = pipeline::response_batch<http::string_body>;
+
+// What the handlers of one server share
+struct context
+{
+  context(beast::string_view server, beast::string_view greeting)
+    : server(server)
+    , hello(response_cache::make_cached_response(
+          http::status::ok, server, greeting))
+    , health(response_cache::make_cached_response(
+        http::status::ok, server, "OK\n", "text/plain"))
+    , not_found(response_cache::make_cached_response(
+        http::status::not_found, server, "The resource was not found\n",
+        "text/plain"))
+    , not_allowed(response_cache::make_cached_response(
+        http::status::method_not_allowed, server, "Unknown HTTP-method\n",
+        "text/plain"))
+    , unavailable(response_cache::make_cached_response(
+        http::status::service_unavailable, server,
+        "The server is too busy, try again later\n", "text/plain"))
+    , too_many(response_cache::make_cached_response(
+        http::status::too_many_requests, server,
+        "Too many requests, slow down\n", "text/plain"))
+  {
+  }
+
+  // Serve the files below 'doc_root' for targets that have no route
+  void serve_files(std::string doc_root)
+  {
+    files.emplace(std::move(doc_root), server);
+  }
+
+  // Forward the targets under the route's prefix to its upstream, keeping
+  // up to 'max_idle' idle connections to it per thread
+  void proxy_to(proxy::route_spec const& route, std::size_t max_idle)
+  {
+    proxies.push_back({route.prefix, std::make_unique<proxy::upstream>(
+        route.host, route.port, max_idle, server)});
+  }
+
+  std::string server;
+
+  std::shared_ptr<response_cache::cached_response const> hello;
+  std::shared_ptr<response_cache::cached_response const> health;
+  std::shared_ptr<response_cache::cached_response const> not_found;
+  std::shared_ptr<response_cache::cached_response const> not_allowed;
+
+  // For turning connections away when the server is overloaded
+  std::shared_ptr<response_cache::cached_response const> unavailable;
+  std::shared_ptr<response_cache::cached_response const> too_many;
+
+  std::optional<static_files::file_handler> files;
+
+  std::vector<proxy::route> proxies;
+};
+
+using handler = void (*)(context&, request const&, batch&);
+
+// Queue one of the context's responses, without a body for HEAD
+inline void reply(
+    std::shared_ptr<response_cache::cached_response const> const& res,
+    request const& req,
+    batch& b)
+{
+  b.push(res, req.version(), req.keep_alive(),
+      req.method() != http::verb::head);
+}
+
+inline void hello(context& ctx, request const& req, batch& b)
+{
+  reply(ctx.hello, req, b);
+}
+
+// For load balancers and the like
+inline void health(context& ctx, request const& req, batch& b)
+{
+  reply(ctx.health, req, b);
+}
+
+#ifndef BEAST_NO_METRICS
+// The server's metrics, in the Prometheus text format. Unlike the other
+// responses this one is built afresh every time.
+inline void metrics_page(context& ctx, request const& req, batch& b)
+{
+  http::response<http::string_body> res{http::status::ok, req.version()};
+  res.set(http::field::server, ctx.server);
+  res.set(http::field::content_type, "text/plain; version=0.0.4");
+  res.body() = metrics::render();
+  res.prepare_payload();
+  res.keep_alive(req.keep_alive());
+  b.push(std::move(res));
+}
+#endif
+
+// The value of 'name' in the query of 'target', if it is a number
+inline std::optional<std::uint64_t> query_number(
+    std::string_view target,
+    std::string_view name)
+{
+  auto const q = target.find('?');
+  if (q == std::string_view::npos) return std::nullopt;
+
+  auto query = target.substr(q + 1);
+  while (!query.empty()) {
+    auto const amp = query.find('&');
+    auto const param = query.substr(0, amp);
+    query = amp == std::string_view::npos ? std::string_view()
+                                          : query.substr(amp + 1);
+
+    if (param.size() > name.size() && param.starts_with(name) &&
+        param[name.size()] == '=') {
+      std::uint64_t n = 0;
+      auto const value = param.substr(name.size() + 1);
+      auto const [end, ec] =
+        std::from_chars(value.data(), value.data() + value.size(), n);
+      if (ec != std::errc{} || end != value.data() + value.size())
+        return std::nullopt;
+      return n;
+    }
+  }
+
+  return std::nullopt;
+}
+
+// ?bytes=N (1 MiB by default) of generated text. It stands in for a body
+// that is too large, or not known soon enough, to build in memory, so it
+// is produced a chunk at a time as the client takes it (see streaming.hpp).
+inline void generated(context& ctx, request const& req, batch& b)
+{
+  static constexpr std::string_view line =
+    "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ.\n";
+
+  auto const target =
+    std::string_view(req.target().data(), req.target().size());
+  auto const bytes = query_number(target, "bytes").value_or(1 << 20);
+
+  streaming::response res;
+  auto& m = res.message;
+  m.result(http::status::ok);
+  m.version(req.version());
+  m.set(http::field::server, ctx.server);
+  m.set(http::field::content_type, "text/plain");
+
+  // Without chunks, the end of the body is the end of the connection
+  if (req.version() >= 11) {
+    m.chunked(true);
+    m.keep_alive(req.keep_alive());
+  }
+  else
+    m.keep_alive(false);
+
+  if (req.method() != http::verb::head)
+    res.produce = [remaining = bytes, offset = std::size_t(0)](
+        std::span<char> out) mutable {
+      auto const n =
+        std::size_t(std::min<std::uint64_t>(remaining, out.size()));
+      for (std::size_t i = 0; i < n;) {
+        auto const part = std::min(n - i, line.size() - offset);
+        std::memcpy(out.data() + i, line.data() + offset, part);
+        i += part;
+        offset = (offset + part) % line.size();
+      }
+      remaining -= n;
+      return n;
+    };
+
+  b.push(std::move(res));
+}
+
+inline constexpr auto routes = routing::make_route_table<handler>({
+  {http::verb::get,  "/",        &hello},
+  {http::verb::head, "/",        &hello},
+  {http::verb::get,  "/health",  &health},
+  {http::verb::head, "/health",  &health},
+  {http::verb::get,  "/stream",  &generated},
+  {http::verb::head, "/stream",  &generated},
+#ifndef BEAST_NO_METRICS
+  {http::verb::get,  "/metrics", &metrics_page},
+#endif
+});
+
+// Turn 'req' away with a 503 and close the connection, when the server
+// is too far behind to take it on (see admission.hpp)
+inline void shed(context& ctx, request const& req, batch& b)
+{
+  b.push(ctx.unavailable, req.version(), false,
+      req.method() != http::verb::head);
+}
+
+// Turn 'req' away with a 429, when its client is over its rate (see
+// rate_limit.hpp). The connection stays open, for when it has slowed down.
+inline void limited(context& ctx, request const& req, batch& b)
+{
+  reply(ctx.too_many, req, b);
+}
+
+// The upstream that 'req' is to be forwarded to, if any
+inline proxy::upstream* proxied(context const& ctx, request const& req)
+{
+  if (ctx.proxies.empty()) return nullptr;
+  return proxy::find(ctx.proxies,
+      std::string_view(req.target().data(), req.target().size()));
+}
+
+// Queue the response to 'req'
+inline void handle(context& ctx, request const& req, batch& b)
+{
+  // Routes match the path, without any query
+  auto target = std::string_view(req.target().data(), req.target().size());
+  target = target.substr(0, target.find('?'));
+
+  if (auto const* r = routes.find(req.method(), target))
+    return r->handler(ctx, req, b);
+
+  if (ctx.files)
+    return ctx.files->handle(req, b);
+
+  reply(routes.has_target(target) ? ctx.not_allowed : ctx.not_found, req, b);
+}
+
+} // namespace handlers
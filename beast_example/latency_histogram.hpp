@@ -0,0 +1,156 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+
+// A log-linear (HDR style) histogram of latencies in nanoseconds.
+//
+// Values below 2 * sub_buckets are recorded exactly, above that every
+// power-of-two range is split into 'sub_buckets' equal slots, which keeps
+// the relative error under 1/sub_buckets (~1.6%) for any value. Recording
+// is a couple of shifts and an add, so it can sit on the request path.
+//
+// A histogram has a single writer (the thread that owns it) but may be read
+// by any number of other threads at the same time; the counts are relaxed
+// atomics that the owner bumps with a plain load/store.
+class latency_histogram
+{
+  public:
+  static constexpr unsigned sub_bucket_bits = 6;
+  static constexpr std::uint64_t sub_buckets = 1 << sub_bucket_bits;
+
+  // Anything beyond ~2^44 ns (about 5 hours) is clamped into the last bucket
+  static constexpr unsigned max_shift = 38;
+  static constexpr std::size_t num_buckets = (max_shift + 2) * sub_buckets;
+
+  latency_histogram() = default;
+
+  latency_histogram(latency_histogram const& rhs)
+  {
+    merge(rhs);
+  }
+
+  latency_histogram& operator=(latency_histogram const& rhs)
+  {
+    if (this != &rhs) {
+      reset();
+      merge(rhs);
+    }
+    return *this;
+  }
+
+  // Record a single value (owner thread only)
+  void record(std::uint64_t ns)
+  {
+    bump(counts_[index_of(ns)], 1);
+    bump(count_, 1);
+    bump(sum_, ns);
+    if (ns > max_.load(std::memory_order_relaxed))
+      max_.store(ns, std::memory_order_relaxed);
+  }
+
+  // Add the counts of another histogram to this one (owner thread only)
+  void merge(latency_histogram const& other)
+  {
+    for (std::size_t i = 0; i < num_buckets; ++i)
+      if (auto n = other.counts_[i].load(std::memory_order_relaxed))
+        bump(counts_[i], n);
+
+    bump(count_, other.count());
+    bump(sum_, other.sum_.load(std::memory_order_relaxed));
+    max_.store(std::max(max(), other.max()), std::memory_order_relaxed);
+  }
+
+  void reset()
+  {
+    for (auto& c : counts_) c.store(0, std::memory_order_relaxed);
+    count_.store(0, std::memory_order_relaxed);
+    sum_.store(0, std::memory_order_relaxed);
+    max_.store(0, std::memory_order_relaxed);
+  }
+
+  std::uint64_t count() const { return count_.load(std::memory_order_relaxed); }
+  std::uint64_t max() const { return max_.load(std::memory_order_relaxed); }
+
+  double mean() const
+  {
+    auto n = count();
+    return n ? double(sum_.load(std::memory_order_relaxed)) / n : 0.0;
+  }
+
+  // Sum of all recorded values, as exported by Prometheus histograms
+  std::uint64_t sum() const { return sum_.load(std::memory_order_relaxed); }
+
+  // The value below which 'percentile' percent of the samples fall. Like
+  // HdrHistogram, this reports the highest value equivalent to the bucket.
+  std::uint64_t value_at_percentile(double percentile) const
+  {
+    auto const total = count();
+    if (total == 0) return 0;
+
+    auto target = static_cast<std::uint64_t>(
+      percentile / 100.0 * static_cast<double>(total) + 0.5);
+    target = std::clamp<std::uint64_t>(target, 1, total);
+
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i < num_buckets; ++i) {
+      seen += counts_[i].load(std::memory_order_relaxed);
+      if (seen >= target)
+        return std::min(highest_equivalent(i), max());
+    }
+    return max();
+  }
+
+  // Visit the non-empty buckets in ascending order as (upper bound, count)
+  template <class Visitor>
+  void for_each_bucket(Visitor&& visit) const
+  {
+    for (std::size_t i = 0; i < num_buckets; ++i)
+      if (auto n = counts_[i].load(std::memory_order_relaxed))
+        visit(highest_equivalent(i), n);
+  }
+
+  // Count of samples less than or equal to 'ns' (for cumulative buckets)
+  std::uint64_t count_at_or_below(std::uint64_t ns) const
+  {
+    std::uint64_t seen = 0;
+    auto const last = index_of(ns);
+    for (std::size_t i = 0; i <= last; ++i)
+      seen += counts_[i].load(std::memory_order_relaxed);
+    return seen;
+  }
+
+  static std::size_t index_of(std::uint64_t ns)
+  {
+    auto const width = static_cast<unsigned>(std::bit_width(ns));
+    auto shift = width > sub_bucket_bits + 1 ? width - sub_bucket_bits - 1 : 0;
+
+    if (shift > max_shift) return num_buckets - 1;
+
+    return shift * sub_buckets + (ns >> shift);
+  }
+
+  static std::uint64_t highest_equivalent(std::size_t index)
+  {
+    auto const shift = index < 2 * sub_buckets ? 0 : index / sub_buckets - 1;
+    auto const sub = index - shift * sub_buckets;
+    return ((sub + 1) << shift) - 1;
+  }
+
+  private:
+  using counter = std::atomic<std::uint64_t>;
+
+  static void bump(counter& c, std::uint64_t n)
+  {
+    c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+  }
+
+  std::array<counter, num_buckets> counts_{};
+  counter count_{0};
+  counter sum_{0};
+  counter max_{0};
+};
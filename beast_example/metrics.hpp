@@ -0,0 +1,543 @@
+#pragma once
+
+#include "latency_histogram.hpp"
+
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/signal_set.hpp>
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <csignal>
+#include <cstddef>
+#include <cstdint>
+#include <format>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+// Per-thread server metrics, summed when they are read.
+//
+// Every thread has its own counters and phase histograms, which only that
+// thread writes - with a relaxed load and store, not a read-modify-write -
+// so counting costs no more than incrementing a plain variable and no cache
+// line is shared between threads. Reading (for /metrics) takes a lock and
+// sums the threads' values, which may be a moment out of date.
+//
+// For a closer look at a latency regression, the servers can also keep
+// the phases in full-resolution (HDR) histograms, and trace a sample of the
+// requests phase by phase. Both are written to files whenever the process
+// gets SIGUSR1 (see dump_settings): the histograms in HdrHistogram's
+// percentile format, and the traces as Chrome trace events, which
+// chrome://tracing and Perfetto can open.
+//
+// Building with BEAST_NO_METRICS compiles all of it out, which is how the
+// overhead is measured (see the BEAST_NO_METRICS_BUILDS option).
+
+namespace metrics {
+
+namespace asio = boost::asio;
+
+using clock = std::chrono::steady_clock;
+
+// What to write when the process gets SIGUSR1 (see dump_on_signal). An
+// empty path leaves that part out. Configure this before the threads
+// start.
+struct dump_settings
+{
+  // The phase histograms at full resolution
+  std::string histograms;
+
+  // The most recent of the sampled requests, one in every 'trace_sample'
+  std::string trace;
+  std::uint64_t trace_sample = 1000;
+};
+
+enum class counter
+{
+  accepted,
+  closed,
+  requests,
+  shed,
+  limited,
+  bytes_read,
+  bytes_written,
+  count_
+};
+
+// The accept phase is from accepting a connection to its session starting,
+// which includes any wait for a thread to take it on. The read phase ends
+// when a request has been parsed, so for the first request on a connection
+// (or after a keep-alive pause) it includes the wait for the client. The
+// handle phase is producing the response, and the write phase is sending a
+// batch of them.
+enum class phase
+{
+  accept,
+  read,
+  handle,
+  write,
+  count_
+};
+
+inline constexpr char const* phase_names[] = {
+  "accept", "read", "handle", "write"};
+
+#ifndef BEAST_NO_METRICS
+
+// Durations by powers of two, from 256 ns up to about 2 s
+struct histogram
+{
+  static constexpr std::size_t num_buckets = 24; // and one for the rest
+
+  // The upper bound of bucket 'i', in nanoseconds
+  static constexpr std::uint64_t bound(std::size_t i) { return 256ull << i; }
+
+  static constexpr std::size_t bucket(std::uint64_t ns)
+  {
+    auto const i = ns <= 256 ? 0 : std::size_t(std::bit_width((ns - 1) >> 8));
+    return i < num_buckets ? i : num_buckets;
+  }
+
+  std::array<std::atomic<std::uint64_t>, num_buckets + 1> buckets{};
+  std::atomic<std::uint64_t> sum_ns{0};
+};
+
+// One phase of a traced request, from 'start' to 'end'
+struct trace_event
+{
+  phase what;
+  std::uint64_t request;
+  clock::time_point start;
+  clock::time_point end;
+};
+
+struct thread_metrics
+{
+  // The most recent trace events kept per thread
+  static constexpr std::size_t max_trace_events = 1 << 16;
+
+  alignas(64) std::array<std::atomic<std::uint64_t>,
+                         std::size_t(counter::count_)> counters{};
+  std::array<histogram, std::size_t(phase::count_)> phases{};
+
+  // Only with a histograms dump, as they take 20 KiB each
+  std::unique_ptr<std::array<latency_histogram, std::size_t(phase::count_)>>
+    hdr;
+
+  // Which thread this is in the trace, and how many requests it has read,
+  // which picks the ones to sample
+  std::size_t index = 0;
+  std::uint64_t requests = 0;
+
+  // The sampled requests' phases, as a ring of the most recent. The lock
+  // is only taken for a sampled request, and by a dump.
+  std::mutex trace_mutex;
+  std::vector<trace_event> trace;
+  std::size_t trace_next = 0;
+};
+
+namespace detail {
+
+inline std::mutex registry_mutex;
+inline std::vector<std::shared_ptr<thread_metrics>> registry;
+
+inline dump_settings dumps;
+
+inline void add(std::atomic<std::uint64_t>& c, std::uint64_t n)
+{
+  c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+} // namespace detail
+
+// The calling thread's metrics (registered on first use, and kept after
+// the thread exits so that the totals never go backwards)
+inline thread_metrics& local()
+{
+  thread_local std::shared_ptr<thread_metrics> m = [] {
+    auto p = std::make_shared<thread_metrics>();
+    if (!detail::dumps.histograms.empty())
+      p->hdr = std::make_unique<std::array<latency_histogram,
+                                           std::size_t(phase::count_)>>();
+
+    std::lock_guard lock(detail::registry_mutex);
+    p->index = detail::registry.size();
+    detail::registry.push_back(p);
+    return p;
+  }();
+  return *m;
+}
+
+inline void add(counter c, std::uint64_t n = 1)
+{
+  detail::add(local().counters[std::size_t(c)], n);
+}
+
+inline void observe(phase p, clock::duration d)
+{
+  auto const ns = std::uint64_t(
+      std::chrono::duration_cast<std::chrono::nanoseconds>(d).count());
+  auto& m = local();
+  auto& h = m.phases[std::size_t(p)];
+  detail::add(h.buckets[histogram::bucket(ns)], 1);
+  detail::add(h.sum_ns, ns);
+
+  if (m.hdr) (*m.hdr)[std::size_t(p)].record(ns);
+}
+
+// Configure the dumps (see dump_settings) before the threads start
+inline void configure(dump_settings s)
+{
+  detail::dumps = std::move(s);
+  if (detail::dumps.trace.empty()) detail::dumps.trace_sample = 0;
+}
+
+namespace detail {
+
+// The id of the request that the calling thread has just read, if it is
+// one to trace, or else 0
+inline std::uint64_t sample()
+{
+  auto const every = dumps.trace_sample;
+  if (every == 0) return 0;
+
+  auto& m = local();
+  auto const n = ++m.requests;
+  return n % every == 0 ? (std::uint64_t(m.index) << 40) | n : 0;
+}
+
+inline void trace(phase p, std::uint64_t request,
+    clock::time_point start, clock::time_point end)
+{
+  auto& m = local();
+  std::lock_guard lock(m.trace_mutex);
+
+  trace_event const e{p, request, start, end};
+  if (m.trace.size() < thread_metrics::max_trace_events)
+    m.trace.push_back(e);
+  else
+    m.trace[m.trace_next] = e;
+  m.trace_next = (m.trace_next + 1) % thread_metrics::max_trace_events;
+}
+
+} // namespace detail
+
+// Times the phases of one connection and counts it while it is open. Each
+// phase is timed from the end of the previous one, so there is a single
+// clock reading per phase. A sampled request also has its phases traced.
+class connection
+{
+  clock::time_point accepted_;
+  clock::time_point last_;
+
+  // The request being read and handled, and the one whose batch is being
+  // written, if they are traced
+  std::uint64_t request_ = 0;
+  std::uint64_t batch_request_ = 0;
+  bool first_request_ = true;
+
+  void lap(phase p, std::uint64_t traced)
+  {
+    auto const now = clock::now();
+    observe(p, now - last_);
+    if (traced) detail::trace(p, traced, last_, now);
+    last_ = now;
+  }
+
+  public:
+  // The connection was accepted at 'accepted' and its session starts now
+  explicit connection(clock::time_point accepted = clock::now())
+    : accepted_(accepted)
+    , last_(accepted)
+  {
+    add(counter::accepted);
+    lap(phase::accept, 0);
+  }
+
+  ~connection() { add(counter::closed); }
+
+  connection(connection const&) = delete;
+  connection& operator=(connection const&) = delete;
+
+  // A request of 'bytes' has been parsed
+  void read(std::size_t bytes)
+  {
+    request_ = detail::sample();
+    if (request_) {
+      batch_request_ = request_;
+      if (first_request_)
+        detail::trace(phase::accept, request_, accepted_, last_);
+    }
+    first_request_ = false;
+
+    lap(phase::read, request_);
+    add(counter::requests);
+    add(counter::bytes_read, bytes);
+  }
+
+  // Its response has been queued
+  void handled() { lap(phase::handle, request_); }
+
+  // The connection was turned away instead (see admission.hpp)
+  void shed() { add(counter::shed); }
+
+  // A request was turned away for its client's rate (see rate_limit.hpp)
+  void limited() { add(counter::limited); }
+
+  // Part of a batch has been written, to be followed by sent()
+  void wrote(std::size_t bytes) { add(counter::bytes_written, bytes); }
+
+  // The whole batch has been sent
+  void sent()
+  {
+    lap(phase::write, batch_request_);
+    batch_request_ = 0;
+  }
+};
+
+// All of the threads' metrics in the Prometheus text format
+inline std::string render()
+{
+  std::array<std::uint64_t, std::size_t(counter::count_)> counters{};
+  std::array<std::array<std::uint64_t, histogram::num_buckets + 1>,
+             std::size_t(phase::count_)> buckets{};
+  std::array<std::uint64_t, std::size_t(phase::count_)> sums{};
+
+  {
+    std::lock_guard lock(detail::registry_mutex);
+    for (auto const& m : detail::registry) {
+      for (std::size_t i = 0; i < counters.size(); ++i)
+        counters[i] += m->counters[i].load(std::memory_order_relaxed);
+
+      for (std::size_t p = 0; p < sums.size(); ++p) {
+        auto const& h = m->phases[p];
+        for (std::size_t i = 0; i < h.buckets.size(); ++i)
+          buckets[p][i] += h.buckets[i].load(std::memory_order_relaxed);
+        sums[p] += h.sum_ns.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  auto value = [&](counter c) { return counters[std::size_t(c)]; };
+
+  std::string out;
+  out.reserve(8192);
+
+  auto const to = std::back_inserter(out);
+
+  auto metric = [to](char const* name, char const* type, char const* help,
+                     std::uint64_t v) {
+    std::format_to(to, "# HELP {0} {1}\n# TYPE {0} {2}\n{0} {3}\n",
+                   name, help, type, v);
+  };
+
+  metric("beast_connections_accepted_total", "counter",
+         "Connections accepted.", value(counter::accepted));
+  metric("beast_connections_active", "gauge",
+         "Connections currently open.",
+         value(counter::accepted) - value(counter::closed));
+  metric("beast_requests_total", "counter",
+         "Requests parsed.", value(counter::requests));
+  metric("beast_connections_shed_total", "counter",
+         "Connections answered 503 for waiting too long.",
+         value(counter::shed));
+  metric("beast_requests_limited_total", "counter",
+         "Requests answered 429 for their client's rate.",
+         value(counter::limited));
+  metric("beast_received_bytes_total", "counter",
+         "Bytes of requests parsed.", value(counter::bytes_read));
+  metric("beast_sent_bytes_total", "counter",
+         "Bytes of responses sent.", value(counter::bytes_written));
+
+  out += "# HELP beast_phase_seconds "
+         "Time spent accepting connections, and reading, handling and "
+         "writing requests.\n"
+         "# TYPE beast_phase_seconds histogram\n";
+
+  auto const& names = phase_names;
+  for (std::size_t p = 0; p < sums.size(); ++p) {
+    std::uint64_t cumulative = 0;
+    for (std::size_t i = 0; i < histogram::num_buckets; ++i) {
+      cumulative += buckets[p][i];
+      std::format_to(to,
+          "beast_phase_seconds_bucket{{phase=\"{}\",le=\"{}\"}} {}\n",
+          names[p], double(histogram::bound(i)) * 1e-9, cumulative);
+    }
+    cumulative += buckets[p][histogram::num_buckets];
+
+    std::format_to(to,
+        "beast_phase_seconds_bucket{{phase=\"{0}\",le=\"+Inf\"}} {1}\n"
+        "beast_phase_seconds_sum{{phase=\"{0}\"}} {2}\n"
+        "beast_phase_seconds_count{{phase=\"{0}\"}} {1}\n",
+        names[p], cumulative, double(sums[p]) * 1e-9);
+  }
+
+  return out;
+}
+
+// The phase histograms, merged over the threads, in the percentile format
+// of HdrHistogram (with the values in microseconds), one after another
+inline std::string render_histograms()
+{
+  std::array<latency_histogram, std::size_t(phase::count_)> merged;
+  {
+    std::lock_guard lock(detail::registry_mutex);
+    for (auto const& m : detail::registry)
+      if (m->hdr)
+        for (std::size_t p = 0; p < merged.size(); ++p)
+          merged[p].merge((*m->hdr)[p]);
+  }
+
+  std::string out;
+  auto const to = std::back_inserter(out);
+
+  for (std::size_t p = 0; p < merged.size(); ++p) {
+    auto const& h = merged[p];
+    auto const total = h.count();
+
+    std::format_to(to, "# Phase: {}\n"
+        "{:>12} {:>14} {:>10} {:>14}\n\n",
+        phase_names[p], "Value", "Percentile", "TotalCount",
+        "1/(1-Percentile)");
+
+    std::uint64_t seen = 0;
+    h.for_each_bucket([&](std::uint64_t ns, std::uint64_t n) {
+        seen += n;
+        auto const fraction = double(seen) / double(total);
+        if (seen < total)
+          std::format_to(to, "{:>12.3f} {:>14.12f} {:>10} {:>14.2f}\n",
+              double(ns) / 1e3, fraction, seen, 1 / (1 - fraction));
+        else
+          std::format_to(to, "{:>12.3f} {:>14.12f} {:>10}\n",
+              double(ns) / 1e3, fraction, seen);
+      });
+
+    std::format_to(to,
+        "#[Mean    = {:>12.3f}, Max = {:>12.3f}]\n"
+        "#[P50     = {:>12.3f}, P99 = {:>12.3f}, P99.9 = {:>12.3f}]\n"
+        "#[Total count    = {:>12}]\n\n",
+        h.mean() / 1e3, double(h.max()) / 1e3,
+        double(h.value_at_percentile(50)) / 1e3,
+        double(h.value_at_percentile(99)) / 1e3,
+        double(h.value_at_percentile(99.9)) / 1e3, total);
+  }
+
+  return out;
+}
+
+// The threads' trace events, in the Chrome trace event format
+inline std::string render_trace()
+{
+  std::vector<std::pair<std::size_t, std::vector<trace_event>>> threads;
+  {
+    std::lock_guard lock(detail::registry_mutex);
+    for (auto const& m : detail::registry) {
+      std::lock_guard trace_lock(m->trace_mutex);
+      threads.emplace_back(m->index, m->trace);
+    }
+  }
+
+  auto us = [](clock::time_point t) {
+    return std::chrono::duration<double, std::micro>(
+        t.time_since_epoch()).count();
+  };
+
+  std::string out = "{\"traceEvents\":[";
+  auto const to = std::back_inserter(out);
+  auto const pid = ::getpid();
+  bool first = true;
+
+  for (auto const& [index, events] : threads)
+    for (auto const& e : events) {
+      std::format_to(to,
+          "{}\n{{\"name\":\"{}\",\"cat\":\"request\",\"ph\":\"X\","
+          "\"ts\":{:.3f},\"dur\":{:.3f},\"pid\":{},\"tid\":{},"
+          "\"args\":{{\"request\":{}}}}}",
+          first ? "" : ",", phase_names[std::size_t(e.what)],
+          us(e.start), us(e.end) - us(e.start), pid, index, e.request);
+      first = false;
+    }
+
+  out += "\n]}\n";
+  return out;
+}
+
+namespace detail {
+
+inline void write_file(std::string const& path, std::string const& contents,
+    char const* what)
+{
+  std::ofstream file(path, std::ios::binary | std::ios::trunc);
+  file << contents;
+  if (!file.flush())
+    std::cerr << std::format("Error: could not write the {} to {}\n",
+        what, path);
+}
+
+} // namespace detail
+
+// Write the dumps that are configured
+inline void dump()
+{
+  if (!detail::dumps.histograms.empty())
+    detail::write_file(detail::dumps.histograms, render_histograms(),
+        "phase histograms");
+  if (!detail::dumps.trace.empty())
+    detail::write_file(detail::dumps.trace, render_trace(), "trace");
+}
+
+// Dump every time the process gets SIGUSR1, on 'ioc'. Returns whether it
+// is waiting for the signal, which it is not if there is nothing to dump.
+inline bool dump_on_signal(asio::io_context& ioc)
+{
+  if (detail::dumps.histograms.empty() && detail::dumps.trace.empty())
+    return false;
+
+  struct waiter
+  {
+    std::shared_ptr<asio::signal_set> signals;
+
+    void operator()(boost::system::error_code ec, int)
+    {
+      if (ec) return;
+      dump();
+      signals->async_wait(std::move(*this));
+    }
+  };
+
+  auto signals = std::make_shared<asio::signal_set>(ioc, SIGUSR1);
+  signals->async_wait(waiter{signals});
+  return true;
+}
+
+#else
+
+inline void configure(dump_settings) {}
+inline bool dump_on_signal(asio::io_context&) { return false; }
+
+class connection
+{
+  public:
+  explicit connection(clock::time_point = clock::now()) {}
+  connection(connection const&) = delete;
+  connection& operator=(connection const&) = delete;
+
+  void read(std::size_t) {}
+  void handled() {}
+  void shed() {}
+  void limited() {}
+  void wrote(std::size_t) {}
+  void sent() {}
+};
+
+#endif
+
+} // namespace metrics
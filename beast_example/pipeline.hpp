@@ -0,0 +1,197 @@
+#pragma once
+
+#include "response_cache.hpp"
+#include "streaming.hpp"
+
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+
+#include <deque>
+#include <memory>
+#include <optional>
+#include <span>
+#include <vector>
+
+// Helpers for HTTP/1.1 pipelining.
+//
+// A client that pipelines sends several requests without waiting for the
+// responses, so after one read the buffer often already holds the next few
+// requests. Instead of answering them one write at a time, the sessions
+// drain every complete request that is already buffered and send all of the
+// responses with a single gathered write (i.e. one writev).
+
+namespace pipeline {
+
+namespace beast = boost::beast;
+namespace http = beast::http;
+namespace asio = boost::asio;
+
+// Upper bound on the number of responses coalesced into one write
+inline constexpr std::size_t max_batch = 64;
+
+// Parse the next request from data that is already in 'buffer', without
+// touching the socket. Returns the number of bytes the request took up, or
+// 0, leaving the buffer untouched, if the buffer does not hold a complete
+// request. Malformed input is also left in place so that the next regular
+// read reports the error as usual.
+//
+// As with http::read, 'req' must be empty. It is moved into the parser so
+// that the parsed request is built with req's own allocator.
+template <class Body, class Allocator, class BufferAllocator>
+std::size_t read_buffered(
+    beast::basic_flat_buffer<BufferAllocator>& buffer,
+    http::request<Body, http::basic_fields<Allocator>>& req)
+{
+  if (buffer.size() == 0) return 0;
+
+  http::request_parser<Body, Allocator> parser(std::move(req));
+  parser.eager(true);
+
+  auto const data = buffer.data();
+  std::size_t used = 0;
+  beast::error_code ec;
+
+  while (!parser.is_done()) {
+    auto const n = parser.put(asio::buffer(data + used), ec);
+    used += n;
+
+    if (ec == http::error::need_more) {
+      if (n == 0 || used == buffer.size()) return 0;
+      ec = {};
+      continue;
+    }
+
+    if (ec) return 0;
+  }
+
+  req = parser.release();
+  buffer.consume(used);
+
+  return used;
+}
+
+// The responses to a batch of pipelined requests.
+//
+// Cached responses contribute their shared buffers directly. Any other
+// response gets a serializer, and the buffers of all of the responses are
+// collected into one sequence for a single gathered write. Everything must
+// stay alive until that write completes.
+template <class Body>
+class response_batch
+{
+  public:
+  using response_type = http::response<Body>;
+
+  // Queue a response. Responses after one that closes the connection are
+  // never sent, so the caller should stop adding once keep_alive() is false.
+  void push(response_type&& res)
+  {
+    keep_alive_ = res.keep_alive();
+
+    auto& r = responses_.emplace_back(std::move(res));
+    auto& sr = serializers_.emplace_back(r);
+
+    // A body with a single buffer (e.g. string_body) is serialized in one
+    // step i.e. the header and body buffers are returned together.
+    beast::error_code ec;
+    sr.next(ec, [this](beast::error_code&, auto const& buffers) {
+        for (auto const& b : beast::buffers_range_ref(buffers))
+          buffers_.emplace_back(b);
+      });
+  }
+
+  // Queue a pre-serialized response (see response_cache.hpp). Only a
+  // reference is taken - the response's bytes are never copied.
+  void push(
+      std::shared_ptr<response_cache::cached_response const> const& res,
+      unsigned version,
+      bool keep_alive,
+      bool send_body = true)
+  {
+    keep_alive_ = keep_alive;
+
+    auto const& r = cached_.emplace_back(res);
+    for (auto const& b : r->buffers(version, keep_alive, send_body))
+      if (b.size()) buffers_.emplace_back(b);
+  }
+
+  // Queue a response whose body is a file. Only its header is added to
+  // the buffers: the body is sent straight from the file once they have
+  // been written (see static_files::async_sendfile), so nothing can be
+  // queued after it.
+  void push(http::response<http::file_body>&& res)
+  {
+    keep_alive_ = res.keep_alive();
+
+    file_.emplace(std::move(res));
+    auto& sr = file_serializer_.emplace(*file_);
+    sr.split(true);
+
+    beast::error_code ec;
+    sr.next(ec, [this](beast::error_code&, auto const& buffers) {
+        for (auto const& b : beast::buffers_range_ref(buffers))
+          buffers_.emplace_back(b);
+      });
+  }
+
+  // Queue a response whose body is generated as it is sent (see
+  // streaming.hpp). It is written after the buffers, header and all, so
+  // nothing can be queued after it either.
+  void push(streaming::response&& res)
+  {
+    keep_alive_ = res.message.keep_alive();
+    stream_.emplace(std::move(res));
+  }
+
+  // A view rather than the vector itself, because the write operations
+  // take their own copy of the buffer sequence
+  std::span<asio::const_buffer const> buffers() const { return buffers_; }
+
+  // The file to send after the buffers, if any
+  http::file_body::value_type* file()
+  {
+    return file_ ? &file_->body() : nullptr;
+  }
+
+  // The response to send after the buffers, if any
+  streaming::response* stream()
+  {
+    return stream_ ? &*stream_ : nullptr;
+  }
+
+  std::size_t size() const
+  {
+    return responses_.size() + cached_.size() + (file_ ? 1 : 0) +
+      (stream_ ? 1 : 0);
+  }
+
+  bool full() const { return size() >= max_batch || file_ || stream_; }
+  bool keep_alive() const { return keep_alive_; }
+
+  // Drop the responses once they have been written
+  void clear()
+  {
+    buffers_.clear();
+    serializers_.clear();
+    responses_.clear();
+    cached_.clear();
+    file_serializer_.reset();
+    file_.reset();
+    stream_.reset();
+    keep_alive_ = true;
+  }
+
+  private:
+  // std::deque keeps references stable as elements are added, which the
+  // serializers (and the buffers they hand out) rely on
+  std::deque<response_type> responses_;
+  std::deque<http::response_serializer<Body>> serializers_;
+  std::vector<std::shared_ptr<response_cache::cached_response const>> cached_;
+  std::optional<http::response<http::file_body>> file_;
+  std::optional<http::response_serializer<http::file_body>> file_serializer_;
+  std::optional<streaming::response> stream_;
+  std::vector<asio::const_buffer> buffers_;
+  bool keep_alive_ = true;
+};
+
+} // namespace pipeline
@@ -0,0 +1,527 @@
+#pragma once
+
+#include "deadline.hpp"
+#include "response_cache.hpp"
+
+#include <boost/asio/coroutine.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Reverse proxying to local backends.
+//
+// Requests under a proxied prefix are forwarded to its upstream server over
+// a keep-alive connection from the calling thread's pool, rather than a new
+// connection (a handshake, and a socket left in TIME_WAIT) per request. The
+// response is relayed as it arrives: its header is parsed and serialized
+// again for the client, and its body passes through a fixed 16 KiB buffer
+// (buffer_body), however large it is. Each read from the upstream and each
+// write to the client has io_timeout to itself, so a body keeps streaming
+// for as long as both sides keep up, however long that takes. A client
+// connection in an idle timing wheel is timed by the wheel instead, and
+// every step of the relay touches its entry.
+//
+// A thread keeps at most max_idle idle connections to each upstream, and
+// drops those that have been idle longer than idle_timeout rather than
+// wait for the backend's own keep-alive timeout to close them under a
+// request. A pooled connection that the backend has closed anyway is only
+// found out when the request is written or its response read. The request
+// is tried again on another connection when writing it failed, or when the
+// connection reached EOF before any of the response, but only if its method
+// is idempotent: otherwise the backend may have acted on it already. A
+// request that timed out is never tried again, it is answered 502.
+//
+// Each upstream also tracks its health: after failures_to_open failures in
+// a row to connect or to get a response, its requests are answered 502
+// straight away, except for one every retry_after to see if it is back.
+//
+// The hop-by-hop fields (Connection and those it names, Keep-Alive, TE,
+// Trailer, Upgrade and the Proxy-* fields) describe one connection, so they
+// are removed from the request and from the response rather than passed
+// on. Transfer-Encoding is left to the serializers, which frame the body
+// again for the other side. An HTTP/1.0 client cannot read a chunked body,
+// so it gets the body unframed and the connection closes after it.
+//
+// Request bodies are not streamed: the servers read each request whole (up
+// to the parser's body limit) before it is routed.
+
+namespace proxy {
+
+namespace beast = boost::beast;
+namespace http = beast::http;
+namespace asio = boost::asio;
+using tcp = asio::ip::tcp;
+using clock = std::chrono::steady_clock;
+
+// A backend server, shared by all threads
+class upstream
+{
+  public:
+  static constexpr unsigned failures_to_open = 3;
+  static constexpr auto retry_after = std::chrono::seconds(1);
+  static constexpr auto idle_timeout = std::chrono::seconds(15);
+  static constexpr auto io_timeout = std::chrono::seconds(30);
+
+  // Resolves host:port straight away (and throws if it cannot)
+  upstream(
+      std::string const& host,
+      std::string const& port,
+      std::size_t max_idle,
+      beast::string_view server)
+    : endpoints_(resolve(host, port))
+    , max_idle_(max_idle)
+    , bad_gateway_(response_cache::make_cached_response(
+        http::status::bad_gateway, server,
+        "The upstream server is unavailable\n", "text/plain"))
+  {
+  }
+
+  upstream(upstream const&) = delete;
+  upstream& operator=(upstream const&) = delete;
+
+  tcp::resolver::results_type const& endpoints() const { return endpoints_; }
+
+  std::size_t max_idle() const { return max_idle_; }
+
+  response_cache::cached_response const& bad_gateway() const
+  {
+    return *bad_gateway_;
+  }
+
+  // Whether to send it a request, rather than answer 502
+  bool available() const
+  {
+    if (failures_.load(std::memory_order_relaxed) < failures_to_open)
+      return true;
+
+    // Let one request through each time the retry time comes round
+    auto const now = ticks(clock::now());
+    auto retry = retry_at_.load(std::memory_order_relaxed);
+    return now >= retry && retry_at_.compare_exchange_strong(
+        retry, now + ticks(retry_after), std::memory_order_relaxed);
+  }
+
+  void succeeded()
+  {
+    failures_.store(0, std::memory_order_relaxed);
+  }
+
+  void failed()
+  {
+    if (failures_.fetch_add(1, std::memory_order_relaxed) + 1 == failures_to_open)
+      retry_at_.store(ticks(clock::now() + retry_after),
+          std::memory_order_relaxed);
+  }
+
+  private:
+  static tcp::resolver::results_type resolve(
+      std::string const& host,
+      std::string const& port)
+  {
+    asio::io_context ioc;
+    return tcp::resolver(ioc).resolve(host, port);
+  }
+
+  template <class T>
+  static std::int64_t ticks(T t)
+  {
+    if constexpr (std::is_same_v<T, clock::time_point>)
+      return t.time_since_epoch().count();
+    else
+      return std::chrono::duration_cast<clock::duration>(t).count();
+  }
+
+  tcp::resolver::results_type const endpoints_;
+  std::size_t const max_idle_;
+  std::shared_ptr<response_cache::cached_response const> const bad_gateway_;
+
+  mutable std::atomic<std::int64_t> retry_at_{0};
+  std::atomic<unsigned> failures_{0};
+};
+
+// The targets under 'prefix' go to 'upstream'
+struct route
+{
+  std::string prefix;
+  std::unique_ptr<upstream> server;
+};
+
+// A route given as <prefix>=<host>:<port>, e.g. "/api=127.0.0.1:9000"
+struct route_spec
+{
+  std::string prefix;
+  std::string host;
+  std::string port;
+};
+
+inline std::optional<route_spec> parse_route(std::string_view spec)
+{
+  auto const eq = spec.find('=');
+  auto const colon = spec.rfind(':');
+  if (eq == 0 || eq == std::string_view::npos ||
+      colon == std::string_view::npos || colon < eq || spec[0] != '/')
+    return std::nullopt;
+
+  return route_spec{
+    std::string(spec.substr(0, eq)),
+    std::string(spec.substr(eq + 1, colon - eq - 1)),
+    std::string(spec.substr(colon + 1))};
+}
+
+// The upstream for 'target', if it is proxied
+inline upstream* find(std::vector<route> const& routes, std::string_view target)
+{
+  for (auto const& r : routes)
+    if (target.starts_with(r.prefix))
+      return r.server.get();
+  return nullptr;
+}
+
+// An open connection to an upstream
+struct connection
+{
+  explicit connection(asio::any_io_executor ex)
+    : stream(std::move(ex))
+  {
+  }
+
+  beast::tcp_stream stream;
+  beast::flat_buffer buffer;
+  clock::time_point idle_since;
+};
+
+namespace detail {
+
+struct idle_list
+{
+  upstream const* server;
+  std::vector<std::unique_ptr<connection>> connections;
+};
+
+// The calling thread's idle connections to 'up'
+inline std::vector<std::unique_ptr<connection>>& idle(upstream const& up)
+{
+  thread_local std::vector<idle_list> lists;
+
+  for (auto& list : lists)
+    if (list.server == &up) return list.connections;
+
+  lists.push_back({&up, {}});
+  lists.back().connections.reserve(up.max_idle());
+  return lists.back().connections;
+}
+
+} // namespace detail
+
+// Take the calling thread's most recently used connection to 'up' that is
+// not too old, if it has one
+inline std::unique_ptr<connection> take(upstream const& up)
+{
+  auto& idle = detail::idle(up);
+  auto const now = clock::now();
+
+  while (!idle.empty()) {
+    auto c = std::move(idle.back());
+    idle.pop_back();
+    if (now - c->idle_since < upstream::idle_timeout) return c;
+  }
+
+  return nullptr;
+}
+
+// Keep 'c' for the calling thread's next request to 'up', if there is room
+inline void give(upstream const& up, std::unique_ptr<connection> c)
+{
+  auto& idle = detail::idle(up);
+  if (idle.size() >= up.max_idle()) return;
+
+  c->idle_since = clock::now();
+  idle.push_back(std::move(c));
+}
+
+namespace detail {
+
+// Whether a request can be sent twice with the same effect as once
+inline bool idempotent(http::verb method)
+{
+  switch (method) {
+    case http::verb::get:
+    case http::verb::head:
+    case http::verb::options:
+    case http::verb::trace:
+    case http::verb::put:
+    case http::verb::delete_:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Remove the fields that only apply to the connection they arrived on
+template <bool isRequest, class Fields>
+void strip_hop_by_hop(http::header<isRequest, Fields>& h)
+{
+  // Copied, as the Connection field is erased while its tokens are in use
+  std::string const connection(h[http::field::connection]);
+  for (auto const& token : http::token_list(connection))
+    h.erase(token);
+
+  for (auto const field : {
+         http::field::connection,
+         http::field::keep_alive,
+         http::field::proxy_authenticate,
+         http::field::proxy_authorization,
+         http::field::proxy_connection,
+         http::field::te,
+         http::field::trailer,
+         http::field::upgrade})
+    h.erase(field);
+}
+
+template <class Stream, class Request, class Handler>
+class forward_op
+  : public beast::stable_async_base<Handler, typename Stream::executor_type>
+  , public asio::coroutine
+{
+  // Kept in one place while the parser and the serializer refer to it
+  struct state
+  {
+    std::unique_ptr<connection> conn;
+    std::optional<http::response_parser<http::buffer_body>> parser;
+    std::optional<http::response_serializer<http::buffer_body>> serializer;
+    std::array<char, 16384> chunk;
+  };
+
+  upstream& up_;
+  Stream& client_;
+  Request& req_;
+  asio::any_io_executor ex_;
+  deadline::limit client_limit_;
+  state& s_;
+
+  // The client's choice, unless the response has to be ended by closing
+  bool keep_alive_;
+  bool reuse_upstream_ = false;
+  bool pooled_ = false;
+  bool written_ = false;
+
+  public:
+  forward_op(
+      Handler&& handler,
+      upstream& up,
+      Stream& client,
+      Request& req,
+      asio::any_io_executor ex,
+      deadline::limit client_limit)
+    : beast::stable_async_base<Handler, typename Stream::executor_type>(
+        std::move(handler), client.get_executor())
+    , up_(up)
+    , client_(client)
+    , req_(req)
+    , ex_(std::move(ex))
+    , client_limit_(client_limit)
+    , s_(beast::allocate_stable<state>(*this))
+    , keep_alive_(req.keep_alive())
+  {
+    (*this)({}, 0, false);
+  }
+
+  void operator()(beast::error_code ec, tcp::endpoint)
+  {
+    (*this)(ec, 0);
+  }
+
+  // Give the next write its own time limit, unless the client's connection
+  // is timed by a wheel
+  void time_client()
+  {
+    if (!client_limit_.idle) client_.expires_after(client_limit_.timeout);
+  }
+
+  void operator()(
+      beast::error_code ec = {},
+      std::size_t = 0,
+      bool is_continuation = true)
+  {
+    // Every step of the relay keeps the client's connection from idling
+    if (client_limit_.idle) client_limit_.idle->touch();
+
+    BOOST_ASIO_CORO_REENTER(*this)
+    {
+      // The connection to the upstream stays open whatever the client does
+      strip_hop_by_hop(req_.base());
+      req_.keep_alive(true);
+
+      while (up_.available()) {
+        s_.conn = take(up_);
+        pooled_ = s_.conn != nullptr;
+
+        if (!pooled_) {
+          s_.conn = std::make_unique<connection>(ex_);
+          s_.conn->stream.expires_after(upstream::io_timeout);
+          BOOST_ASIO_CORO_YIELD
+          s_.conn->stream.async_connect(up_.endpoints(), std::move(*this));
+          if (ec) {
+            s_.conn.reset();
+            up_.failed();
+            break;
+          }
+          s_.conn->stream.socket().set_option(tcp::no_delay(true), ec);
+        }
+
+        s_.conn->stream.expires_after(upstream::io_timeout);
+        BOOST_ASIO_CORO_YIELD
+        http::async_write(s_.conn->stream, req_, std::move(*this));
+
+        written_ = !ec;
+        if (written_) {
+          // A response to HEAD has no body, whatever its header says
+          s_.parser.emplace();
+          s_.parser->body_limit(std::numeric_limits<std::uint64_t>::max());
+          s_.parser->skip(req_.method() == http::verb::head);
+
+          BOOST_ASIO_CORO_YIELD
+          http::async_read_header(
+              s_.conn->stream, s_.conn->buffer, *s_.parser, std::move(*this));
+        }
+
+        if (!ec) break;
+
+        // A pooled connection may just have been closed by the upstream,
+        // so try another one if the request cannot have been acted on, or
+        // can safely be acted on twice
+        s_.conn.reset();
+        if (pooled_ && ec != beast::error::timeout &&
+            (!written_ || ec == http::error::end_of_stream) &&
+            idempotent(req_.method()))
+          continue;
+
+        up_.failed();
+        break;
+      }
+
+      // Nothing has been sent yet, so the client can still have a 502
+      if (!s_.conn) {
+        time_client();
+        BOOST_ASIO_CORO_YIELD
+        asio::async_write(client_,
+            up_.bad_gateway().buffers(req_.version(), keep_alive_,
+                req_.method() != http::verb::head),
+            std::move(*this));
+        return this->complete(is_continuation, ec, keep_alive_);
+      }
+
+      up_.succeeded();
+
+      // A body that only ends when the upstream closes has to end the same
+      // way for the client
+      reuse_upstream_ = s_.parser->keep_alive() && !s_.parser->need_eof();
+      if (s_.parser->need_eof()) keep_alive_ = false;
+
+      // An HTTP/1.0 client cannot read chunks, so it reads the body to the
+      // end of the connection instead
+      if (req_.version() < 11 && s_.parser->chunked()) {
+        s_.parser->get().chunked(false);
+        keep_alive_ = false;
+      }
+
+      // The response is the proxy's own to the client
+      strip_hop_by_hop(s_.parser->get().base());
+      s_.parser->get().version(req_.version());
+      s_.parser->get().keep_alive(keep_alive_);
+      s_.serializer.emplace(s_.parser->get());
+
+      // A response without a body to relay (such as one to HEAD) is only
+      // its header
+      if (s_.parser->is_done()) {
+        time_client();
+        BOOST_ASIO_CORO_YIELD
+        http::async_write_header(client_, *s_.serializer, std::move(*this));
+        if (ec) return this->complete(is_continuation, ec, false);
+      }
+
+      // Otherwise relay the body a chunk at a time, with the header in
+      // front of the first one
+      while (!s_.parser->is_done()) {
+        s_.parser->get().body().data = s_.chunk.data();
+        s_.parser->get().body().size = s_.chunk.size();
+
+        s_.conn->stream.expires_after(upstream::io_timeout);
+        BOOST_ASIO_CORO_YIELD
+        http::async_read(
+            s_.conn->stream, s_.conn->buffer, *s_.parser, std::move(*this));
+
+        // The chunk is full
+        if (ec == http::error::need_buffer) ec = {};
+        if (ec) return this->complete(is_continuation, ec, false);
+
+        s_.parser->get().body().size =
+          s_.chunk.size() - s_.parser->get().body().size;
+        s_.parser->get().body().data = s_.chunk.data();
+        s_.parser->get().body().more = !s_.parser->is_done();
+
+        // Each chunk has as long to reach the client as to come from the
+        // upstream, however long the whole body takes
+        time_client();
+        BOOST_ASIO_CORO_YIELD
+        http::async_write(client_, *s_.serializer, std::move(*this));
+
+        // The chunk has been sent
+        if (ec == http::error::need_buffer) ec = {};
+        if (ec) return this->complete(is_continuation, ec, false);
+      }
+
+      if (reuse_upstream_) give(up_, std::move(s_.conn));
+
+      this->complete(is_continuation, ec, keep_alive_);
+    }
+  }
+};
+
+} // namespace detail
+
+// Forward 'req' to 'up' and relay its response to 'client', answering 502
+// when the upstream cannot be reached. New upstream connections use 'ex',
+// which should be the io_context's own executor, since they are pooled per
+// thread (so the completion handler should have an associated executor, if
+// the client stream needs one). Each write to the client has to finish
+// within 'client_limit' (usually upstream::io_timeout). The completion
+// signature is void(error_code, bool keep_alive), where keep_alive says
+// whether the client connection can take another request.
+template <class Stream, class Request, class CompletionToken>
+auto async_forward(
+    upstream& up,
+    Stream& client,
+    Request& req,
+    asio::any_io_executor ex,
+    deadline::limit client_limit,
+    CompletionToken&& token)
+{
+  return asio::async_initiate<
+    CompletionToken, void(beast::error_code, bool)>(
+      [](auto&& handler,
+         upstream* up,
+         Stream* client,
+         Request* req,
+         asio::any_io_executor ex,
+         deadline::limit client_limit) {
+        using handler_type = std::decay_t<decltype(handler)>;
+        detail::forward_op<Stream, Request, handler_type>(
+            std::forward<decltype(handler)>(handler), *up, *client, *req,
+            std::move(ex), client_limit);
+      },
+      token, &up, &client, &req, std::move(ex), client_limit);
+}
+
+} // namespace proxy
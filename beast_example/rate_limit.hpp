@@ -0,0 +1,150 @@
+#pragma once
+
+#include <boost/asio/ip/address.hpp>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
+
+// Rate limiting by client address.
+//
+// Every client has a token bucket: it may make 'burst' requests straight
+// away, and then 'rate' a second. The bucket is kept as the single time at
+// which it will next be full (the "theoretical arrival time" of GCRA, an
+// equivalent form of the token bucket): a request takes 1/rate off the
+// tokens by moving that time on by 1/rate, and is allowed unless that
+// would put it more than a burst's worth ahead of now. No tokens have to
+// be topped up, and a bucket is one number.
+//
+// The buckets are spread over shards by a hash of the address, and each
+// shard has its own lock, so threads serving different clients do not
+// contend. A bucket whose time has passed is full again, the same as no
+// bucket at all, so each shard drops those once a second, when it is next
+// used, which keeps the table as small as the set of recently busy
+// clients.
+
+namespace rate_limit {
+
+namespace asio = boost::asio;
+using clock = std::chrono::steady_clock;
+
+class limiter
+{
+  public:
+  static constexpr std::size_t num_shards = 64;
+  static constexpr auto sweep_interval = std::chrono::seconds(1);
+
+  // Allow each client 'rate' requests a second, in bursts of up to
+  // 'burst'. A rate of zero turns the limiter off.
+  void configure(double rate, std::size_t burst)
+  {
+    interval_ = rate > 0 ? std::int64_t(1e9 / rate) : 0;
+    if (rate > 0 && interval_ == 0) interval_ = 1;
+    tolerance_ = std::int64_t(burst ? burst : 1) * interval_;
+  }
+
+  bool enabled() const noexcept { return interval_ != 0; }
+
+  // Take a token from the client's bucket, unless it is empty
+  bool allow(asio::ip::address const& client, clock::time_point now)
+  {
+    auto const t = ns(now);
+    auto const k = key(client);
+    auto& s = shard_of(k);
+
+    std::lock_guard lock(s.mutex);
+    sweep(s, t);
+
+    auto const it = s.full_at.try_emplace(k, t).first;
+    auto const start = std::max(it->second, t);
+    if (start + interval_ - t > tolerance_) return false;
+
+    it->second = start + interval_;
+    return true;
+  }
+
+  // Is the client's bucket empty? Unlike allow() this takes nothing, so a
+  // listener can turn a client's new connections away while it is over
+  // its limit without using up its tokens.
+  bool exhausted(asio::ip::address const& client, clock::time_point now)
+  {
+    auto const t = ns(now);
+    auto const k = key(client);
+    auto& s = shard_of(k);
+
+    std::lock_guard lock(s.mutex);
+    auto const it = s.full_at.find(k);
+    return it != s.full_at.end() &&
+           std::max(it->second, t) + interval_ - t > tolerance_;
+  }
+
+  private:
+  // IPv4 addresses as IPv4-mapped IPv6 ones
+  struct key_type
+  {
+    std::uint64_t high;
+    std::uint64_t low;
+
+    bool operator==(key_type const&) const = default;
+  };
+
+  struct hash
+  {
+    std::size_t operator()(key_type const& k) const noexcept
+    {
+      auto const h =
+        (k.high ^ (k.low * 0x9e3779b97f4a7c15ull)) * 0xbf58476d1ce4e5b9ull;
+      return std::size_t(h ^ (h >> 31));
+    }
+  };
+
+  struct alignas(64) shard
+  {
+    std::mutex mutex;
+    std::unordered_map<key_type, std::int64_t, hash> full_at;
+    std::int64_t next_sweep = 0;
+  };
+
+  static key_type key(asio::ip::address const& a)
+  {
+    auto const bytes = a.is_v4()
+      ? asio::ip::make_address_v6(asio::ip::v4_mapped, a.to_v4()).to_bytes()
+      : a.to_v6().to_bytes();
+
+    key_type k;
+    std::memcpy(&k.high, bytes.data(), 8);
+    std::memcpy(&k.low, bytes.data() + 8, 8);
+    return k;
+  }
+
+  static std::int64_t ns(clock::time_point t)
+  {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        t.time_since_epoch()).count();
+  }
+
+  shard& shard_of(key_type const& k)
+  {
+    return shards_[(hash{}(k) >> 32) % num_shards];
+  }
+
+  // Drop the shard's full buckets, once every sweep_interval
+  static void sweep(shard& s, std::int64_t now)
+  {
+    if (now < s.next_sweep) return;
+
+    std::erase_if(s.full_at, [now](auto const& e) { return e.second <= now; });
+    s.next_sweep = now + std::chrono::nanoseconds(sweep_interval).count();
+  }
+
+  std::int64_t interval_ = 0;
+  std::int64_t tolerance_ = 0;
+  std::array<shard, num_shards> shards_;
+};
+
+} // namespace rate_limit
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <vector>
+
+// Per-thread recycling memory for handlers, sessions and buffers.
+//
+// Every thread keeps a free list for each power-of-two size class from 64
+// bytes to 64 KiB. Blocks are returned to the free list of whichever thread
+// releases them, so at steady state the same blocks just circulate and the
+// global heap is only touched to grow the cache or for oversized requests.
+// None of this needs a lock: a thread only ever touches its own cache.
+
+namespace recycling {
+
+// Counters for checking how often the global heap is still used. Each
+// thread has its own set, which only it writes, and they are summed on read.
+struct stats
+{
+  std::atomic<std::uint64_t> recycled{0};
+  std::atomic<std::uint64_t> heap{0};
+  std::atomic<std::uint64_t> sessions_created{0};
+  std::atomic<std::uint64_t> sessions_reused{0};
+};
+
+struct totals
+{
+  std::uint64_t recycled = 0;
+  std::uint64_t heap = 0;
+  std::uint64_t sessions_created = 0;
+  std::uint64_t sessions_reused = 0;
+};
+
+namespace detail {
+
+inline std::mutex registry_mutex;
+inline std::vector<std::shared_ptr<stats>> registry;
+
+inline void bump(std::atomic<std::uint64_t>& c)
+{
+  c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+} // namespace detail
+
+// The calling thread's counters (registered on first use)
+inline stats& local_stats()
+{
+  thread_local std::shared_ptr<stats> s = [] {
+    auto p = std::make_shared<stats>();
+    std::lock_guard lock(detail::registry_mutex);
+    detail::registry.push_back(p);
+    return p;
+  }();
+  return *s;
+}
+
+// Sum the counters of every thread
+inline totals read_stats()
+{
+  totals t;
+  std::lock_guard lock(detail::registry_mutex);
+  for (auto const& s : detail::registry) {
+    t.recycled += s->recycled.load(std::memory_order_relaxed);
+    t.heap += s->heap.load(std::memory_order_relaxed);
+    t.sessions_created += s->sessions_created.load(std::memory_order_relaxed);
+    t.sessions_reused += s->sessions_reused.load(std::memory_order_relaxed);
+  }
+  return t;
+}
+
+// A thread's cache of free blocks
+class thread_cache
+{
+  public:
+  static constexpr std::size_t min_block = 64;
+  static constexpr std::size_t num_classes = 11; // 64 B ... 64 KiB
+  static constexpr std::size_t max_cached = 256; // blocks per class
+
+  // Reserving the free lists up front means that releasing a block can
+  // never throw (or allocate)
+  thread_cache() : stats_(local_stats())
+  {
+    for (auto& list : free_) list.reserve(max_cached);
+  }
+
+  ~thread_cache()
+  {
+    for (auto& list : free_)
+      for (auto* p : list)
+        ::operator delete(p);
+  }
+
+  thread_cache(thread_cache const&) = delete;
+  thread_cache& operator=(thread_cache const&) = delete;
+
+  void* allocate(std::size_t size)
+  {
+    auto const c = size_class(size);
+    if (c < num_classes && !free_[c].empty()) {
+      auto* p = free_[c].back();
+      free_[c].pop_back();
+      detail::bump(stats_.recycled);
+      return p;
+    }
+
+    detail::bump(stats_.heap);
+    return ::operator new(c < num_classes ? block_size(c) : size);
+  }
+
+  void deallocate(void* p, std::size_t size) noexcept
+  {
+    auto const c = size_class(size);
+    if (c < num_classes && free_[c].size() < max_cached) {
+      free_[c].push_back(p);
+      return;
+    }
+
+    ::operator delete(p);
+  }
+
+  static thread_cache& local()
+  {
+    thread_local thread_cache cache;
+    return cache;
+  }
+
+  private:
+  static std::size_t size_class(std::size_t size)
+  {
+    if (size <= min_block) return 0;
+    return std::bit_width(size - 1) - std::bit_width(min_block - 1);
+  }
+
+  static std::size_t block_size(std::size_t c)
+  {
+    return min_block << c;
+  }
+
+  stats& stats_;
+  std::array<std::vector<void*>, num_classes> free_;
+};
+
+// A standard allocator drawing on the calling thread's cache. It is
+// stateless, so any instance can free memory from any other and it can be
+// used wherever an allocator is rebound (handlers, containers, buffers).
+template <class T>
+class allocator
+{
+  public:
+  using value_type = T;
+
+  allocator() noexcept = default;
+
+  template <class U>
+  allocator(allocator<U> const&) noexcept {}
+
+  T* allocate(std::size_t n)
+  {
+    return static_cast<T*>(thread_cache::local().allocate(n * sizeof(T)));
+  }
+
+  void deallocate(T* p, std::size_t n) noexcept
+  {
+    thread_cache::local().deallocate(p, n * sizeof(T));
+  }
+
+  template <class U>
+  bool operator==(allocator<U> const&) const noexcept { return true; }
+};
+
+} // namespace recycling
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <boost/beast/http.hpp>
+
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <memory_resource>
+#include <optional>
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+// Per-session arena for requests.
+//
+// A default http::request allocates every header field separately from the
+// global heap, and frees them all again when the next request replaces it.
+// Here the fields and the body use a std::pmr resource drawing on a
+// monotonic arena owned by the session. Allocating is a pointer bump,
+// freeing is a no-op, and the whole arena is released in one step before
+// the next request is parsed. The first few KiB live inside the arena
+// itself, so a typical request's headers never reach the heap at all.
+
+namespace arena {
+
+namespace beast = boost::beast;
+namespace http = beast::http;
+
+// A std::pmr::polymorphic_allocator that can be assigned (basic_fields
+// requires it) and so moves along with the message it belongs to
+template <class T>
+class resource_allocator
+{
+  public:
+  using value_type = T;
+  using propagate_on_container_copy_assignment = std::true_type;
+  using propagate_on_container_move_assignment = std::true_type;
+  using propagate_on_container_swap = std::true_type;
+
+  resource_allocator() noexcept
+    : resource_(std::pmr::get_default_resource())
+  {
+  }
+
+  resource_allocator(std::pmr::memory_resource* resource) noexcept
+    : resource_(resource)
+  {
+  }
+
+  template <class U>
+  resource_allocator(resource_allocator<U> const& other) noexcept
+    : resource_(other.resource())
+  {
+  }
+
+  T* allocate(std::size_t n)
+  {
+    return static_cast<T*>(resource_->allocate(n * sizeof(T), alignof(T)));
+  }
+
+  void deallocate(T* p, std::size_t n) noexcept
+  {
+    resource_->deallocate(p, n * sizeof(T), alignof(T));
+  }
+
+  std::pmr::memory_resource* resource() const noexcept { return resource_; }
+
+  template <class U>
+  bool operator==(resource_allocator<U> const& other) const noexcept
+  {
+    return resource_ == other.resource() ||
+        resource_->is_equal(*other.resource());
+  }
+
+  private:
+  std::pmr::memory_resource* resource_;
+};
+
+using allocator = resource_allocator<char>;
+
+using fields = http::basic_fields<allocator>;
+using string_body = http::basic_string_body<
+  char, std::char_traits<char>, allocator>;
+
+using request = http::request<string_body, fields>;
+
+// Owns the current request of a session and the memory behind it
+template <std::size_t InlineSize = 4096>
+class basic_request_arena
+{
+  public:
+  // Requests bigger than the inline storage spill over to 'upstream'
+  explicit basic_request_arena(
+      std::pmr::memory_resource* upstream = std::pmr::get_default_resource())
+    : resource_(storage_.data(), storage_.size(), upstream)
+  {
+    renew();
+  }
+
+  // The request and the resource point into 'storage_'
+  basic_request_arena(basic_request_arena const&) = delete;
+  basic_request_arena& operator=(basic_request_arena const&) = delete;
+
+  // Discard the current request along with everything allocated for it,
+  // and return a new empty request (ready for http::read) that allocates
+  // from the start of the arena again
+  request& renew()
+  {
+    req_.reset();
+    resource_.release();
+
+    allocator alloc(&resource_);
+    return req_.emplace(std::piecewise_construct,
+        std::make_tuple(alloc), std::make_tuple(alloc));
+  }
+
+  request& get() { return *req_; }
+
+  private:
+  alignas(std::max_align_t) std::array<std::byte, InlineSize> storage_;
+  std::pmr::monotonic_buffer_resource resource_;
+
+  // Destroyed before the resource its memory came from
+  std::optional<request> req_;
+};
+
+using request_arena = basic_request_arena<>;
+
+namespace detail {
+
+inline std::vector<std::unique_ptr<request_arena>>& spare_arenas()
+{
+  thread_local std::vector<std::unique_ptr<request_arena>> spare;
+  return spare;
+}
+
+} // namespace detail
+
+// A session that only holds an arena while it has a request to read (see
+// async_http_server --idle-release) takes one from the calling thread's
+// spares, and gives it back to whichever thread it is on when done
+inline std::unique_ptr<request_arena> acquire()
+{
+  auto& spare = detail::spare_arenas();
+  if (spare.empty()) return std::make_unique<request_arena>();
+
+  auto a = std::move(spare.back());
+  spare.pop_back();
+  return a;
+}
+
+inline void release(std::unique_ptr<request_arena> a)
+{
+  static constexpr std::size_t max_spare = 1024;
+
+  auto& spare = detail::spare_arenas();
+  if (!a || spare.size() >= max_spare) return;
+
+  a->renew();
+  spare.push_back(std::move(a));
+}
+
+} // namespace arena
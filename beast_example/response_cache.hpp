@@ -0,0 +1,148 @@
+#pragma once
+
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+
+#include <array>
+#include <format>
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace response_cache {
+
+namespace beast = boost::beast;
+namespace http = beast::http;
+namespace asio = boost::asio;
+
+// A response that is serialized once and then shared by every session.
+//
+// Building an http::response for each request copies the body, formats the
+// headers and calls prepare_payload() even though the bytes on the wire are
+// the same every time. A cached_response does that work once, up front, and
+// hands out const_buffers that point straight at its immutable storage.
+//
+// The only parts of the response that depend on the request are the HTTP
+// version in the status line and whether a Connection header is needed to
+// state the keep-alive choice. Both are picked from pre-built variants, so
+// 'patching' a response is just choosing which buffers to send.
+class cached_response
+{
+  public:
+  using buffers_type = std::array<asio::const_buffer, 4>;
+
+  // Serialize 'res'. The version and any Connection header in 'res' are
+  // ignored because they are chosen per request.
+  template <class Body, class Fields>
+  explicit cached_response(http::response<Body, Fields> const& res)
+    : status_(res.result())
+  {
+    serialize_header(res);
+
+    if constexpr (std::is_same_v<Body, http::string_body>)
+      body_storage_ = res.body();
+    else
+      static_assert(std::is_same_v<Body, http::empty_body>,
+          "cached_response supports string_body and empty_body");
+
+    body_ = body_storage_;
+  }
+
+  // Serialize the header 'res' and send 'body' after it without copying
+  // it. The body's memory (e.g. a mapped file) is kept alive by 'owner'.
+  template <class Fields>
+  cached_response(
+      http::response<http::empty_body, Fields> const& res,
+      std::string_view body,
+      std::shared_ptr<void const> owner)
+    : status_(res.result())
+    , body_(body)
+    , owner_(std::move(owner))
+  {
+    serialize_header(res);
+  }
+
+  // body_ may point into body_storage_
+  cached_response(cached_response const&) = delete;
+  cached_response& operator=(cached_response const&) = delete;
+
+  // The serialized response for a request with the given version and
+  // keep-alive choice. The body is left out for a HEAD request, but the
+  // header still describes it. The buffers stay valid for as long as this
+  // object.
+  buffers_type buffers(
+      unsigned version,
+      bool keep_alive,
+      bool send_body = true) const
+  {
+    return {
+      asio::buffer(version >= 11 ? status_line_11_ : status_line_10_),
+      asio::buffer(fields_),
+      asio::buffer(connection_line(version, keep_alive)),
+      send_body ? asio::buffer(body_.data(), body_.size())
+                : asio::const_buffer()};
+  }
+
+  http::status status() const { return status_; }
+
+  private:
+  template <class Fields>
+  void serialize_header(http::response_header<Fields> const& res)
+  {
+    auto const reason = res.reason().empty()
+      ? http::obsolete_reason(res.result()) : res.reason();
+
+    status_line_10_ = std::format("HTTP/1.0 {} {}\r\n",
+        res.result_int(), view(reason));
+    status_line_11_ = std::format("HTTP/1.1 {} {}\r\n",
+        res.result_int(), view(reason));
+
+    for (auto const& field : res) {
+      if (field.name() == http::field::connection) continue;
+      fields_ += std::format("{}: {}\r\n",
+          view(field.name_string()), view(field.value()));
+    }
+  }
+
+  static std::string_view view(beast::string_view s)
+  {
+    return {s.data(), s.size()};
+  }
+
+  // HTTP/1.1 defaults to keep-alive and HTTP/1.0 to close, so only the
+  // non-default choice needs a header (this matches what Beast emits)
+  static std::string_view connection_line(unsigned version, bool keep_alive)
+  {
+    if (version >= 11)
+      return keep_alive ? "\r\n" : "Connection: close\r\n\r\n";
+    return keep_alive ? "Connection: keep-alive\r\n\r\n" : "\r\n";
+  }
+
+  http::status status_;
+  std::string status_line_10_;
+  std::string status_line_11_;
+  std::string fields_;
+  std::string body_storage_;
+  std::string_view body_;
+  std::shared_ptr<void const> owner_;
+};
+
+// Build a shareable cached response with a text body
+inline std::shared_ptr<cached_response const>
+  make_cached_response(
+      http::status status,
+      beast::string_view server,
+      beast::string_view body,
+      beast::string_view content_type = {})
+{
+  http::response<http::string_body> res{status, 11};
+  res.set(http::field::server, server);
+  if (!content_type.empty())
+    res.set(http::field::content_type, content_type);
+  res.body().assign(body.data(), body.size());
+  res.prepare_payload();
+
+  return std::make_shared<cached_response const>(res);
+}
+
+} // namespace response_cache
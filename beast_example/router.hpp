@@ -0,0 +1,185 @@
+#pragma once
+
+#include <boost/beast/http.hpp>
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+// A route table that is built at compile time.
+//
+// The routes are (method, target) pairs, placed by "hash and displace":
+// the hash of a route picks a bucket, and each bucket has a displacement
+// that was searched for - at compile time, as the constructor is consteval
+// - so that the routes of every bucket land in slots no other route uses.
+// The hash is then perfect for this set of routes, and looking a request
+// up costs one hash of the target and one comparison, however many routes
+// there are. A duplicate route fails to compile.
+
+namespace routing {
+
+namespace http = boost::beast::http;
+
+template <class Handler>
+struct route
+{
+  http::verb method;
+  std::string_view target;
+  Handler handler;
+};
+
+// Mixes in the method and then the target eight bytes at a time, so the
+// short targets of most routes take only a few multiplications
+constexpr std::uint64_t hash(
+    http::verb method,
+    std::string_view target) noexcept
+{
+  constexpr std::uint64_t k = 0x9e3779b97f4a7c15ull;
+
+  std::uint64_t h = (std::uint64_t(method) << 32 | target.size()) * k;
+  while (!target.empty()) {
+    // Assembled from bytes to stay usable at compile time (a memcpy of a
+    // variable length would be a call)
+    std::uint64_t w = 0;
+    auto const n = std::min<std::size_t>(target.size(), 8);
+    for (std::size_t i = 0; i < n; ++i)
+      w |= std::uint64_t(std::uint8_t(target[i])) << (8 * i);
+    target.remove_prefix(n);
+
+    h = (h ^ w) * k;
+    h ^= h >> 29;
+  }
+  return h;
+}
+
+template <class Handler, std::size_t N>
+class route_table
+{
+  static_assert(N > 0 && N < 0xff, "route_table needs 1 to 254 routes");
+
+  public:
+  // Twice as many slots as routes keeps the displacement search short
+  static constexpr std::size_t slots = std::bit_ceil(2 * N);
+  static constexpr std::size_t buckets = slots / 2;
+
+  consteval explicit route_table(std::array<route<Handler>, N> const& routes)
+    : routes_(routes)
+  {
+    for (std::size_t i = 0; i < N; ++i)
+      for (std::size_t j = i + 1; j < N; ++j)
+        if (routes_[i].method == routes_[j].method &&
+            routes_[i].target == routes_[j].target)
+          throw "duplicate route";
+
+    std::array<std::uint64_t, N> hashes{};
+    for (std::size_t i = 0; i < N; ++i)
+      hashes[i] = hash(routes_[i].method, routes_[i].target);
+
+    // The fullest buckets are the hardest to place, so place them first
+    slot_.fill(empty);
+    for (std::size_t size = N; size > 0; --size)
+      for (std::size_t b = 0; b < buckets; ++b)
+        if (bucket_size(hashes, b) == size)
+          place(hashes, b);
+  }
+
+  // The route for exactly this method and target, or null
+  constexpr route<Handler> const*
+    find(http::verb method, std::string_view target) const noexcept
+  {
+    auto const h = hash(method, target);
+    auto const i = slot_[slot_of(h, displacement_[h % buckets])];
+    if (i == empty) return nullptr;
+
+    auto const& r = routes_[i];
+    return r.method == method && r.target == target ? &r : nullptr;
+  }
+
+  // Is there a route for 'target' with some other method? This is a
+  // linear search, for the 405 response after find() has failed.
+  constexpr bool has_target(std::string_view target) const noexcept
+  {
+    for (auto const& r : routes_)
+      if (r.target == target) return true;
+    return false;
+  }
+
+  constexpr std::size_t size() const noexcept { return N; }
+
+  private:
+  static constexpr std::uint8_t empty = 0xff;
+
+  // The displacement is a pair (d0, d1) packed into one number, and the
+  // high half of the hash gives the stride that d0 multiplies
+  static constexpr std::size_t
+    slot_of(std::uint64_t h, std::uint32_t displacement) noexcept
+  {
+    auto const d0 = displacement / slots;
+    auto const d1 = displacement % slots;
+    auto const stride = (h >> 32) | 1;
+    return ((h >> 16) + d0 * stride + d1) & (slots - 1);
+  }
+
+  static constexpr std::size_t bucket_size(
+      std::array<std::uint64_t, N> const& hashes,
+      std::size_t b)
+  {
+    std::size_t n = 0;
+    for (auto h : hashes) n += h % buckets == b;
+    return n;
+  }
+
+  constexpr void place(
+      std::array<std::uint64_t, N> const& hashes,
+      std::size_t b)
+  {
+    for (std::uint32_t d = 0; d < slots * slots; ++d) {
+      auto free = [&] {
+        for (std::size_t i = 0; i < N; ++i) {
+          if (hashes[i] % buckets != b) continue;
+
+          auto const s = slot_of(hashes[i], d);
+          if (slot_[s] != empty) return false;
+          for (std::size_t j = 0; j < i; ++j)
+            if (hashes[j] % buckets == b && slot_of(hashes[j], d) == s)
+              return false;
+        }
+        return true;
+      };
+
+      if (!free()) continue;
+
+      for (std::size_t i = 0; i < N; ++i)
+        if (hashes[i] % buckets == b)
+          slot_[slot_of(hashes[i], d)] = std::uint8_t(i);
+      displacement_[b] = d;
+      return;
+    }
+
+    throw "no perfect hash for these routes";
+  }
+
+  std::array<route<Handler>, N> routes_;
+  std::array<std::uint8_t, slots> slot_{};
+  std::array<std::uint32_t, buckets> displacement_{};
+};
+
+// Deduces the number of routes from a braced list, e.g.
+//
+//   constexpr auto routes = routing::make_route_table<handler>({
+//     {http::verb::get, "/", &hello},
+//     {http::verb::get, "/health", &health},
+//   });
+template <class Handler, std::size_t N>
+consteval route_table<Handler, N>
+  make_route_table(route<Handler> const (&routes)[N])
+{
+  std::array<route<Handler>, N> a{};
+  for (std::size_t i = 0; i < N; ++i) a[i] = routes[i];
+  return route_table<Handler, N>(a);
+}
+
+} // namespace routing
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <boost/asio/spawn.hpp>
+#include <boost/asio/strand.hpp>
+#include <boost/context/stack_context.hpp>
+#include <boost/context/stack_traits.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+#include <sys/mman.h>
+
+// Pooled stacks for the stackful coroutines.
+//
+// asio::spawn gives every coroutine a fresh stack from Boost.Context's
+// default allocator: a malloc of the default size, freed when the
+// coroutine ends, whatever the coroutine needs. Here every stack is mapped
+// at the size the server was given, and kept for the next connection when
+// its coroutine finishes, so accepting a connection costs no allocation
+// once the pool is warm. Stacks are mapped without reserving swap, so only
+// the pages that a coroutine has touched are resident. A stack can also
+// have a guard page below it, so that overflowing a (small) stack faults
+// instead of silently writing over the memory underneath; the guard makes
+// each stack a mapping of its own, which counts against vm.max_map_count
+// (65530 by default).
+//
+// stacks::spawn passes the pool to asio::spawn as its stack allocator.
+
+namespace stacks {
+
+namespace asio = boost::asio;
+namespace context = boost::context;
+
+class pool
+{
+  public:
+  // The size is rounded up to whole pages. At most 'max_cached' free stacks
+  // are kept; zero maps and unmaps a stack for every coroutine.
+  pool(std::size_t size, bool guard_page, std::size_t max_cached = 1024)
+    : page_(context::stack_traits::page_size())
+    , size_((std::max(size, context::stack_traits::minimum_size()) + page_ - 1)
+            / page_ * page_)
+    , guard_(guard_page ? page_ : 0)
+    , max_cached_(max_cached)
+  {
+    free_.reserve(max_cached_);
+  }
+
+  pool(pool const&) = delete;
+  pool& operator=(pool const&) = delete;
+
+  ~pool()
+  {
+    for (auto* top : free_) unmap(top);
+  }
+
+  std::size_t stack_size() const noexcept { return size_; }
+
+  // A Boost.Context StackAllocator, drawing on the pool
+  class allocator
+  {
+    pool* pool_;
+
+    public:
+    explicit allocator(pool& p) noexcept : pool_(&p) {}
+
+    context::stack_context allocate()
+    {
+      context::stack_context ctx;
+      ctx.sp = pool_->take();
+      ctx.size = pool_->size_;
+      return ctx;
+    }
+
+    void deallocate(context::stack_context& ctx) noexcept
+    {
+      pool_->give(ctx.sp);
+    }
+  };
+
+  allocator get_allocator() noexcept { return allocator(*this); }
+
+  private:
+  // Stacks grow down, so a stack is known by its top
+  void* take()
+  {
+    {
+      std::lock_guard lock(mutex_);
+      if (!free_.empty()) {
+        auto* top = free_.back();
+        free_.pop_back();
+        return top;
+      }
+    }
+    return map();
+  }
+
+  void give(void* top) noexcept
+  {
+    {
+      std::lock_guard lock(mutex_);
+      if (free_.size() < max_cached_) {
+        free_.push_back(top);
+        return;
+      }
+    }
+    unmap(top);
+  }
+
+  void* map()
+  {
+    auto const length = size_ + guard_;
+    auto* base = ::mmap(nullptr, length, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if (base == MAP_FAILED) throw std::bad_alloc();
+
+    if (guard_ && ::mprotect(base, guard_, PROT_NONE) != 0) {
+      ::munmap(base, length);
+      throw std::bad_alloc();
+    }
+
+    return static_cast<char*>(base) + length;
+  }
+
+  void unmap(void* top) noexcept
+  {
+    auto const length = size_ + guard_;
+    ::munmap(static_cast<char*>(top) - length, length);
+  }
+
+  std::size_t const page_;
+  std::size_t const size_;
+  std::size_t const guard_;
+  std::size_t const max_cached_;
+
+  std::mutex mutex_;
+  std::vector<void*> free_;
+};
+
+// Run 'function' as a coroutine on a new strand of 'ex', on a stack from
+// 'stacks' (which must outlive it). An exception that escapes 'function' is
+// rethrown from the io_context's run().
+template <class Executor, class Function>
+void spawn(Executor const& ex, Function&& function, pool& stacks)
+{
+  asio::spawn(asio::make_strand(ex), std::allocator_arg,
+      stacks.get_allocator(), std::forward<Function>(function),
+      [](std::exception_ptr e) { if (e) std::rethrow_exception(e); });
+}
+
+} // namespace stacks
@@ -0,0 +1,599 @@
+#pragma once
+
+#include "deadline.hpp"
+#include "response_cache.hpp"
+
+#include <boost/asio/async_result.hpp>
+#include <boost/asio/socket_base.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <format>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Serving a directory of static files.
+//
+// Small files are mapped into memory once and kept in an LRU cache along
+// with their pre-serialized headers (as cached_responses), so a hit costs a
+// lookup and the response is written straight from the mapping - the file
+// is never copied into a string. Large files are sent as an http::file_body
+// whose header goes out with the rest of the batch and whose contents then
+// go from the page cache to the socket with sendfile(2). The client has
+// to keep taking them: a wait for room in the socket's buffer that runs
+// past its timeout ends the transfer (see deadline.hpp).
+//
+// Every response carries Content-Length and an ETag made from the file's
+// size and modification time, so a matching If-None-Match gets a 304.
+
+namespace static_files {
+
+namespace beast = boost::beast;
+namespace http = beast::http;
+namespace asio = boost::asio;
+
+// The MIME type for a file, based on its extension
+inline beast::string_view mime_type(beast::string_view path)
+{
+  auto const pos = path.rfind(".");
+  if (pos == beast::string_view::npos) return "application/octet-stream";
+
+  auto const ext = path.substr(pos);
+  auto is = [&ext](beast::string_view e) { return beast::iequals(ext, e); };
+
+  if (is(".htm") || is(".html")) return "text/html";
+  if (is(".css"))  return "text/css";
+  if (is(".txt"))  return "text/plain";
+  if (is(".js"))   return "application/javascript";
+  if (is(".json")) return "application/json";
+  if (is(".xml"))  return "application/xml";
+  if (is(".png"))  return "image/png";
+  if (is(".jpe") || is(".jpeg") || is(".jpg")) return "image/jpeg";
+  if (is(".gif"))  return "image/gif";
+  if (is(".ico"))  return "image/vnd.microsoft.icon";
+  if (is(".svg") || is(".svgz")) return "image/svg+xml";
+  if (is(".webp")) return "image/webp";
+  if (is(".woff2")) return "font/woff2";
+  if (is(".wasm")) return "application/wasm";
+  if (is(".pdf"))  return "application/pdf";
+  return "application/octet-stream";
+}
+
+// A strong ETag for the given version of a file
+inline std::string make_etag(struct stat const& st)
+{
+  auto const mtime = std::uint64_t(st.st_mtim.tv_sec) * 1'000'000'000u +
+    std::uint64_t(st.st_mtim.tv_nsec);
+  return std::format("\"{:x}-{:x}\"", std::uint64_t(st.st_size), mtime);
+}
+
+// Does an If-None-Match header match 'etag'? This is the weak comparison
+// that RFC 7232 asks for, so a W/ prefix is ignored.
+inline bool etag_matches(beast::string_view if_none_match,
+    std::string_view etag)
+{
+  auto list = std::string_view(if_none_match.data(), if_none_match.size());
+
+  while (!list.empty()) {
+    auto const comma = list.find(',');
+    auto tag = list.substr(0, comma);
+    list = comma == std::string_view::npos ? std::string_view()
+                                           : list.substr(comma + 1);
+
+    while (!tag.empty() && tag.front() == ' ') tag.remove_prefix(1);
+    while (!tag.empty() && tag.back() == ' ') tag.remove_suffix(1);
+    if (tag.starts_with("W/")) tag.remove_prefix(2);
+
+    if (tag == "*" || tag == etag) return true;
+  }
+
+  return false;
+}
+
+namespace detail {
+
+template <class Socket, class Handler>
+class sendfile_op
+  : public beast::async_base<Handler, typename Socket::executor_type>
+{
+  Socket& socket_;
+  int fd_;
+  off_t offset_ = 0;
+  std::uint64_t remaining_;
+  std::size_t sent_ = 0;
+  deadline::timer<Socket> deadline_;
+
+  public:
+  sendfile_op(
+      Handler&& handler,
+      Socket& socket,
+      http::file_body::value_type& file,
+      deadline::limit limit)
+    : beast::async_base<Handler, typename Socket::executor_type>(
+        std::move(handler), socket.get_executor())
+    , socket_(socket)
+    , fd_(file.file().native_handle())
+    , remaining_(file.size())
+    , deadline_(socket, this->get_allocator(), limit)
+  {
+    // sendfile must not block the thread when the socket buffer is full
+    beast::error_code ec;
+    socket_.native_non_blocking(true, ec);
+    (*this)(ec, false);
+  }
+
+  void operator()(beast::error_code ec = {}, bool is_continuation = true)
+  {
+    ec = deadline_.disarm(ec);
+
+    while (!ec && remaining_ > 0) {
+      auto const n = ::sendfile(socket_.native_handle(), fd_, &offset_,
+          std::size_t(remaining_));
+
+      if (n > 0) {
+        remaining_ -= std::uint64_t(n);
+        sent_ += std::size_t(n);
+        continue;
+      }
+
+      if (n < 0 && errno == EINTR) continue;
+
+      // Wait until the socket can take more
+      if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        deadline_.arm();
+        socket_.async_wait(asio::socket_base::wait_write, std::move(*this));
+        return;
+      }
+
+      // The file shrank since its header was sent
+      ec = n == 0 ? beast::error_code(asio::error::eof)
+                  : beast::error_code(errno, beast::system_category());
+    }
+
+    this->complete(is_continuation, ec, sent_);
+  }
+};
+
+} // namespace detail
+
+// Send the contents of 'file' to 'socket' without copying them through
+// user space, failing with beast::error::timeout if the socket has no room
+// for more of them within 'limit'. The completion signature is
+// void(error_code, std::size_t).
+template <class Socket, class CompletionToken>
+auto async_sendfile(
+    Socket& socket,
+    http::file_body::value_type& file,
+    deadline::limit limit,
+    CompletionToken&& token)
+{
+  return asio::async_initiate<
+    CompletionToken, void(beast::error_code, std::size_t)>(
+      [](auto&& handler,
+         Socket* socket,
+         http::file_body::value_type* file,
+         deadline::limit limit) {
+        using handler_type = std::decay_t<decltype(handler)>;
+        detail::sendfile_op<Socket, handler_type>(
+            std::forward<decltype(handler)>(handler), *socket, *file,
+            limit);
+      },
+      token, &socket, &file, limit);
+}
+
+// The blocking version, for the synchronous server
+template <class Socket>
+std::size_t sendfile(
+    Socket& socket,
+    http::file_body::value_type& file,
+    beast::error_code& ec)
+{
+  off_t offset = 0;
+  auto remaining = file.size();
+  std::size_t sent = 0;
+  ec = {};
+
+  while (remaining > 0) {
+    auto const n = ::sendfile(socket.native_handle(),
+        file.file().native_handle(), &offset, std::size_t(remaining));
+
+    if (n > 0) {
+      remaining -= std::uint64_t(n);
+      sent += std::size_t(n);
+      continue;
+    }
+
+    if (n < 0 && errno == EINTR) continue;
+
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      // A blocking socket only gets here when its send timeout expired
+      if (!socket.native_non_blocking()) {
+        ec = beast::error::timeout;
+        break;
+      }
+      socket.wait(asio::socket_base::wait_write, ec);
+      if (ec) break;
+      continue;
+    }
+
+    ec = n == 0 ? beast::error_code(asio::error::eof)
+                : beast::error_code(errno, beast::system_category());
+    break;
+  }
+
+  return sent;
+}
+
+// A read-only mapping of a whole file
+class mapped_file
+{
+  public:
+  // Map 'size' bytes of the open file 'fd'. On failure the mapping is
+  // left empty.
+  mapped_file(int fd, std::size_t size)
+    : size_(size)
+  {
+    if (size_ == 0) return;
+
+    auto* p = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p == MAP_FAILED) {
+      size_ = 0;
+      return;
+    }
+
+    data_ = static_cast<char const*>(p);
+  }
+
+  ~mapped_file()
+  {
+    if (data_) ::munmap(const_cast<char*>(data_), size_);
+  }
+
+  mapped_file(mapped_file const&) = delete;
+  mapped_file& operator=(mapped_file const&) = delete;
+
+  std::string_view contents() const { return {data_, size_}; }
+
+  private:
+  char const* data_ = nullptr;
+  std::size_t size_;
+};
+
+// A cached version of a file. The 200 response shares ownership of the
+// mapping it points into, so the mapping outlives the cache entry for as
+// long as a response that uses it is waiting to be written.
+struct cached_file
+{
+  std::shared_ptr<response_cache::cached_response const> ok;
+  std::shared_ptr<response_cache::cached_response const> not_modified;
+  std::string etag;
+  std::size_t size = 0;
+  struct timespec mtime = {};
+
+  // Is this the same version of the file as 'st' describes?
+  bool current(struct stat const& st) const
+  {
+    return std::size_t(st.st_size) == size &&
+      st.st_mtim.tv_sec == mtime.tv_sec &&
+      st.st_mtim.tv_nsec == mtime.tv_nsec;
+  }
+};
+
+// An LRU cache of small mapped files, keyed by request target.
+//
+// Entries are shared, so one that is evicted (or replaced because the file
+// changed) stays mapped until the last response using it has been written.
+// A file is only stat'ed again once its entry is older than 'revalidate'.
+class file_cache
+{
+  public:
+  using clock = std::chrono::steady_clock;
+
+  file_cache(
+      std::size_t capacity = 64 << 20,
+      std::size_t max_file_size = 256 << 10,
+      clock::duration revalidate = std::chrono::seconds(1))
+    : capacity_(capacity)
+    , max_file_size_(max_file_size)
+    , revalidate_(revalidate)
+  {
+  }
+
+  // Files bigger than this are not cached
+  std::size_t max_file_size() const { return max_file_size_; }
+
+  // A cached file that was checked recently enough to use without
+  // touching the file system
+  std::shared_ptr<cached_file const> find(std::string_view target)
+  {
+    std::lock_guard lock(mutex_);
+
+    auto it = index_.find(target);
+    if (it == index_.end()) return {};
+
+    auto node = it->second;
+    if (clock::now() - node->checked > revalidate_) return {};
+
+    // Most recently used goes to the front
+    lru_.splice(lru_.begin(), lru_, node);
+    return node->file;
+  }
+
+  // Look up an entry that find() rejected as stale: if the file is
+  // unchanged it is good for another revalidation interval
+  std::shared_ptr<cached_file const>
+    revalidate(std::string_view target, struct stat const& st)
+  {
+    std::lock_guard lock(mutex_);
+
+    auto it = index_.find(target);
+    if (it == index_.end() || !it->second->file->current(st)) return {};
+
+    auto node = it->second;
+    node->checked = clock::now();
+    lru_.splice(lru_.begin(), lru_, node);
+    return node->file;
+  }
+
+  // Add (or replace) the entry for 'target', evicting the least recently
+  // used files to stay within the capacity
+  void insert(std::string_view target, std::shared_ptr<cached_file const> file)
+  {
+    auto const size = file->size;
+    if (size > capacity_) return;
+
+    std::lock_guard lock(mutex_);
+
+    if (auto it = index_.find(target); it != index_.end())
+      erase(it->second);
+
+    while (!lru_.empty() && size_ + size > capacity_)
+      erase(std::prev(lru_.end()));
+
+    lru_.push_front(node{std::string(target), std::move(file), clock::now()});
+    index_.emplace(lru_.front().target, lru_.begin());
+    size_ += size;
+  }
+
+  private:
+  struct node
+  {
+    std::string target;
+    std::shared_ptr<cached_file const> file;
+    clock::time_point checked;
+  };
+
+  using list_type = std::list<node>;
+
+  // Lets the index be searched with a string_view
+  struct hash
+  {
+    using is_transparent = void;
+
+    std::size_t operator()(std::string_view s) const
+    {
+      return std::hash<std::string_view>{}(s);
+    }
+  };
+
+  void erase(list_type::iterator node)
+  {
+    size_ -= node->file->size;
+    index_.erase(node->target);
+    lru_.erase(node);
+  }
+
+  std::size_t const capacity_;
+  std::size_t const max_file_size_;
+  clock::duration const revalidate_;
+
+  std::mutex mutex_;
+  list_type lru_;
+  std::unordered_map<std::string_view, list_type::iterator,
+    hash, std::equal_to<>> index_;
+  std::size_t size_ = 0;
+};
+
+// Answers GET and HEAD requests with the files below a document root
+class file_handler
+{
+  public:
+  file_handler(
+      std::string doc_root,
+      beast::string_view server,
+      std::size_t cache_capacity = 64 << 20,
+      std::size_t max_cached_file = 256 << 10)
+    : doc_root_(std::move(doc_root))
+    , server_(server)
+    , cache_(cache_capacity, max_cached_file)
+    , bad_request_(response_cache::make_cached_response(
+        http::status::bad_request, server, "Illegal request-target\n",
+        "text/plain"))
+    , not_found_(response_cache::make_cached_response(
+        http::status::not_found, server, "The resource was not found\n",
+        "text/plain"))
+    , not_allowed_(response_cache::make_cached_response(
+        http::status::method_not_allowed, server, "Unknown HTTP-method\n",
+        "text/plain"))
+  {
+    if (!doc_root_.empty() && doc_root_.back() == '/') doc_root_.pop_back();
+  }
+
+  // Queue the response to 'req' in 'batch' (a pipeline::response_batch)
+  template <class Request, class Batch>
+  void handle(Request const& req, Batch& batch)
+  {
+    auto const version = req.version();
+    auto const keep_alive = req.keep_alive();
+    auto const method = req.method();
+    auto const send_body = method != http::verb::head;
+
+    if (method != http::verb::get && method != http::verb::head)
+      return batch.push(not_allowed_, version, keep_alive);
+
+    // The path, without any query
+    auto target = std::string_view(req.target().data(), req.target().size());
+    target = target.substr(0, target.find('?'));
+
+    if (target.empty() || target[0] != '/' ||
+        target.find("..") != std::string_view::npos)
+      return batch.push(bad_request_, version, keep_alive, send_body);
+
+    auto const if_none_match = req[http::field::if_none_match];
+
+    // The common case: a small file that was served recently
+    auto file = cache_.find(target);
+
+    if (!file) {
+      auto path = doc_root_;
+      path.append(target);
+      if (path.back() == '/') path.append("index.html");
+
+      struct stat st;
+      if (::stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+        return batch.push(not_found_, version, keep_alive, send_body);
+
+      if (std::size_t(st.st_size) > cache_.max_file_size())
+        return send_file(path, st, req, batch);
+
+      file = cache_.revalidate(target, st);
+      if (!file) {
+        file = load(path, target);
+        if (!file)
+          return batch.push(not_found_, version, keep_alive, send_body);
+      }
+    }
+
+    if (etag_matches(if_none_match, file->etag))
+      return batch.push(file->not_modified, version, keep_alive);
+
+    batch.push(file->ok, version, keep_alive, send_body);
+  }
+
+  private:
+  // Map a small file and cache it
+  std::shared_ptr<cached_file const>
+    load(std::string const& path, std::string_view target)
+  {
+    int const fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return {};
+
+    // Describe the file that was opened, in case it has just changed
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+      ::close(fd);
+      return {};
+    }
+
+    auto const mapping = std::make_shared<mapped_file const>(
+        fd, std::size_t(st.st_size));
+    ::close(fd);
+
+    if (mapping->contents().size() != std::size_t(st.st_size)) return {};
+
+    auto file = std::make_shared<cached_file>();
+    file->etag = make_etag(st);
+    file->size = std::size_t(st.st_size);
+    file->mtime = st.st_mtim;
+
+    http::response<http::empty_body> res{http::status::ok, 11};
+    res.set(http::field::server, server_);
+    res.set(http::field::content_type, mime_type(path));
+    res.set(http::field::etag, file->etag);
+    res.content_length(st.st_size);
+
+    file->ok = std::make_shared<response_cache::cached_response const>(
+        res, mapping->contents(), mapping);
+
+    res.result(http::status::not_modified);
+    res.erase(http::field::content_type);
+    res.erase(http::field::content_length);
+    file->not_modified =
+        std::make_shared<response_cache::cached_response const>(res);
+
+    cache_.insert(target, file);
+    return file;
+  }
+
+  // Send a large file with sendfile
+  template <class Request, class Batch>
+  void send_file(
+      std::string const& path,
+      struct stat const& st,
+      Request const& req,
+      Batch& batch)
+  {
+    auto const version = req.version();
+    auto const keep_alive = req.keep_alive();
+
+    // The body, and the tag, come from the file that is opened, in case it
+    // has been replaced since it was looked up. HEAD opens nothing.
+    beast::error_code ec;
+    http::file_body::value_type body;
+    struct stat opened = st;
+    if (req.method() != http::verb::head) {
+      body.open(path.c_str(), beast::file_mode::scan, ec);
+      if (ec || ::fstat(body.file().native_handle(), &opened) != 0 ||
+          !S_ISREG(opened.st_mode))
+        return batch.push(not_found_, version, keep_alive);
+    }
+
+    auto const etag = make_etag(opened);
+
+    // Nothing to send but a header
+    auto header_only = [&](http::status status, std::uint64_t length) {
+      http::response<http::empty_body> res{status, version};
+      res.set(http::field::server, server_);
+      res.set(http::field::etag, etag);
+      if (status == http::status::ok) {
+        res.set(http::field::content_type, mime_type(path));
+        res.content_length(length);
+      }
+      batch.push(std::make_shared<response_cache::cached_response const>(res),
+          version, keep_alive, false);
+    };
+
+    if (etag_matches(req[http::field::if_none_match], etag))
+      return header_only(http::status::not_modified, 0);
+
+    if (req.method() == http::verb::head)
+      return header_only(http::status::ok, std::uint64_t(opened.st_size));
+
+    http::response<http::file_body> res{
+      std::piecewise_construct,
+      std::make_tuple(std::move(body)),
+      std::make_tuple(http::status::ok, version)};
+    res.set(http::field::server, server_);
+    res.set(http::field::content_type, mime_type(path));
+    res.set(http::field::etag, etag);
+    res.prepare_payload();
+    res.keep_alive(keep_alive);
+
+    batch.push(std::move(res));
+  }
+
+  std::string doc_root_;
+  std::string server_;
+  file_cache cache_;
+
+  std::shared_ptr<response_cache::cached_response const> bad_request_;
+  std::shared_ptr<response_cache::cached_response const> not_found_;
+  std::shared_ptr<response_cache::cached_response const> not_allowed_;
+};
+
+} // namespace static_files
@@ -0,0 +1,225 @@
+#pragma once
+
+#include "deadline.hpp"
+
+#include <boost/asio/coroutine.hpp>
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <span>
+#include <utility>
+#include <vector>
+
+// Responses whose bodies are generated while they are sent.
+//
+// A string_body has to hold the whole body before the first byte goes out.
+// Here the body comes from a producer that fills one fixed-size chunk at a
+// time, and the next chunk is only produced once the last one has been
+// written to the socket, so a slow client slows the producer down instead
+// of the body piling up in memory. Each response in flight holds a single
+// chunk (taken from the thread's spares, and given back when it is done)
+// and a serializer, whatever the size of its body.
+//
+// The chunks are written to the socket under the session's tcp_stream, so
+// each has a timeout of its own: a client that stops reading is cut off
+// when a chunk has waited for it that long (see deadline.hpp).
+//
+// The body is sent with the chunked transfer coding, as its size is not
+// known up front. An HTTP/1.0 client gets it delimited by closing the
+// connection instead.
+
+namespace streaming {
+
+namespace beast = boost::beast;
+namespace http = beast::http;
+namespace asio = boost::asio;
+
+inline constexpr std::size_t chunk_size = 16384;
+
+using chunk = std::array<char, chunk_size>;
+
+// Fills the buffer with the next part of the body and returns how much of
+// it was filled, or 0 at the end of the body
+using producer = std::move_only_function<std::size_t(std::span<char>)>;
+
+// A response without a producer (e.g. to HEAD) is only its header
+struct response
+{
+  http::response<http::buffer_body> message;
+  producer produce;
+};
+
+namespace detail {
+
+inline std::vector<std::unique_ptr<chunk>>& spare_chunks()
+{
+  thread_local std::vector<std::unique_ptr<chunk>> spare;
+  return spare;
+}
+
+} // namespace detail
+
+// A chunk from the calling thread's spares, or a new one
+inline std::unique_ptr<chunk> acquire()
+{
+  auto& spare = detail::spare_chunks();
+  if (spare.empty()) return std::make_unique<chunk>();
+
+  auto c = std::move(spare.back());
+  spare.pop_back();
+  return c;
+}
+
+inline void release(std::unique_ptr<chunk> c)
+{
+  static constexpr std::size_t max_spare = 256;
+
+  auto& spare = detail::spare_chunks();
+  if (!c || spare.size() >= max_spare) return;
+
+  spare.push_back(std::move(c));
+}
+
+namespace detail {
+
+// Point the body at the next part of it, or mark its end
+inline void produce(response& res, chunk& c)
+{
+  auto& body = res.message.body();
+  auto const n = res.produce ? res.produce(c) : 0;
+
+  body.data = n ? c.data() : nullptr;
+  body.size = n;
+  body.more = n != 0;
+}
+
+template <class Stream, class Handler>
+class write_op
+  : public beast::stable_async_base<Handler, typename Stream::executor_type>
+  , public asio::coroutine
+{
+  struct state
+  {
+    explicit state(response& res)
+      : serializer(res.message)
+      , buffer(acquire())
+    {
+    }
+
+    http::response_serializer<http::buffer_body> serializer;
+    std::unique_ptr<chunk> buffer;
+  };
+
+  Stream& stream_;
+  response& res_;
+  state& s_;
+  std::size_t written_ = 0;
+  deadline::timer<Stream> deadline_;
+
+  public:
+  write_op(
+      Handler&& handler,
+      Stream& stream,
+      response& res,
+      deadline::limit limit)
+    : beast::stable_async_base<Handler, typename Stream::executor_type>(
+        std::move(handler), stream.get_executor())
+    , stream_(stream)
+    , res_(res)
+    , s_(beast::allocate_stable<state>(*this, res))
+    , deadline_(stream, this->get_allocator(), limit)
+  {
+    (*this)({}, 0, false);
+  }
+
+  void operator()(
+      beast::error_code ec = {},
+      std::size_t bytes_transferred = 0,
+      bool is_continuation = true)
+  {
+    BOOST_ASIO_CORO_REENTER(*this)
+    {
+      if (!res_.produce) {
+        deadline_.arm();
+        BOOST_ASIO_CORO_YIELD
+        http::async_write_header(stream_, s_.serializer, std::move(*this));
+        ec = deadline_.disarm(ec);
+        written_ += bytes_transferred;
+      }
+      else {
+        // The header goes out in front of the first chunk
+        for (;;) {
+          produce(res_, *s_.buffer);
+
+          deadline_.arm();
+          BOOST_ASIO_CORO_YIELD
+          http::async_write(stream_, s_.serializer, std::move(*this));
+          ec = deadline_.disarm(ec);
+          written_ += bytes_transferred;
+
+          // The chunk has been sent
+          if (ec != http::error::need_buffer) break;
+          ec = {};
+        }
+      }
+
+      release(std::move(s_.buffer));
+      this->complete(is_continuation, ec, written_);
+    }
+  }
+};
+
+} // namespace detail
+
+// Send 'res' to the socket 'stream', producing its body as the socket
+// takes it, and failing with beast::error::timeout if a chunk is not
+// written within 'limit'. The completion signature is
+// void(error_code, std::size_t).
+template <class Stream, class CompletionToken>
+auto async_write(
+    Stream& stream,
+    response& res,
+    deadline::limit limit,
+    CompletionToken&& token)
+{
+  return asio::async_initiate<
+    CompletionToken, void(beast::error_code, std::size_t)>(
+      [](auto&& handler,
+         Stream* stream,
+         response* res,
+         deadline::limit limit) {
+        using handler_type = std::decay_t<decltype(handler)>;
+        detail::write_op<Stream, handler_type>(
+            std::forward<decltype(handler)>(handler), *stream, *res,
+            limit);
+      },
+      token, &stream, &res, limit);
+}
+
+// The blocking version, for the synchronous server
+template <class Stream>
+std::size_t write(Stream& stream, response& res, beast::error_code& ec)
+{
+  http::response_serializer<http::buffer_body> serializer(res.message);
+  if (!res.produce) return http::write_header(stream, serializer, ec);
+
+  auto buffer = acquire();
+  std::size_t written = 0;
+
+  for (;;) {
+    detail::produce(res, *buffer);
+    written += http::write(stream, serializer, ec);
+    if (ec != http::error::need_buffer) break;
+    ec = {};
+  }
+
+  release(std::move(buffer));
+  return written;
+}
+
+} // namespace streaming
@@ -2,27 +2,503 @@
 #include <boost/beast/http.hpp>
 #include <boost/beast/version.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/config.hpp>
 
+#include "bounded_queue.hpp"
+#include "command_line.hpp"
+#include "handlers.hpp"
+#include "metrics.hpp"
+#include "pipeline.hpp"
+#include "request_arena.hpp"
+#include "static_files.hpp"
+#include "streaming.hpp"
+
+#include <array>
+#include <chrono>
 #include <iostream>
 #include <format>
+#include <memory>
+#include <optional>
+#include <thread>
+#include <vector>
+
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
 
 namespace beast = boost::beast;
 namespace http = beast::http;
 namespace asio = boost::asio;
 using tcp = boost::asio::ip::tcp;
 
+// How long a connection may take to send its next request, or to make room
+// for more of a response
+constexpr auto idle_timeout = std::chrono::seconds(30);
+
+// The routes' responses are serialized once and reused for every request
+handlers::context app{"Beast", "Hello ACCU 2023 from Synchronous Server!"};
+
+// A connected socket whose blocking reads and writes are timed out by the
+// kernel (SO_RCVTIMEO and SO_SNDTIMEO). Asio's own blocking operations go
+// back to waiting, for as long as it takes, when recv or send time out, so
+// these make the calls themselves and report the timeout instead.
+//
+// The kernel times each call on its own, so a client that sends a byte at
+// a time would never run out of time. With a deadline set, each call is
+// given only what is left of it, and fails once it has passed.
+class timed_socket
+{
+  using clock = std::chrono::steady_clock;
+
+  tcp::socket& socket_;
+
+  // When set, the time by which all of the reads and writes must be done
+  std::optional<clock::time_point> deadline_;
+
+  // Otherwise, the time that each of them may take
+  clock::duration each_{};
+
+  // The timeouts that the socket has, to save setting them again
+  clock::duration rcvtimeo_{};
+  clock::duration sndtimeo_{};
+
+  // The most buffers written with one sendmsg
+  static constexpr std::size_t max_iov = 64;
+
+  public:
+  explicit timed_socket(tcp::socket& socket)
+    : socket_(socket)
+  {
+  }
+
+  // Give the reads and writes from now on 'timeout' between them
+  void expires_after(clock::duration timeout)
+  {
+    deadline_ = clock::now() + timeout;
+  }
+
+  // Give each read and write from now on 'timeout' of its own. This also
+  // applies to the socket's other calls, e.g. sendfile.
+  void expires_each(clock::duration timeout)
+  {
+    deadline_.reset();
+    each_ = timeout;
+
+    beast::error_code ec;
+    arm(SO_RCVTIMEO, rcvtimeo_, ec);
+    arm(SO_SNDTIMEO, sndtimeo_, ec);
+  }
+
+  template <class MutableBufferSequence>
+  std::size_t read_some(
+      MutableBufferSequence const& buffers,
+      beast::error_code& ec)
+  {
+    asio::mutable_buffer b;
+    for(auto it = asio::buffer_sequence_begin(buffers);
+        it != asio::buffer_sequence_end(buffers) && b.size() == 0; ++it)
+      b = *it;
+
+    ec = {};
+    if(b.size() == 0) return 0;
+
+    for(;;) {
+      if(!arm(SO_RCVTIMEO, rcvtimeo_, ec)) return 0;
+      auto const n = ::recv(socket_.native_handle(), b.data(), b.size(), 0);
+      if(n > 0) return std::size_t(n);
+      if(n == 0) ec = asio::error::eof;
+      else if(errno == EINTR) continue;
+      else ec = error(errno);
+      return 0;
+    }
+  }
+
+  template <class ConstBufferSequence>
+  std::size_t write_some(
+      ConstBufferSequence const& buffers,
+      beast::error_code& ec)
+  {
+    std::array<iovec, max_iov> iov;
+    std::size_t count = 0;
+    for(auto it = asio::buffer_sequence_begin(buffers);
+        it != asio::buffer_sequence_end(buffers) && count < max_iov; ++it) {
+      asio::const_buffer const b = *it;
+      if(b.size() == 0) continue;
+      iov[count++] = {const_cast<void*>(b.data()), b.size()};
+    }
+
+    ec = {};
+    if(count == 0) return 0;
+
+    msghdr msg{};
+    msg.msg_iov = iov.data();
+    msg.msg_iovlen = count;
+
+    for(;;) {
+      if(!arm(SO_SNDTIMEO, sndtimeo_, ec)) return 0;
+      auto const n = ::sendmsg(socket_.native_handle(), &msg, MSG_NOSIGNAL);
+      if(n >= 0) return std::size_t(n);
+      if(errno == EINTR) continue;
+      ec = error(errno);
+      return 0;
+    }
+  }
+
+  template <class MutableBufferSequence>
+  std::size_t read_some(MutableBufferSequence const& buffers)
+  {
+    beast::error_code ec;
+    auto const n = read_some(buffers, ec);
+    if(ec) BOOST_THROW_EXCEPTION(beast::system_error{ec});
+    return n;
+  }
+
+  template <class ConstBufferSequence>
+  std::size_t write_some(ConstBufferSequence const& buffers)
+  {
+    beast::error_code ec;
+    auto const n = write_some(buffers, ec);
+    if(ec) BOOST_THROW_EXCEPTION(beast::system_error{ec});
+    return n;
+  }
+
+  private:
+  // Give the socket's next call, under 'option' (SO_RCVTIMEO or
+  // SO_SNDTIMEO, now set to 'current'), the time that it has, or fail if
+  // the deadline has passed
+  bool arm(int option, clock::duration& current, beast::error_code& ec)
+  {
+    auto timeout = each_;
+    if(deadline_) {
+      timeout = *deadline_ - clock::now();
+      if(timeout <= clock::duration::zero()) {
+        ec = beast::error::timeout;
+        return false;
+      }
+    }
+
+    if(timeout == current) return true;
+
+    // A zero timeval is no timeout at all, so this rounds up
+    auto const us = std::chrono::ceil<std::chrono::microseconds>(timeout);
+    timeval tv{};
+    tv.tv_sec = us.count() / 1000000;
+    tv.tv_usec = us.count() % 1000000;
+    if(::setsockopt(socket_.native_handle(), SOL_SOCKET, option,
+        &tv, sizeof(tv)) != 0) {
+      ec = {errno, beast::system_category()};
+      return false;
+    }
+
+    current = timeout;
+    return true;
+  }
+
+  // The socket blocks, so EAGAIN means that its timeout expired
+  static beast::error_code error(int e)
+  {
+    if(e == EAGAIN || e == EWOULDBLOCK) return beast::error::timeout;
+    return {e, beast::system_category()};
+  }
+};
+
+// Serve one connection, accepted at 'accepted', until it closes or keeps
+// the server waiting for longer than the idle timeout, parsing its requests
+// into 'arena'
+void serve(
+    tcp::socket& socket,
+    arena::request_arena& arena,
+    metrics::clock::time_point accepted)
+{
+  timed_socket stream(socket);
+  beast::flat_buffer buffer;
+  beast::error_code ec;
+
+  // Holds the one response being sent
+  pipeline::response_batch<http::string_body> batch;
+
+  // Counts the connection and times its requests (see metrics.hpp)
+  metrics::connection conn{accepted};
+
+  for(;;)
+  {
+    // Read an HTTP request, which has the idle timeout to arrive in all,
+    // however slowly it trickles in
+    stream.expires_after(idle_timeout);
+    auto& req = arena.renew();
+    auto const bytes = http::read(stream, buffer, req, ec);
+    if(ec == http::error::end_of_stream)
+      break; // Client disconnected - reset
+
+    if(ec) break; // Any other read error (or a timeout) also ends it
+
+    // Queue the response to the request (see handlers.hpp)
+    auto handle_request = [&req, &batch, &conn](std::size_t size) {
+      conn.read(size);
+      handlers::handle(app, req, batch);
+      conn.handled();
+    };
+
+    // Send the response. Each write has the idle timeout of its own, so
+    // a large response goes on for as long as the client keeps reading.
+    handle_request(bytes);
+    stream.expires_each(idle_timeout);
+    conn.wrote(asio::write(stream, batch.buffers(), ec));
+    if(ec) break;
+
+    // A large file's contents follow its header
+    if(auto* file = batch.file()) {
+      conn.wrote(static_files::sendfile(socket, *file, ec));
+      if(ec) break;
+    }
+
+    // A streamed response follows, header and all
+    if(auto* res = batch.stream()) {
+      conn.wrote(streaming::write(stream, *res, ec));
+      if(ec) break;
+    }
+    conn.sent();
+
+    // Determine if we should close the connection
+    bool keep_alive = batch.keep_alive();
+    batch.clear();
+
+    if(!keep_alive) break;
+  }
+
+  // Send a TCP shutdown
+  socket.shutdown(tcp::socket::shutdown_send, ec);
+}
+
+// Block until a connection is accepted into 'socket'. Running out of
+// descriptors is no reason to stop accepting, but there is no point in
+// trying again straight away.
+void accept(tcp::acceptor& acceptor, tcp::socket& socket)
+{
+  for(;;)
+  {
+    beast::error_code ec;
+    acceptor.accept(socket, ec);
+    if(!ec) return;
+
+    std::cerr << std::format("Error: accept : {}\n", ec.message());
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+}
+
+// Turns away the connections that the worker pool has no room for.
+//
+// Closing a socket with unread data makes the kernel send an RST, which can
+// discard the 503 before the client has read it: that is, exactly when the
+// server is overloaded. So each connection is answered and then drained,
+// its request read and dropped until the client closes, for up to 'linger',
+// before it is closed. That happens on a thread of its own, so the acceptor
+// never waits for a client.
+class rejecter
+{
+  static constexpr auto linger = std::chrono::seconds(1);
+
+  // One connection being answered and drained
+  struct rejected : std::enable_shared_from_this<rejected>
+  {
+    tcp::socket socket;
+    asio::steady_timer deadline;
+    std::array<char, 4096>& discard;
+
+    rejected(tcp::socket s, std::array<char, 4096>& d)
+      : socket(std::move(s))
+      , deadline(socket.get_executor(), linger)
+      , discard(d)
+    {
+    }
+
+    void start()
+    {
+      deadline.async_wait([self = shared_from_this()](beast::error_code ec) {
+          if(!ec) self->socket.close(ec);
+        });
+
+      asio::async_write(socket, app.unavailable->buffers(11, false),
+          [self = shared_from_this()](beast::error_code ec, std::size_t) {
+            if(ec) return self->done();
+            self->socket.shutdown(tcp::socket::shutdown_send, ec);
+            self->drain();
+          });
+    }
+
+    void drain()
+    {
+      socket.async_read_some(asio::buffer(discard),
+          [self = shared_from_this()](beast::error_code ec, std::size_t) {
+            if(ec) return self->done();
+            self->drain();
+          });
+    }
+
+    void done()
+    {
+      deadline.cancel();
+      beast::error_code ec;
+      socket.close(ec);
+    }
+  };
+
+  asio::io_context ioc_;
+  asio::executor_work_guard<asio::io_context::executor_type> work_;
+
+  // What is read is thrown away, so all the connections share one buffer
+  std::array<char, 4096> discard_;
+
+  std::thread thread_;
+
+  public:
+  rejecter()
+    : work_(ioc_.get_executor())
+    , thread_([this] { ioc_.run(); })
+  {
+  }
+
+  ~rejecter()
+  {
+    work_.reset();
+    thread_.join();
+  }
+
+  // Answer 503 on the connection 'fd' and close it
+  void reject(tcp protocol, tcp::socket::native_handle_type fd)
+  {
+    asio::post(ioc_, [this, protocol, fd] {
+        beast::error_code ec;
+        tcp::socket socket{ioc_};
+        socket.assign(protocol, fd, ec);
+        if(ec) {
+          ::close(fd);
+          return;
+        }
+        std::make_shared<rejected>(std::move(socket), discard_)->start();
+      });
+  }
+};
+
+// Worker pool mode: this thread only accepts connections, and hands them
+// to the workers through a bounded queue. A worker stays with a connection
+// until it closes, so there can be as many keep-alive clients as workers;
+// the queue absorbs bursts of new connections beyond that. When it is full
+// the acceptor either waits for a worker (block), or has the connection
+// answered 503 and closed (reject).
+void run_pool(
+    asio::io_context& ioc,
+    tcp::acceptor& acceptor,
+    unsigned num_workers,
+    std::size_t queue_size,
+    bool reject)
+{
+  // Sockets move between threads as their native handles, along with when
+  // they were accepted
+  struct accepted_socket
+  {
+    tcp::socket::native_handle_type fd;
+    metrics::clock::time_point at;
+  };
+
+  mpmc::bounded_queue<accepted_socket> queue(queue_size);
+  auto const protocol = acceptor.local_endpoint().protocol();
+
+  std::optional<rejecter> rejects;
+  if(reject) rejects.emplace();
+
+  std::vector<std::thread> workers;
+  for(unsigned i = 0; i < num_workers; ++i)
+    workers.emplace_back([&ioc, &queue, protocol] {
+        arena::request_arena arena;
+        for(;;)
+        {
+          auto const accepted = queue.pop();
+
+          // The descriptor is the worker's to close if it cannot be had
+          beast::error_code ec;
+          tcp::socket socket{ioc};
+          socket.assign(protocol, accepted.fd, ec);
+          if(ec) {
+            std::cerr << std::format("Error: assign : {}\n", ec.message());
+            ::close(accepted.fd);
+            continue;
+          }
+
+          serve(socket, arena, accepted.at);
+        }
+      });
+
+  for(;;)
+  {
+    tcp::socket socket{ioc};
+    accept(acceptor, socket);
+
+    // Let go of the socket before a worker can take it
+    auto const fd = socket.release();
+
+    if(!reject)
+      queue.push({fd, metrics::clock::now()});
+    else if(!queue.try_push({fd, metrics::clock::now()}))
+      rejects->reject(protocol, fd);
+  }
+}
+
 int main(int argc, char *argv[])
 {
-  if (argc != 3) {
+  command_line options(argc, argv, 3);
+
+  auto const num_workers = options.get("workers", 0u);
+  auto const overflow = options.get("overflow", "block");
+  auto const queue_size = options.get("queue", std::size_t(256));
+
+  if (argc < 3 || !options.positional().empty() ||
+      options.unknown({"doc-root", "workers", "queue", "overflow",
+                       "latency-dump", "trace", "trace-sample"}) ||
+      (overflow != "block" && overflow != "reject") ||
+      !mpmc::valid_capacity(queue_size)) {
     std::cerr << std::format(
-      "Usage: {} <ip-address> <port>\n"
-      "E.g.: {} 0.0.0.0 8080\n",
+      "Usage: {} <ip-address> <port> [options]\n"
+      "E.g.: {} 0.0.0.0 8080\n"
+      "Options:\n"
+      "  --doc-root=DIR serve the files in DIR for targets without a route\n"
+      "  --workers=N    serve up to N connections at once on a pool of\n"
+      "                 worker threads (0: one at a time on this thread)\n"
+      "  --queue=N      accepted connections waiting for a worker, a\n"
+      "                 power of two (256)\n"
+      "  --overflow=P   when the queue is full, 'block' the acceptor or\n"
+      "                 'reject' the connection with a 503 (block)\n"
+      "  --latency-dump=FILE  write the phase histograms to FILE on SIGUSR1\n"
+      "  --trace=FILE   write a Chrome trace of the sampled requests to\n"
+      "                 FILE on SIGUSR1\n"
+      "  --trace-sample=N  trace one request in N (1000)\n",
       argv[0], argv[0]
     );
     return EXIT_FAILURE;
   }
 
+  if (options.has("doc-root"))
+    app.serve_files(options.get("doc-root", "."));
+
+  metrics::configure({options.get("latency-dump", ""),
+      options.get("trace", ""),
+      options.get("trace-sample", std::uint64_t(1000))});
+
+  // Nothing runs an io_context here, so SIGUSR1 is waited for on a thread
+  // of its own. The other threads block it, as it would interrupt their
+  // blocking accepts and reads (with EINTR) if it were delivered to them.
+  asio::io_context signals;
+  if (metrics::dump_on_signal(signals)) {
+    std::thread([&signals] { signals.run(); }).detach();
+
+    sigset_t usr1;
+    sigemptyset(&usr1);
+    sigaddset(&usr1, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &usr1, nullptr);
+  }
+
   try {
     asio::io_context ioc;
 
@@ -32,40 +508,23 @@ int main(int argc, char *argv[])
 
     tcp::acceptor acceptor{ioc, {address, port}};
 
+    if (num_workers > 0) {
+      run_pool(ioc, acceptor, num_workers, queue_size, overflow == "reject");
+      return EXIT_SUCCESS;
+    }
+
+    // Connections are served one at a time, so they can all share one
+    // arena for their requests
+    arena::request_arena arena;
+
     for(;;)
     {
       // Create a socket and block until we get a connection
       tcp::socket socket{ioc};
-      acceptor.accept(socket);
-
-      // A client has connected - declare a buffer
-      beast::flat_buffer buffer;
-      beast::error_code ec;
-
-      for(;;)
-      {
-        // Read an HTTP request
-        http::request<http::string_body> req;
-        http::read(socket, buffer, req, ec);
-        if(ec == http::error::end_of_stream)
-          break; // Client disconnected - reset
-
-        // Create a response
-        auto handle_request = [&req]() -> http::message_generator {
-          http::response<http::string_body> res{http::status::ok, req.version()};
-          res.set(http::field::server, "Beast");
-          res.body() = "Hello ACCU 2023 from Synchronous Server!";
-          res.prepare_payload();
-          return res;
-        };
-
-        // Send the response
-        beast::write(socket, handle_request(), ec);
-      }
+      accept(acceptor, socket);
 
-      // Send a TCP shutdown
-      socket.shutdown(tcp::socket::shutdown_send, ec);
-   }
+      serve(socket, arena, metrics::clock::now());
+    }
   }
   catch (const std::exception& e)
   {
@@ -0,0 +1,227 @@
+#pragma once
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/steady_timer.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+// Coarse idle timeouts for many connections, from one timer.
+//
+// Re-arming a steady_timer for every read (which is what tcp_stream's
+// expires_after does) cancels the pending wait and pushes a new one onto
+// the reactor's timer heap: O(log n) work under the reactor's lock, and a
+// handler, for every request. With a timing wheel a session's deadline is
+// just a tick number that touch() overwrites. The wheel's own timer fires
+// once per tick and looks at one slot, and only then is a session whose
+// deadline has moved on put into the slot for its new deadline - at most
+// once per timeout, however busy the session is.
+//
+// The wheel is hierarchical: three levels of 64 slots, of 1, 64 and 4096
+// ticks each. Entries in the upper levels are cascaded down as their slot
+// comes round. Deadlines are only accurate to a tick, so a session times
+// out between its timeout and one tick later.
+//
+// One wheel serves the sessions of one io_context. Starting and stopping
+// an entry takes the wheel's lock (uncontended when the io_context has one
+// thread, as in the sharded server); touching one does not.
+
+namespace idle {
+
+namespace asio = boost::asio;
+using clock = std::chrono::steady_clock;
+
+class timing_wheel;
+
+// A session's place in a timing wheel
+class entry
+{
+  public:
+  // Called on the wheel's thread, with the wheel locked, when the entry
+  // expires (after which it is no longer in the wheel). It should only
+  // post the real work to wherever the session runs.
+  using expire_fn = void (*)(void* context);
+
+  entry(timing_wheel& wheel, expire_fn on_expire, void* context) noexcept
+    : wheel_(wheel)
+    , on_expire_(on_expire)
+    , context_(context)
+  {
+  }
+
+  entry(entry const&) = delete;
+  entry& operator=(entry const&) = delete;
+
+  inline ~entry();
+
+  // Put the entry in the wheel, to expire after the timeout unless touched
+  inline void start();
+
+  // Restart the timeout. This is a single store.
+  inline void touch() noexcept;
+
+  // Take the entry out of the wheel (if it is still in it)
+  inline void stop();
+
+  private:
+  friend class timing_wheel;
+
+  timing_wheel& wheel_;
+  expire_fn on_expire_;
+  void* context_;
+
+  // Guarded by the wheel's lock
+  bool linked_ = false;
+  entry* prev_ = nullptr;
+  entry* next_ = nullptr;
+  entry** head_ = nullptr;
+
+  std::atomic<std::uint64_t> deadline_{0};
+};
+
+class timing_wheel
+{
+  public:
+  static constexpr unsigned slot_bits = 6;
+  static constexpr std::size_t slots = std::size_t(1) << slot_bits;
+  static constexpr std::size_t levels = 3;
+
+  timing_wheel(
+      asio::any_io_executor executor,
+      clock::duration timeout,
+      clock::duration tick = std::chrono::seconds(1))
+    : timer_(executor)
+    , tick_(tick)
+    , timeout_ticks_(std::max<std::uint64_t>(1, (timeout + tick - clock::duration(1)) / tick))
+    , start_(clock::now())
+  {
+  }
+
+  timing_wheel(timing_wheel const&) = delete;
+  timing_wheel& operator=(timing_wheel const&) = delete;
+
+  // Start ticking (the wheel must outlive the wait, and its entries)
+  void run()
+  {
+    timer_.expires_at(start_ + tick_ * (now_.load(std::memory_order_relaxed) + 1));
+    timer_.async_wait([this](boost::system::error_code ec) {
+        if (ec) return;
+        advance();
+        run();
+      });
+  }
+
+  std::uint64_t timeout_ticks() const noexcept { return timeout_ticks_; }
+
+  private:
+  friend class entry;
+
+  void start(entry& e)
+  {
+    std::lock_guard lock(mutex_);
+    if (e.linked_) unlink(e);
+    touch(e);
+    insert(e);
+  }
+
+  // The current tick is already partly over, hence the extra one
+  void touch(entry& e) noexcept
+  {
+    e.deadline_.store(now_.load(std::memory_order_relaxed) + timeout_ticks_ + 1,
+        std::memory_order_relaxed);
+  }
+
+  void stop(entry& e)
+  {
+    std::lock_guard lock(mutex_);
+    if (e.linked_) unlink(e);
+  }
+
+  // Put 'e' in the slot for its deadline, relative to the current tick.
+  // Deadlines beyond the top level wait in it and are put back later.
+  void insert(entry& e)
+  {
+    auto const now = now_.load(std::memory_order_relaxed);
+    auto const furthest = now + (std::uint64_t(1) << (slot_bits * levels - 1));
+    auto const deadline = std::clamp(
+        e.deadline_.load(std::memory_order_relaxed), now, furthest);
+
+    std::size_t level = 0;
+    while (level + 1 < levels &&
+           deadline - now >= (std::uint64_t(1) << (slot_bits * (level + 1))))
+      ++level;
+
+    auto& head = slots_[level][(deadline >> (slot_bits * level)) & (slots - 1)];
+
+    e.linked_ = true;
+    e.head_ = &head;
+    e.prev_ = nullptr;
+    e.next_ = head;
+    if (head) head->prev_ = &e;
+    head = &e;
+  }
+
+  void unlink(entry& e) noexcept
+  {
+    if (e.prev_) e.prev_->next_ = e.next_;
+    else *e.head_ = e.next_;
+    if (e.next_) e.next_->prev_ = e.prev_;
+
+    e.linked_ = false;
+    e.head_ = nullptr;
+    e.prev_ = e.next_ = nullptr;
+  }
+
+  // One tick: cascade the upper level slots that have come round, then
+  // expire (or move on) the entries in the current slot
+  void advance()
+  {
+    std::lock_guard lock(mutex_);
+    auto const now = now_.load(std::memory_order_relaxed) + 1;
+    now_.store(now, std::memory_order_relaxed);
+
+    for (auto level = levels - 1; level > 0; --level) {
+      auto const shift = slot_bits * level;
+      if (now & ((std::uint64_t(1) << shift) - 1)) continue;
+
+      auto& head = slots_[level][(now >> shift) & (slots - 1)];
+      while (auto* e = head) {
+        unlink(*e);
+        insert(*e);
+      }
+    }
+
+    auto& head = slots_[0][now & (slots - 1)];
+    while (auto* e = head) {
+      unlink(*e);
+      if (e->deadline_.load(std::memory_order_relaxed) <= now)
+        e->on_expire_(e->context_);
+      else
+        insert(*e); // touched since, so this is another slot
+    }
+  }
+
+  asio::steady_timer timer_;
+  clock::duration const tick_;
+  std::uint64_t const timeout_ticks_;
+  clock::time_point const start_;
+
+  std::mutex mutex_;
+  std::atomic<std::uint64_t> now_{0};
+  std::array<std::array<entry*, slots>, levels> slots_{};
+};
+
+entry::~entry() { stop(); }
+
+void entry::start() { wheel_.start(*this); }
+
+void entry::touch() noexcept { wheel_.touch(*this); }
+
+void entry::stop() { wheel_.stop(*this); }
+
+} // namespace idle
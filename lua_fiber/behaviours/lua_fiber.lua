@@ -20,23 +20,18 @@ function ping_fiber (connector, remote_port)
 
   local timer = Actions.Timer()
 
-  -- Connect to a node and send a 'ping' message
+  -- Connect to a node and send a 'ping' message. Receive and Sleep park
+  -- this fiber (and let the others run) until there is a message or the
+  -- timer fires.
   while true do
 
     connector:Send("localhost", remote_port, "PING")
 
-    repeat
-      coroutine.yield()
-    until (connector:IsMessageAvailable())
-
     Actions.Log.info(
-      "ping_fiber: received: " .. connector:GetNextMessage()
+      "ping_fiber: received: " .. connector:Receive()
     )
 
-    timer(Actions.Timer.WaitType_NOBLOCK, 1, "s", 1)
-    while timer:IsWaiting() do
-      coroutine.yield()
-    end
+    timer:Sleep(1, "s")
 
   end
 
@@ -53,58 +48,18 @@ function pong_fiber (connector, remote_port)
   -- Connect to a node and send a 'pong' message
   while true do
 
-    repeat
-      coroutine.yield()
-    until (connector:IsMessageAvailable())
-
     Actions.Log.info(
-      "pong_fiber: received: " .. connector:GetNextMessage()
+      "pong_fiber: received: " .. connector:Receive()
     )
 
     connector:Send("localhost", remote_port, "PONG")
 
-    timer(Actions.Timer.WaitType_NOBLOCK, 1, "s", 2)
-    while timer:IsWaiting() do
-      coroutine.yield()
-    end
+    timer:Sleep(1, "s")
 
   end
 
 end
 
--- Coroutine dispatcher (see Section 9.4 of 'Programming in Lua')
-function dispatcher (coroutines)
-
-  local timer = Actions.Timer()
-
-  while true do
-    if next(coroutines) == nil then break end -- no more coroutines to run
-
-    for name, co in pairs(coroutines) do
-      local status, res = coroutine.resume(co)
-
-      if res then -- coroutine has returned a result (i.e. finished)
-
-        if type(res) == "string" then  -- runtime error
-          Actions.Log.critical("Lua coroutine '" .. tostring(name) ..
-                               "' has exited with runtime error " .. res)
-        else
-          Actions.Log.warn("Lua coroutine '" .. tostring(name) .. "' exited")
-        end
-
-        coroutines[name] = nil
-
-        break
-      end
-    end
-
-    -- Run the dispatcher every 1 ms. Note, that a blocking timer is required
-    -- to prevent lua_mesh from consuming 100% of a core.
-    timer(Actions.Timer.WaitType_BLOCK, 1, "ms", 3)
-
-  end
-end
-
 local function main(args)
 
   print("Welcome to Lua Fiber !")
@@ -122,16 +77,10 @@ local function main(args)
   local connector = Actions.Connector(args["port"])
   local remote_port = args["port"] == 7777 and "8888" or "7777"
 
-  -- Create co-routines
-  local coroutines = {}
-  coroutines["ping"] = coroutine.create(ping_fiber)
-  coroutine.resume(coroutines["ping"], connector, remote_port)
-
-  coroutines["pong"] = coroutine.create(pong_fiber)
-  coroutine.resume(coroutines["pong"], connector, remote_port)
-
-  -- Run the main loop
-  dispatcher(coroutines)
+  -- Create the fibers. They are run by the C++ scheduler once this
+  -- function has returned.
+  Fiber.Spawn("ping", ping_fiber, connector, remote_port)
+  Fiber.Spawn("pong", pong_fiber, connector, remote_port)
 
 end
 
@@ -0,0 +1,115 @@
+/**
+ * lua_fiber_timer_bench.cpp
+ *
+ * Measures the cost of the Timer action: creating and destroying timers, and
+ * arming and firing a large number of them at once. All timers share the one
+ * timer service thread (see lua_fiber_timer_service.hpp), so the number of
+ * threads in the process should not grow with the number of timers.
+ *
+ * Usage: lua_fiber_timer_bench [number of timers (default 100000)]
+ *
+ * Copyright © Blu Wireless. All Rights Reserved.
+ * Licensed under the MIT license. See LICENSE file in the project.
+ * Feedback: james.pascoe@bluwireless.com
+ */
+
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include "lua_fiber_action_timer.hpp"
+#include "lua_fiber_log_manager.hpp"
+
+using clock_type = std::chrono::steady_clock;
+
+// The number of threads in this process (from /proc)
+static int thread_count() {
+  std::ifstream status("/proc/self/status");
+
+  for (std::string line; std::getline(status, line);)
+    if (line.rfind("Threads:", 0) == 0)
+      return std::stoi(line.substr(8));
+
+  return -1;
+}
+
+// The CPU time used by all the threads in this process
+static std::chrono::nanoseconds cpu_time() {
+  rusage usage{};
+  getrusage(RUSAGE_SELF, &usage);
+
+  auto to_ns = [](timeval const& tv) {
+    return std::chrono::seconds(tv.tv_sec) +
+           std::chrono::microseconds(tv.tv_usec);
+  };
+
+  return to_ns(usage.ru_utime) + to_ns(usage.ru_stime);
+}
+
+static double ns_per(clock_type::duration elapsed, std::size_t n) {
+  return std::chrono::duration<double, std::nano>(elapsed).count() / n;
+}
+
+int main(int argc, char* argv[]) {
+  std::size_t const num_timers = argc > 1 ? std::stoul(argv[1]) : 100000;
+
+  // The timers log each wait at debug level
+  spdlog::set_level(spdlog::level::warn);
+
+  std::vector<std::unique_ptr<Timer>> timers;
+  timers.reserve(num_timers);
+
+  // Creation (the first timer also starts the service)
+  auto start = clock_type::now();
+  for (std::size_t i = 0; i < num_timers; ++i)
+    timers.push_back(std::make_unique<Timer>());
+  auto created = clock_type::now();
+
+  int const threads = thread_count();
+
+  timers.clear();
+  auto destroyed = clock_type::now();
+
+  std::cout << "timers:  " << num_timers << "\n"
+            << "threads: " << threads << " (with all of the timers alive)\n"
+            << "create:  " << ns_per(created - start, num_timers)
+            << " ns/timer\n"
+            << "destroy: " << ns_per(destroyed - created, num_timers)
+            << " ns/timer\n";
+
+  // Arm every timer, then sleep until they should all have fired, so that
+  // (almost) all of the CPU time used in the meantime is the service firing
+  // them
+  auto const delay = std::chrono::seconds(1);
+
+  for (std::size_t i = 0; i < num_timers; ++i)
+    timers.push_back(std::make_unique<Timer>());
+
+  start = clock_type::now();
+  for (std::size_t i = 0; i < num_timers; ++i)
+    (*timers[i])(Timer::WaitType::NOBLOCK, 1000, "ms", int(i));
+  auto const armed = clock_type::now();
+
+  auto const cpu_before = cpu_time();
+  std::this_thread::sleep_until(armed + delay + std::chrono::milliseconds(200));
+  auto const cpu_after = cpu_time();
+
+  std::size_t fired = 0;
+  for (auto const& timer : timers)
+    fired += timer->HasExpired();
+
+  std::cout << "arm:     " << ns_per(armed - start, num_timers)
+            << " ns/timer\n"
+            << "fire:    " << ns_per(cpu_after - cpu_before, num_timers)
+            << " ns/timer of CPU (" << fired << " of " << num_timers
+            << " fired)\n";
+
+  return fired == num_timers ? EXIT_SUCCESS : EXIT_FAILURE;
+}
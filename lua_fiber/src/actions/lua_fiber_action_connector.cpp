@@ -74,7 +74,9 @@ Connector::ErrorType Connector::Send(std::string const& hostname_or_ip,
 
 // Returns the most recent message (or an empty string if none are available)
 std::string Connector::GetNextMessage(void) {
-  if (!IsMessageAvailable())
+  std::lock_guard lock(m_messagesMutex);
+
+  if (m_messages.empty())
     return "";
 
   std::string ret = m_messages.front();
@@ -89,15 +91,22 @@ void Connector::handle_read(asio::error_code const& error,
                           std::size_t bytes_transferred,
                           tcp_connection::pointer connection) {
   if (!error || error == asio::error::eof) {
-    // Limit the message array to prevent it from growing uncontrollably
-    if (m_messages.size() > max_messages)
-      m_messages.erase(m_messages.begin());
+    {
+      std::lock_guard lock(m_messagesMutex);
+
+      // Limit the message array to prevent it from growing uncontrollably
+      if (m_messages.size() > max_messages)
+        m_messages.erase(m_messages.begin());
 
-    m_messages.emplace_back(connection->data());
+      m_messages.emplace_back(connection->data());
+    }
 
     log_info("Received message ({} bytes): {}",
              bytes_transferred,
              connection->data());
+
+    // Wake any fibers waiting for a message
+    m_waiters.Notify();
   } else
     log_error("Connector read failed: returned error: {}", error.message());
 }
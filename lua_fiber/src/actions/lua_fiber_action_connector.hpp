@@ -13,6 +13,10 @@
 
 #include "asio/asio.hpp"
 
+#include <mutex>
+
+#include "lua_fiber_scheduler.hpp"
+
 class Connector {
 public:
   enum class ErrorType { SUCCESS, RESOLVE_FAILED, CONNECT_FAILED };
@@ -35,11 +39,21 @@ public:
                  std::string const& message);
 
   // Returns whether a message is available to be read
-  bool IsMessageAvailable(void) { return !m_messages.empty(); }
+  bool IsMessageAvailable(void) {
+    std::lock_guard lock(m_messagesMutex);
+    return !m_messages.empty();
+  }
 
   // Returns the most recent message (or an empty string if none are available)
   std::string GetNextMessage(void);
 
+  // Returns the next message, blocking the calling fiber until one arrives.
+  // The blocking is done by the Lua binding (see lua_fiber_actions.i).
+  std::string Receive(void) { return GetNextMessage(); }
+
+  // The fibers waiting in Receive()
+  WaitQueue& Waiters(void) { return m_waiters; }
+
 private:
   using tcp = asio::ip::tcp;
 
@@ -87,6 +101,11 @@ private:
 
   std::thread m_thread;
 
-  // FIFO vector to store received messages
+  // FIFO vector to store received messages. The messages are added by the
+  // I/O thread and read by the behaviour's thread.
+  std::mutex m_messagesMutex;
   std::vector<std::string> m_messages;
+
+  // Notified whenever a message arrives
+  WaitQueue m_waiters;
 };
@@ -1,9 +1,10 @@
 /**
  * lua_fiber_action_timer.cpp
  *
- * The Timer action allows the user to wait for a given duration. Lua simply
- * polls the object to discover whether the timer has fired. The action allows
- * for non-blocking and blocking waits.
+ * The Timer action allows the user to wait for a given duration. Lua either
+ * polls the object to discover whether the timer has fired, or sleeps, which
+ * parks the calling fiber until it has. The action allows for non-blocking
+ * and blocking waits.
  *
  * Copyright © Blu Wireless. All Rights Reserved.
  * Licensed under the MIT license. See LICENSE file in the project.
@@ -12,14 +13,11 @@
 #include "lua_fiber_action_timer.hpp"
 
 #include "lua_fiber_log_manager.hpp"
+#include "lua_fiber_timer_service.hpp"
 
 #include <functional>
 
-Timer::Timer()
-    : m_ctx(),
-      m_timer(m_ctx),
-      m_work(std::make_unique<work>(asio::make_work_guard(m_ctx))),
-      m_workerThread(std::bind(&Timer::threadRoutine, this)) {
+Timer::Timer() : m_timer(TimerService::Instance().Context()) {
   log_trace("New timer initialised.");
 }
 
@@ -29,11 +27,10 @@ Timer::~Timer() {
   if (m_waiting)
     Cancel();
 
-  // Force the work_guard out of scope to allow the io_context to stop
-  m_work.reset();
-
-  // We can now join the worker thread
-  m_workerThread.join();
+  // Wait for the handler of a cancelled (or just expired) wait to finish
+  // on the service's thread before the timer goes away
+  std::unique_lock lock(m_timerMutex);
+  m_handlersDone.wait(lock, [this] { return m_pendingHandlers == 0; });
 }
 
 void Timer::operator()(WaitType const waitType,
@@ -97,6 +94,11 @@ void Timer::operator()(WaitType const waitType,
                 duration,
                 timeUnit);
 
+      {
+        std::lock_guard lock(m_timerMutex);
+        ++m_pendingHandlers;
+      }
+
       m_timer.async_wait(
           std::bind(&Timer::timerHandler, this, std::placeholders::_1));
 
@@ -109,6 +111,12 @@ void Timer::operator()(WaitType const waitType,
   }
 }
 
+// Start a non-blocking wait. The Lua binding parks the calling fiber until
+// the timer stops waiting.
+void Timer::Sleep(int const duration, std::string const& timeUnit) {
+  (*this)(WaitType::NOBLOCK, duration, timeUnit, 0);
+}
+
 unsigned int Timer::Cancel() {
   asio::error_code error;
   auto timersCancelled = m_timer.cancel(error);
@@ -139,26 +147,40 @@ void Timer::timerHandler(asio::error_code const& error) {
 
     cancel();
   }
+
+  // This must be the last use of the timer, which may be destroyed as soon
+  // as the lock is released
+  std::lock_guard lock(m_timerMutex);
+  if (--m_pendingHandlers == 0)
+    m_handlersDone.notify_all();
 }
 
 void Timer::expire() {
   log_debug("Timer {} expired", m_notifyId);
 
-  std::lock_guard lock(m_timerMutex);
+  {
+    std::lock_guard lock(m_timerMutex);
+
+    m_notifyId = 0;
 
-  m_notifyId = 0;
+    m_expired = true;
+    m_waiting = false;
+  }
 
-  m_expired = true;
-  m_waiting = false;
+  m_waiters.Notify();
 }
 
 void Timer::cancel() {
   log_debug("Timer {} cancelled", m_notifyId);
 
-  std::lock_guard lock(m_timerMutex);
+  {
+    std::lock_guard lock(m_timerMutex);
+
+    m_notifyId = 0;
 
-  m_notifyId = 0;
+    m_expired = false;
+    m_waiting = false;
+  }
 
-  m_expired = false;
-  m_waiting = false;
+  m_waiters.Notify();
 }
@@ -1,9 +1,10 @@
 /**
  * bwt_mcm_action_timer.hpp
  *
- * The Timer action allows the user to wait for a given duration. Lua simply
- * polls the object to discover whether the timer has fired. The action allows
- * for non-blocking and blocking waits.
+ * The Timer action allows the user to wait for a given duration. Lua either
+ * polls the object to discover whether the timer has fired, or sleeps, which
+ * parks the calling fiber until it has. The action allows for non-blocking
+ * and blocking waits.
  *
  * Copyright © Blu Wireless. All Rights Reserved.
  * Licensed under the MIT license. See LICENSE file in the project.
@@ -13,9 +14,11 @@
 
 #include "asio/asio.hpp"
 
-#include <memory>
+#include <atomic>
+#include <condition_variable>
 #include <mutex>
-#include <thread>
+
+#include "lua_fiber_scheduler.hpp"
 
 class Timer {
 public:
@@ -42,6 +45,11 @@ public:
                   std::string const& timeUnit,
                   int notifyId);
 
+  // Wait for the given duration, blocking the calling fiber (but not the
+  // other fibers) until the timer fires. The blocking is done by the Lua
+  // binding (see lua_fiber_actions.i).
+  void Sleep(int const duration, std::string const& timeUnit);
+
   // Cancel a running timer
   unsigned int Cancel();
 
@@ -51,34 +59,35 @@ public:
   // Check if the timer has expired
   bool HasExpired() const { return m_expired; }
 
-private:
-  using work = asio::executor_work_guard<asio::io_context::executor_type>;
+  // The fibers waiting in Sleep()
+  WaitQueue& Waiters() { return m_waiters; }
 
-  asio::io_context m_ctx;
+private:
+  // The timer is queued on the process-wide timer service, whose thread
+  // executes the timer handlers (see lua_fiber_timer_service.hpp)
   asio::steady_timer m_timer;
 
-  // This prevents the context's run() call from returning when it has no
-  // handlers to execute and grants us control over when that happens via the
-  // unique_ptr.
-  std::unique_ptr<work> m_work;
-
-  // The thread to execute the timer handlers
-  std::thread m_workerThread;
-
   // Mutex to make sure all timer state transitions are atomic
   std::mutex m_timerMutex;
 
-  // Flag indicating whether the timer is waiting
-  bool m_waiting = false;
+  // The number of waits whose handler has not finished yet. The destructor
+  // waits for this to drop to zero, as the handlers run on the service's
+  // thread and refer to the timer.
+  int m_pendingHandlers = 0;
+  std::condition_variable m_handlersDone;
+
+  // Flag indicating whether the timer is waiting. The flags are set on the
+  // service's thread and read on the behaviour's.
+  std::atomic<bool> m_waiting = false;
 
   // Flag indicating whether the timer has fired
-  bool m_expired = false;
+  std::atomic<bool> m_expired = false;
 
   // Notification ID to return to the caller via the callback
   int m_notifyId = 0;
 
-  // The function the thread will run
-  void threadRoutine() { m_ctx.run(); }
+  // Notified whenever the timer stops waiting (i.e. expires or is cancelled)
+  WaitQueue m_waiters;
 
   // Function to be executed when the timer expires or is cancelled
   void timerHandler(asio::error_code const& error);
@@ -18,9 +18,130 @@
 // Definitions required by the SWIG wrapper to compile
 %{
 #include "lua_fiber_log_manager.hpp"
+#include "lua_fiber_scheduler.hpp"
 #include "lua_fiber_action_log.hpp"
 #include "lua_fiber_action_connector.hpp"
 #include "lua_fiber_action_timer.hpp"
+
+#include <exception>
+#include <string>
+%}
+
+// The blocking calls. Rather than block the thread that runs the
+// behaviour, these park the calling fiber (see lua_fiber_scheduler.hpp)
+// and yield, to be resumed in the continuations below.
+//
+// They are written by hand instead of being wrapped by SWIG. Yielding from
+// a C function longjmps out of it when Lua is built as C, which skips the
+// destructors of its C++ objects (e.g. the std::string for the result of
+// a SWIG wrapper), so none of these may have any alive when they park.
+%wrapper %{
+// Pushes the std::string given as light userdata
+static int PushString(lua_State* L) {
+  auto message = static_cast<std::string const*>(lua_touserdata(L, 1));
+  lua_pushlstring(L, message->data(), message->size());
+  return 1;
+}
+
+// Continuations for the blocking calls. A parked fiber is resumed in one
+// of these once its wait queue has been notified. Wake-ups may be for an
+// event that another fiber has already consumed (e.g. two fibers receiving
+// on one connector), so each checks and parks again if need be.
+static int ResumeReceive(lua_State* L, int, lua_KContext ctx) {
+  auto connector = reinterpret_cast<Connector*>(ctx);
+
+  if (!connector->IsMessageAvailable())
+    return Scheduler::Park(L, connector->Waiters(), ctx, ResumeReceive);
+
+  // The message is pushed in a protected call, so that a Lua error (out
+  // of memory) is only raised once the std::string has gone
+  int status = LUA_OK;
+  {
+    std::string message = connector->Receive();
+    lua_pushcfunction(L, PushString);
+    lua_pushlightuserdata(L, &message);
+    status = lua_pcall(L, 1, 1, 0);
+  }
+
+  if (status != LUA_OK)
+    return lua_error(L);
+
+  return 1;
+}
+
+static int ResumeSleep(lua_State* L, int, lua_KContext ctx) {
+  auto timer = reinterpret_cast<Timer*>(ctx);
+
+  if (timer->IsWaiting())
+    return Scheduler::Park(L, timer->Waiters(), ctx, ResumeSleep);
+
+  return 0;
+}
+
+// connector:Receive() - the next message, once there is one
+static int ConnectorReceive(lua_State* L) {
+  Connector* connector = nullptr;
+  if (!SWIG_IsOK(SWIG_ConvertPtr(L, 1,
+                                 reinterpret_cast<void**>(&connector),
+                                 SWIGTYPE_p_Connector, 0)))
+    return luaL_error(L, "Receive: expected a Connector");
+
+  return ResumeReceive(L, LUA_OK, reinterpret_cast<lua_KContext>(connector));
+}
+
+// timer:Sleep(duration, unit) - returns once the timer has fired
+static int TimerSleep(lua_State* L) {
+  Timer* timer = nullptr;
+  if (!SWIG_IsOK(SWIG_ConvertPtr(L, 1,
+                                 reinterpret_cast<void**>(&timer),
+                                 SWIGTYPE_p_Timer, 0)))
+    return luaL_error(L, "Sleep: expected a Timer");
+
+  int duration = static_cast<int>(luaL_checkinteger(L, 2));
+  char const* unit = luaL_checkstring(L, 3);
+
+  // Nor may an exception leave through Lua
+  bool started = true;
+  try {
+    timer->Sleep(duration, unit);
+  } catch (std::exception const& e) {
+    log_error("Unable to start the timer: {}", e.what());
+    started = false;
+  }
+
+  if (!started)
+    return luaL_error(L, "Sleep: unable to start the timer");
+
+  return ResumeSleep(L, LUA_OK, reinterpret_cast<lua_KContext>(timer));
+}
+
+// Add 'fn' to the methods of SWIG's class 'cls', which are kept in the
+// '.fn' table of the class's metatable
+static void AddMethod(lua_State* L,
+                      char const* cls,
+                      char const* name,
+                      lua_CFunction fn) {
+  SWIG_Lua_get_class_metatable(L, cls);
+  if (lua_istable(L, -1)) {
+    lua_pushstring(L, ".fn");
+    lua_rawget(L, -2);
+    if (lua_istable(L, -1)) {
+      lua_pushcfunction(L, fn);
+      lua_setfield(L, -2, name);
+    }
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 1);
+}
+%}
+
+%native(ConnectorReceive) int ConnectorReceive(lua_State* L);
+%native(TimerSleep) int TimerSleep(lua_State* L);
+
+// ... and as methods, i.e. connector:Receive() and timer:Sleep(1, "s")
+%init %{
+  AddMethod(L, "Connector", "Receive", ConnectorReceive);
+  AddMethod(L, "Timer", "Sleep", TimerSleep);
 %}
 
 // Files to be wrapped by SWIG
@@ -37,6 +158,14 @@
 }
 %enddef
 
+// The wait queues are for the blocking calls, not for Lua
+%ignore Connector::Waiters;
+%ignore Timer::Waiters;
+
+// ... nor are the C++ blocking calls, which the natives above stand in for
+%ignore Connector::Receive;
+%ignore Timer::Sleep;
+
 // Include the actions and define exception handlers
 %exception Connector::Connector CTOR_ERROR;
 %include "lua_fiber_action_connector.hpp"
@@ -0,0 +1,33 @@
+/**
+ * lua_fiber_timer_service.cpp
+ *
+ * The timer service runs the handlers of every Timer action in the process
+ * on a single thread.
+ *
+ * Copyright © Blu Wireless. All Rights Reserved.
+ * Licensed under the MIT license. See LICENSE file in the project.
+ * Feedback: james.pascoe@bluwireless.com
+ */
+#include "lua_fiber_timer_service.hpp"
+
+#include "lua_fiber_log_manager.hpp"
+
+TimerService& TimerService::Instance() {
+  static TimerService service;
+  return service;
+}
+
+TimerService::TimerService()
+    : m_ctx(),
+      m_work(asio::make_work_guard(m_ctx)),
+      m_workerThread([this]() { m_ctx.run(); }) {
+  log_trace("Timer service started");
+}
+
+TimerService::~TimerService() {
+  // Let run() return once the last handler has been executed
+  m_work.reset();
+  m_workerThread.join();
+
+  log_trace("Timer service stopped");
+}
@@ -0,0 +1,49 @@
+/**
+ * lua_fiber_timer_service.hpp
+ *
+ * The timer service runs the handlers of every Timer action in the process
+ * on a single thread. Each Timer only adds an entry to the service's timer
+ * queue (a min-heap ordered by expiry, which ASIO waits on with a timerfd
+ * where it can), so creating one costs no more than the timer itself, and
+ * a behaviour can have as many timers as it has fibers.
+ *
+ * Copyright © Blu Wireless. All Rights Reserved.
+ * Licensed under the MIT license. See LICENSE file in the project.
+ * Feedback: james.pascoe@bluwireless.com
+ */
+#pragma once
+
+#include "asio/asio.hpp"
+
+#include <thread>
+
+class TimerService {
+public:
+  // The service shared by all timers. It is started on first use and
+  // stopped when the process exits.
+  static TimerService& Instance();
+
+  ~TimerService();
+
+  // Do not allow copying or moving the service
+  TimerService(TimerService const&) = delete;
+  TimerService& operator=(TimerService const&) = delete;
+  TimerService(TimerService&&) = delete;
+  TimerService& operator=(TimerService&&) = delete;
+
+  // The context that the timers are created on
+  asio::io_context& Context() { return m_ctx; }
+
+private:
+  using work = asio::executor_work_guard<asio::io_context::executor_type>;
+
+  TimerService();
+
+  asio::io_context m_ctx;
+
+  // Keeps the context's run() call from returning while there are no timers
+  work m_work;
+
+  // The thread to execute the timer handlers
+  std::thread m_workerThread;
+};
@@ -36,6 +36,9 @@ LuaManager::LuaManager() {
 
   // Open the actions library (i.e. the SWIG bindings for the C++ actions)
   luaopen_Actions(lua_state);
+
+  // Make the 'Fiber' library available, so behaviours can spawn fibers
+  scheduler = std::make_unique<Scheduler>(lua_state);
 }
 
 // Constructor to load behaviour
@@ -219,12 +222,15 @@ void LuaManager::RunBehaviour(void) {
   // directory as the behaviour
   SetLuaPackagePath(path_it->second);
 
-  // Call the entry point for the behaviour (this may not return). Note that
-  // there is only ever either 0 or 1 arguments passed to the behaviour.
+  // Call the entry point for the behaviour. Note that there is only ever
+  // either 0 or 1 arguments passed to the behaviour.
   int lua_ret =
       lua_pcall(lua_state, lua_ref_argument_table != LUA_NOREF, LUA_MULTRET, 0);
   if (lua_ret != LUA_OK)
     ProcessLuaError(lua_ret);
+
+  // Run the fibers that the entry point spawned (this may not return)
+  scheduler->Run();
 }
 
 // Process error values returned by Lua calls
@@ -13,12 +13,15 @@
  */
 #pragma once
 
+#include <memory>
 #include <string>
 #include <unordered_map>
 #include <vector>
 
 #include "lua.hpp"
 
+#include "lua_fiber_scheduler.hpp"
+
 class LuaManager {
 public:
   // Constructors
@@ -44,7 +47,7 @@ public:
   // are passed with lua_pushboolean and everything else is passed as a string.
   void ProcessArguments(std::vector<std::string> const& arguments);
 
-  // Runs the loaded behaviour
+  // Runs the loaded behaviour, followed by any fibers that it spawns
   void RunBehaviour();
 
 private:
@@ -75,6 +78,11 @@ private:
   // Provide a mapping between the name of a behaviour and its path
   std::unordered_map<std::string, std::string> behaviour_path;
 
+  // Runs the behaviours' fibers. This outlives the Lua state, as the actions
+  // (which are only destroyed when the state is closed) may still wake the
+  // fibers parked on them.
+  std::unique_ptr<Scheduler> scheduler;
+
   // Process error values returned by Lua calls
   void ProcessLuaError(int lua_ret);
 
@@ -0,0 +1,211 @@
+/**
+ * lua_fiber_scheduler.cpp
+ *
+ * Implementation of the fiber scheduler.
+ *
+ * This file implements the scheduler that runs the behaviours' fibers, plus
+ * the wait queues that the blocking actions park them on.
+ *
+ * Copyright © Blu Wireless. All Rights Reserved.
+ * Licensed under the MIT license. See LICENSE file in the project.
+ * Feedback: james.pascoe@bluwireless.com
+ */
+
+#include <stdexcept>
+#include <string>
+
+#include <lua.hpp>
+
+#include "lua_fiber_log_manager.hpp"
+#include "lua_fiber_scheduler.hpp"
+
+Scheduler::Scheduler(lua_State* L) : lua_state(L) {
+  if (instance)
+    throw std::runtime_error("Only one fiber scheduler may exist at a time");
+
+  instance = this;
+
+  // Fiber = { Spawn = LuaSpawn } (with the scheduler as an upvalue)
+  lua_newtable(lua_state);
+  lua_pushlightuserdata(lua_state, this);
+  lua_pushcclosure(lua_state, &Scheduler::LuaSpawn, 1);
+  lua_setfield(lua_state, -2, "Spawn");
+  lua_setglobal(lua_state, "Fiber");
+}
+
+// The fibers' threads belong to the Lua state, which frees them when it is
+// closed, so there is nothing to release here.
+Scheduler::~Scheduler() {
+  instance = nullptr;
+}
+
+// Run the fibers until they have all exited
+void Scheduler::Run() {
+  while (!fibers.empty()) {
+    // Pick up the fibers that have been woken since the last one ran (and
+    // if none are ready, sleep until one is)
+    TakeWoken(ready.empty());
+
+    Fiber* fiber = ready.front();
+    ready.pop_front();
+
+    Resume(*fiber);
+  }
+}
+
+// Park the fiber running in 'L' on 'queue' and yield
+int Scheduler::Park(lua_State* L,
+                    WaitQueue& queue,
+                    lua_KContext ctx,
+                    lua_KFunction k) {
+  if (!instance)
+    return luaL_error(L, "blocking calls need a fiber scheduler");
+
+  auto fiber_it = instance->fibers.find(L);
+  if (fiber_it == instance->fibers.end())
+    return luaL_error(L, "blocking calls can only be made from a fiber");
+
+  // Set before the fiber is added to the queue, which may wake it straight
+  // away, so that Resume() does not make it ready a second time
+  fiber_it->second->parked = true;
+  queue.Add(*instance, fiber_it->second.get());
+
+  return lua_yieldk(L, 0, ctx, k);
+}
+
+// Fiber.Spawn(name, function, ...) - run 'function(...)' in a new fiber
+int Scheduler::LuaSpawn(lua_State* L) {
+  auto& scheduler =
+      *static_cast<Scheduler*>(lua_touserdata(L, lua_upvalueindex(1)));
+
+  std::string name = luaL_checkstring(L, 1);
+  luaL_checktype(L, 2, LUA_TFUNCTION);
+
+  int nargs = lua_gettop(L) - 2;
+
+  // Create the thread and keep it in the registry until the fiber exits
+  lua_State* thread = lua_newthread(L);
+  int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+  // Move the function and its arguments onto the new thread's stack
+  lua_xmove(L, thread, nargs + 1);
+
+  auto fiber = std::make_unique<Fiber>();
+  fiber->name = name;
+  fiber->thread = thread;
+  fiber->ref = ref;
+  fiber->nargs = nargs;
+
+  scheduler.ready.push_back(fiber.get());
+  scheduler.fibers.emplace(thread, std::move(fiber));
+
+  log_debug("Spawned Lua fiber '{}'", name);
+
+  return 0;
+}
+
+// Make a fiber ready to run again. This may be called from any thread.
+void Scheduler::Wake(Fiber* fiber) {
+  {
+    std::lock_guard lock(woken_mutex);
+    woken.push_back(fiber);
+  }
+
+  woken_cv.notify_one();
+}
+
+// Move the woken fibers to the ready queue, waiting for one if 'block'
+void Scheduler::TakeWoken(bool block) {
+  std::unique_lock lock(woken_mutex);
+
+  if (block)
+    woken_cv.wait(lock, [this] { return !woken.empty(); });
+
+  for (Fiber* fiber : woken) {
+    fiber->parked = false;
+    ready.push_back(fiber);
+  }
+
+  woken.clear();
+}
+
+// Resume a fiber until it yields, parks or exits
+void Scheduler::Resume(Fiber& fiber) {
+  int nresults = 0;
+
+#if LUA_VERSION_NUM >= 504
+  int lua_ret = lua_resume(fiber.thread, lua_state, fiber.nargs, &nresults);
+#else
+  int lua_ret = lua_resume(fiber.thread, lua_state, fiber.nargs);
+  nresults = lua_gettop(fiber.thread);
+#endif
+
+  fiber.nargs = 0;
+
+  switch (lua_ret) {
+    case LUA_YIELD:
+      // Anything passed to coroutine.yield is discarded
+      lua_pop(fiber.thread, nresults);
+
+      // A fiber that called coroutine.yield() simply goes to the back of
+      // the queue. One that is parked waits until it is woken.
+      if (!fiber.parked)
+        ready.push_back(&fiber);
+      break;
+
+    case LUA_OK:
+      log_warn("Lua fiber '{}' exited", fiber.name);
+      Finish(fiber);
+      break;
+
+    default: {
+      char const* error = lua_tostring(fiber.thread, -1);
+      log_critical("Lua fiber '{}' has exited with runtime error {}",
+                   fiber.name,
+                   error ? error : "(error object is not a string)");
+      Finish(fiber);
+      break;
+    }
+  }
+}
+
+// Forget a fiber that has exited (which leaves its thread to be collected)
+void Scheduler::Finish(Fiber& fiber) {
+  luaL_unref(lua_state, LUA_REGISTRYINDEX, fiber.ref);
+  fibers.erase(fiber.thread);
+}
+
+// Wake all of the parked fibers (or the next one to park)
+void WaitQueue::Notify() {
+  std::vector<std::pair<Scheduler*, Scheduler::Fiber*>> to_wake;
+
+  {
+    std::lock_guard lock(mutex);
+
+    if (parked.empty()) {
+      pending = true;
+      return;
+    }
+
+    to_wake.swap(parked);
+  }
+
+  for (auto const& [scheduler, fiber] : to_wake)
+    scheduler->Wake(fiber);
+}
+
+// Park 'fiber', or wake it at once if the queue has already been notified
+void WaitQueue::Add(Scheduler& scheduler, Scheduler::Fiber* fiber) {
+  {
+    std::lock_guard lock(mutex);
+
+    if (!pending) {
+      parked.emplace_back(&scheduler, fiber);
+      return;
+    }
+
+    pending = false;
+  }
+
+  scheduler.Wake(fiber);
+}
@@ -0,0 +1,139 @@
+/**
+ * lua_fiber_scheduler.hpp
+ *
+ * Definition of the fiber scheduler.
+ *
+ * The scheduler runs each fiber in its own Lua thread and resumes the ones
+ * that are ready, one at a time, on the thread that runs the behaviour. A
+ * fiber that makes a blocking call (e.g. connector:Receive()) is parked on
+ * the action's wait queue and yields; it is only resumed once the action
+ * notifies the queue from its own thread (e.g. when a message arrives).
+ * When no fiber is ready, the scheduler sleeps until one is woken, so an
+ * idle behaviour uses no CPU at all.
+ *
+ * Copyright © Blu Wireless. All Rights Reserved.
+ * Licensed under the MIT license. See LICENSE file in the project.
+ * Feedback: james.pascoe@bluwireless.com
+ */
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "lua.hpp"
+
+class WaitQueue;
+
+class Scheduler {
+public:
+  // Makes the 'Fiber' library available to the behaviours run in 'L'
+  explicit Scheduler(lua_State* L);
+
+  ~Scheduler();
+
+  // Disable copy, move and assignment constructors
+  Scheduler(Scheduler const& rhs) = delete;
+  Scheduler(Scheduler&& rhs) = delete;
+  Scheduler& operator=(Scheduler const& rhs) = delete;
+  Scheduler& operator=(Scheduler&& rhs) = delete;
+
+  // Run the fibers until they have all exited. This blocks while none of
+  // them are ready to run.
+  void Run();
+
+  // Park the fiber running in 'L' on 'queue' and yield. When the queue is
+  // notified, the fiber is resumed in 'k' (with 'ctx'), which should check
+  // that what it was waiting for has happened and park again if not. This
+  // must be the return expression of a lua_CFunction (see lua_yieldk), and
+  // one with no C++ objects alive: unless Lua is built as C++, the yield
+  // longjmps out of it without running their destructors.
+  static int Park(lua_State* L,
+                  WaitQueue& queue,
+                  lua_KContext ctx,
+                  lua_KFunction k);
+
+private:
+  friend class WaitQueue;
+
+  struct Fiber {
+    std::string name{};
+    lua_State* thread = nullptr;
+
+    // The registry reference that stops the thread being collected
+    int ref = LUA_NOREF;
+
+    // The number of arguments to pass to the first resume
+    int nargs = 0;
+
+    // Set while the fiber is waiting on a WaitQueue
+    bool parked = false;
+  };
+
+  // The scheduler that Park() hands fibers to
+  inline static Scheduler* instance = nullptr;
+
+  lua_State* lua_state = nullptr;
+
+  // Every fiber that has not exited, by its Lua thread
+  std::unordered_map<lua_State*, std::unique_ptr<Fiber>> fibers;
+
+  // The fibers waiting to be resumed, in order
+  std::deque<Fiber*> ready;
+
+  // Fibers that have been woken (possibly by other threads) but not yet
+  // added to the ready queue
+  std::mutex woken_mutex;
+  std::condition_variable woken_cv;
+  std::vector<Fiber*> woken;
+
+  // Fiber.Spawn(name, function, ...) - run 'function(...)' in a new fiber
+  static int LuaSpawn(lua_State* L);
+
+  // Make a fiber ready to run again. This may be called from any thread.
+  void Wake(Fiber* fiber);
+
+  // Move the woken fibers to the ready queue, waiting for one if 'block'
+  void TakeWoken(bool block);
+
+  // Resume a fiber until it yields, parks or exits
+  void Resume(Fiber& fiber);
+
+  // Forget a fiber that has exited
+  void Finish(Fiber& fiber);
+};
+
+// The fibers parked until something happens. Actions that allow fibers to
+// block have one of these for each thing that can be waited for, and call
+// Notify() when it happens.
+class WaitQueue {
+public:
+  WaitQueue() = default;
+
+  // Disable copy, move and assignment constructors
+  WaitQueue(WaitQueue const& rhs) = delete;
+  WaitQueue(WaitQueue&& rhs) = delete;
+  WaitQueue& operator=(WaitQueue const& rhs) = delete;
+  WaitQueue& operator=(WaitQueue&& rhs) = delete;
+
+  // Wake all of the parked fibers. If there are none, the next fiber to
+  // park is woken straight away instead, as it may have checked for the
+  // event just before it happened. This may be called from any thread.
+  void Notify();
+
+private:
+  friend class Scheduler;
+
+  // Park 'fiber' (or wake it at once, if the queue has been notified since
+  // the last fiber was woken)
+  void Add(Scheduler& scheduler, Scheduler::Fiber* fiber);
+
+  std::mutex mutex;
+  std::vector<std::pair<Scheduler*, Scheduler::Fiber*>> parked;
+  bool pending = false;
+};